@@ -0,0 +1,113 @@
+// Timings of the FFTs in fourier.hpp: batched vs one-by-one transforms
+// of map coefficients; float vs double grids (with the error of float)
+// and float grids transformed with FftPrecision::Double.
+// Usage: bench_fft [grid_size [n_datasets [nthreads]]]
+
+#include <chrono>
+#include <cmath>     // for sqrt
+#include <cstdio>
+#include <cstdlib>   // for atoi
+#include <random>
+#include <gemmi/fourier.hpp>
+#include <gemmi/symmetry.hpp>  // for find_spacegroup_by_name
+
+using namespace gemmi;
+
+template<typename T>
+static FPhiGrid<T> random_f_phi(int n, unsigned seed) {
+  FPhiGrid<T> hkl;
+  hkl.spacegroup = find_spacegroup_by_name("P 1");
+  hkl.unit_cell.set(60, 70, 80, 90, 90, 90);
+  hkl.half_l = true;
+  hkl.axis_order = AxisOrder::XYZ;
+  hkl.set_size_without_checking(n, n, n / 2 + 1);
+  std::mt19937 rng(seed);
+  std::normal_distribution<float> normal;
+  for (std::complex<T>& x : hkl.data)
+    x = std::complex<T>(normal(rng), normal(rng));
+  return hkl;
+}
+
+template<typename Func>
+static double best_of_3(Func func) {
+  double best = 1e99;
+  for (int i = 0; i != 3; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+    best = std::min(best, t.count());
+  }
+  return best;
+}
+
+int main(int argc, char** argv) {
+  int size = argc > 1 ? std::atoi(argv[1]) : 96;
+  int n = argc > 2 ? std::atoi(argv[2]) : 8;
+  int nthreads = argc > 3 ? std::atoi(argv[3]) : 0;
+  std::vector<FPhiGrid<float>> hkls;
+  for (int i = 0; i != n; ++i)
+    hkls.push_back(random_f_phi<float>(size, i));
+  std::printf("%d grids of %d^3, %d thread(s)\n", n, size,
+              resolve_thread_count(nthreads));
+
+  // in both cases the input is copied and all maps are kept
+  double t_loop = best_of_3([&] {
+    std::vector<Grid<float>> maps;
+    for (const FPhiGrid<float>& hkl : hkls)
+      maps.push_back(transform_f_phi_grid_to_map(FPhiGrid<float>(hkl),
+                                                 nthreads));
+  });
+  std::printf("one by one: %8.3f s\n", t_loop);
+
+  double t_batch = best_of_3([&] {
+    std::vector<FPhiGrid<float>> copy = hkls;
+    transform_f_phi_grids_to_maps(std::move(copy), nthreads);
+  });
+  std::printf("batched:    %8.3f s\n", t_batch);
+
+  // the same values in float and double
+  FPhiGrid<double> hkl_d = random_f_phi<double>(size, 0);
+  std::printf("%d^3 grid, float vs double\n", size);
+  Grid<float> map_f;
+  Grid<double> map_d;
+  double t_f = best_of_3([&] {
+    map_f = transform_f_phi_grid_to_map(FPhiGrid<float>(hkls[0]), nthreads);
+  });
+  double t_d = best_of_3([&] {
+    map_d = transform_f_phi_grid_to_map(FPhiGrid<double>(hkl_d), nthreads);
+  });
+  double t_fd = best_of_3([&] {
+    transform_f_phi_grid_to_map(FPhiGrid<float>(hkls[0]), nthreads,
+                                FftPrecision::Double);
+  });
+  std::printf("hkl->map:   float %8.3f s, double %8.3f s, "
+              "float/Double %8.3f s\n", t_f, t_d, t_fd);
+  FPhiGrid<float> back_f;
+  FPhiGrid<double> back_d;
+  t_f = best_of_3([&] {
+    back_f = transform_map_to_f_phi(map_f, true, nthreads);
+  });
+  t_d = best_of_3([&] {
+    back_d = transform_map_to_f_phi(map_d, true, nthreads);
+  });
+  t_fd = best_of_3([&] {
+    transform_map_to_f_phi(map_f, true, nthreads, FftPrecision::Double);
+  });
+  std::printf("map->hkl:   float %8.3f s, double %8.3f s, "
+              "float/Double %8.3f s\n", t_f, t_d, t_fd);
+  double sum_d2 = 0, sum_x2 = 0;
+  for (size_t i = 0; i != map_d.data.size(); ++i) {
+    double d = map_f.data[i] - map_d.data[i];
+    sum_d2 += d * d;
+    sum_x2 += map_d.data[i] * map_d.data[i];
+  }
+  std::printf("float error (relative rms): %.2g one pass",
+              std::sqrt(sum_d2 / sum_x2));
+  sum_d2 = sum_x2 = 0;
+  for (size_t i = 0; i != back_d.data.size(); ++i) {
+    sum_d2 += std::norm(std::complex<double>(back_f.data[i]) - back_d.data[i]);
+    sum_x2 += std::norm(back_d.data[i]);
+  }
+  std::printf(", %.2g roundtrip\n", std::sqrt(sum_d2 / sum_x2));
+  return 0;
+}
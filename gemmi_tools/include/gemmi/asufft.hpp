@@ -0,0 +1,179 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Fourier transform of map coefficients that calculates the map only
+// in a slab of the unit cell containing the asymmetric unit.
+
+#ifndef GEMMI_ASUFFT_HPP_
+#define GEMMI_ASUFFT_HPP_
+
+#include <algorithm>    // for min, max
+#include <array>
+#include <cmath>        // for NAN
+#include <complex>
+#include <mutex>
+#include <utility>      // for pair
+#include <vector>
+#include "fourier.hpp"  // for FPhiGrid, pocketfft
+#include "grid.hpp"     // for Grid, GridOp, modulo
+#include "threads.hpp"  // for parallel_for
+#include "fail.hpp"     // for fail
+
+namespace gemmi {
+
+// Map stored only for sections [0, length) along one axis. The slab
+// contains at least one copy of each symmetry-equivalent point; values
+// of other points are taken from symmetry mates.
+template<typename T>
+struct SlabMap {
+  UnitCell unit_cell;
+  const SpaceGroup* spacegroup = nullptr;
+  int nu = 0, nv = 0, nw = 0;  // size of the full-cell grid
+  int axis = 0;                // 0, 1 or 2 (u, v or w)
+  int length = 0;              // number of sections stored along axis
+  std::vector<T> data;         // in XYZ order, with length points along axis
+  std::vector<GridOp> ops;     // from Grid::get_scaled_ops_except_id()
+
+  std::array<int, 3> stored_size() const {
+    return {{axis == 0 ? length : nu, axis == 1 ? length : nv,
+             axis == 2 ? length : nw}};
+  }
+  size_t index_q(int u, int v, int w) const {
+    std::array<int, 3> s = stored_size();
+    return ((size_t) w * s[1] + v) * s[0] + u;
+  }
+
+  // u, v, w can be any integers (they are wrapped to the unit cell)
+  T get_value(int u, int v, int w) const {
+    std::array<int, 3> p = {{modulo(u, nu), modulo(v, nv), modulo(w, nw)}};
+    if (p[axis] < length)
+      return data[index_q(p[0], p[1], p[2])];
+    for (const GridOp& op : ops) {
+      std::array<int, 3> t = op.apply(p[0], p[1], p[2]);
+      t = {{modulo(t[0], nu), modulo(t[1], nv), modulo(t[2], nw)}};
+      if (t[axis] < length)
+        return data[index_q(t[0], t[1], t[2])];
+    }
+    return (T) NAN;  // not reached if the slab was from find_asu_slab()
+  }
+
+  Grid<T> expand(int nthreads=0) const {
+    Grid<T> grid;
+    grid.unit_cell = unit_cell;
+    grid.spacegroup = spacegroup;
+    grid.set_size_without_checking(nu, nv, nw);
+    parallel_for(0, nw, nthreads, [&](int w_begin, int w_end) {
+      for (int w = w_begin; w != w_end; ++w)
+        for (int v = 0; v != nv; ++v)
+          for (int u = 0; u != nu; ++u)
+            grid.data[grid.index_q(u, v, w)] = get_value(u, v, w);
+    });
+    return grid;
+  }
+};
+
+// Returns (axis, length) of the thinnest slab [0, length) along one of
+// the given axes that contains a symmetry mate of every grid point.
+inline std::pair<int, int> find_asu_slab(const SpaceGroup* sg,
+                                         int nu, int nv, int nw,
+                                         std::vector<int> axes={0, 1, 2},
+                                         int nthreads=0) {
+  if (axes.empty())
+    fail("find_asu_slab: no axes");
+  const int n[3] = {nu, nv, nw};
+  if (!sg)
+    return std::make_pair(axes[0], n[axes[0]]);
+  Grid<signed char> meta;  // only for get_scaled_ops_except_id()
+  meta.spacegroup = sg;
+  meta.nu = nu, meta.nv = nv, meta.nw = nw;
+  std::vector<GridOp> ops = meta.get_scaled_ops_except_id();
+  // Needed length along axis a: max over points of the smallest a-th
+  // coordinate among their symmetry mates, plus one. It depends only on
+  // coordinates that contribute to the a-th coordinate of mates, so other
+  // coordinates are kept at 0 (usually it makes a 1D or 2D search).
+  std::array<int, 3> needed = {{0, 0, 0}};
+  for (int a : axes) {
+    int lim[3] = {1, 1, 1};
+    lim[a] = n[a];
+    for (const GridOp& op : ops)
+      for (int j = 0; j != 3; ++j)
+        if (op.scaled_op.rot[a][j] != 0)
+          lim[j] = n[j];
+    std::mutex mutex;
+    parallel_for(0, lim[2], nthreads, [&](int w_begin, int w_end) {
+      int local = 0;
+      for (int w = w_begin; w != w_end; ++w)
+        for (int v = 0; v != lim[1]; ++v)
+          for (int u = 0; u != lim[0]; ++u) {
+            const int p[3] = {u, v, w};
+            int low = p[a];
+            // points with a mate within the length found so far are skipped
+            for (auto op = ops.begin(); op != ops.end() && low >= local; ++op)
+              low = std::min(low, modulo(op->apply(u, v, w)[a], n[a]));
+            local = std::max(local, low + 1);
+          }
+      std::lock_guard<std::mutex> lock(mutex);
+      needed[a] = std::max(needed[a], local);
+    });
+  }
+  std::pair<int, int> best(axes[0], needed[axes[0]]);
+  for (int a : axes)
+    if ((double) needed[a] / n[a] < (double) best.second / n[best.first])
+      best = std::make_pair(a, needed[a]);
+  return best;
+}
+
+// Like transform_f_phi_grid_to_map(), but the map is calculated only in
+// a slab containing the asymmetric unit. hkl must have half_l=true and
+// XYZ axis order. The transform along the slab axis (u or v) is done
+// first, so that the other two passes operate only on the slab: with
+// a slab of 1/m-th of the cell the cost is ~(1 + 2/m)/3 of the full FFT
+// and the output is m times smaller. The content of hkl is overwritten.
+template<typename T>
+SlabMap<T> transform_f_phi_grid_to_asu_map(FPhiGrid<T>&& hkl,
+                                           int nthreads=0) {
+  if (!hkl.half_l || hkl.axis_order != AxisOrder::XYZ)
+    fail("transform_f_phi_grid_to_asu_map: expected half_l grid, XYZ order");
+  size_t nt = (size_t) resolve_thread_count(nthreads);
+  SlabMap<T> map;
+  map.unit_cell = hkl.unit_cell;
+  map.spacegroup = hkl.spacegroup;
+  map.nu = hkl.nu;
+  map.nv = hkl.nv;
+  map.nw = 2 * (hkl.nw - 1);
+  check_grid_factors(map.spacegroup, map.nu, map.nv, map.nw);
+  // w is the half-complex axis, transformed last
+  std::pair<int, int> slab = find_asu_slab(map.spacegroup, map.nu, map.nv,
+                                           map.nw, {0, 1}, nthreads);
+  map.axis = slab.first;
+  map.length = slab.second;
+  if (map.spacegroup) {
+    Grid<signed char> meta;
+    meta.spacegroup = map.spacegroup;
+    meta.nu = map.nu, meta.nv = map.nv, meta.nw = map.nw;
+    map.ops = meta.get_scaled_ops_except_id();
+  }
+  for (std::complex<T>& x : hkl.data)
+    x.imag(-x.imag());
+  std::ptrdiff_t s = sizeof(T);
+  pocketfft::stride_t stride{2*s * hkl.nv * hkl.nu, 2*s * hkl.nu, 2*s};
+  size_t first_axis = map.axis == 0 ? 2 : 1;  // pocketfft axes are w, v, u
+  size_t second_axis = map.axis == 0 ? 1 : 2;
+  pocketfft::shape_t shape{(size_t)hkl.nw, (size_t)hkl.nv, (size_t)hkl.nu};
+  T norm = T(1.0 / hkl.unit_cell.volume);
+  pocketfft::c2c<T>(shape, stride, stride, {first_axis}, pocketfft::BACKWARD,
+                    &hkl.data[0], &hkl.data[0], norm, nt);
+  // from now on only the slab part of hkl is used
+  std::array<int, 3> size = map.stored_size();
+  shape = {(size_t)hkl.nw, (size_t)size[1], (size_t)size[0]};
+  pocketfft::c2c<T>(shape, stride, stride, {second_axis}, pocketfft::BACKWARD,
+                    &hkl.data[0], &hkl.data[0], T(1), nt);
+  map.data.resize((size_t) size[0] * size[1] * size[2]);
+  pocketfft::stride_t stride_out{size[1] * size[0] * s, size[0] * s, s};
+  shape[0] = (size_t) map.nw;
+  pocketfft::c2r<T>(shape, stride, stride_out, 0, pocketfft::BACKWARD,
+                    &hkl.data[0], &map.data[0], T(1), nt);
+  return map;
+}
+
+} // namespace gemmi
+#endif
@@ -0,0 +1,322 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Connected-component labelling of thresholded grids (blob search),
+// with periodic boundaries and optional merging of symmetry mates.
+
+#ifndef GEMMI_BLOBS_HPP_
+#define GEMMI_BLOBS_HPP_
+
+#include <algorithm>    // for min, max
+#include <array>
+#include <limits>       // for numeric_limits
+#include <vector>
+#include "grid.hpp"     // for Grid, GridOp, modulo
+#include "unitcell.hpp" // for Position, Fractional
+#include "threads.hpp"  // for parallel_for, parallel_for_dynamic
+#include "fail.hpp"     // for fail
+
+namespace gemmi {
+
+struct Blob {
+  int label;              // value of this blob in the labels grid
+  size_t point_count = 0;
+  double volume = 0.;     // in A^3
+  double sum = 0.;        // sum of the values
+  double peak_value = 0.;
+  Position peak_pos;
+  Position centroid;      // unweighted
+  // bounding box in grid coordinates; it can extend beyond [0, n) if the
+  // blob crosses the cell boundary
+  std::array<int, 3> box_min;
+  std::array<int, 3> box_max;
+};
+
+namespace impl {
+
+// union-find where the root is the smallest index in the set
+inline int uf_find(int* parent, int x) {
+  while (parent[x] != x) {
+    parent[x] = parent[parent[x]];
+    x = parent[x];
+  }
+  return x;
+}
+
+inline void uf_union(int* parent, int a, int b) {
+  a = uf_find(parent, a);
+  b = uf_find(parent, b);
+  if (a < b)
+    parent[b] = a;
+  else if (b < a)
+    parent[a] = b;
+}
+
+} // namespace impl
+
+// Finds 6-connected regions of points with value > threshold.
+// Connectivity is periodic (the grid must cover the unit cell).
+// If use_symmetry is set, regions that are symmetry mates are assigned
+// the same label and statistics are calculated for one copy only.
+// Points below threshold have label -1.
+//
+// Labelling is done in parallel on slabs of sections; only the merging
+// of slab boundaries and of symmetry mates (both on compacted slab-local
+// components, not on points) is serial. Statistics are calculated in
+// parallel over blobs. The centroid and box are in unwrapped coordinates
+// of the blob (along its spanning tree); for a blob that is connected to
+// its own periodic image they are not well defined.
+template<typename T>
+std::vector<Blob> find_blobs(const Grid<T>& grid, double threshold,
+                             Grid<int>& labels, bool use_symmetry=true,
+                             int nthreads=0) {
+  const int nu = grid.nu, nv = grid.nv, nw = grid.nw;
+  if (grid.data.empty())
+    fail("find_blobs: grid not set up");
+  // labels are also used as point indices
+  if (grid.data.size() > (size_t) std::numeric_limits<int>::max())
+    fail("find_blobs: grid too big (more than 2^31 points)");
+  labels.unit_cell = grid.unit_cell;
+  labels.spacegroup = grid.spacegroup;
+  labels.set_size_without_checking(nu, nv, nw);
+  int* lab = labels.data.data();
+  nthreads = resolve_thread_count(nthreads);
+  const int nslabs = std::min(nw, nthreads);
+  auto slab_begin = [&](int s) { return int((long long) s * nw / nslabs); };
+
+  // 1. union-find within each slab; the root is the smallest index
+  std::vector<int> root_count(nslabs, 0);
+  parallel_for(0, nslabs, nslabs, [&](int s_begin, int s_end) {
+    for (int s = s_begin; s != s_end; ++s) {
+      int wb = slab_begin(s), we = slab_begin(s + 1);
+      for (int w = wb; w != we; ++w)
+        for (int v = 0; v != nv; ++v)
+          for (int u = 0; u != nu; ++u) {
+            int idx = grid.index_q(u, v, w);
+            if (!(grid.data[idx] > threshold)) {
+              lab[idx] = -1;
+              continue;
+            }
+            lab[idx] = idx;
+            if (u != 0 && lab[idx - 1] >= 0)
+              impl::uf_union(lab, idx, idx - 1);
+            if (u == nu - 1 && lab[idx - u] >= 0)
+              impl::uf_union(lab, idx, idx - u);
+            if (v != 0 && lab[idx - nu] >= 0)
+              impl::uf_union(lab, idx, idx - nu);
+            if (v == nv - 1 && lab[idx - v * nu] >= 0)
+              impl::uf_union(lab, idx, idx - v * nu);
+            if (w != wb && lab[idx - nu * nv] >= 0)
+              impl::uf_union(lab, idx, idx - nu * nv);
+          }
+      // flatten and count slab-local components
+      int n = 0;
+      int end = grid.index_q(0, 0, we);
+      for (int idx = grid.index_q(0, 0, wb); idx != end; ++idx)
+        if (lab[idx] >= 0) {
+          lab[idx] = impl::uf_find(lab, idx);
+          if (lab[idx] == idx)
+            ++n;
+        }
+      root_count[s] = n;
+    }
+  });
+
+  // 2. replace point indices with compact ids of slab-local components;
+  // roots precede other points of their component, so they get ids first
+  std::vector<int> offsets(nslabs + 1, 0);
+  for (int s = 0; s != nslabs; ++s)
+    offsets[s + 1] = offsets[s] + root_count[s];
+  const int n_local = offsets[nslabs];
+  std::vector<int> root_point(n_local);
+  parallel_for(0, nslabs, nslabs, [&](int s_begin, int s_end) {
+    for (int s = s_begin; s != s_end; ++s) {
+      int id = offsets[s];
+      int end = grid.index_q(0, 0, slab_begin(s + 1));
+      for (int idx = grid.index_q(0, 0, slab_begin(s)); idx != end; ++idx)
+        if (lab[idx] >= 0) {
+          if (lab[idx] == idx) {
+            root_point[id] = idx;
+            lab[idx] = id++;
+          } else {
+            lab[idx] = lab[lab[idx]];
+          }
+        }
+    }
+  });
+
+  // 3. merge components across slab boundaries (and across w = 0)
+  std::vector<int> comp_parent(n_local);
+  for (int i = 0; i != n_local; ++i)
+    comp_parent[i] = i;
+  if (nw > 1)
+    for (int s = 0; s != nslabs; ++s) {
+      int w = slab_begin(s);
+      int w_prev = w == 0 ? nw - 1 : w - 1;
+      for (int v = 0; v != nv; ++v)
+        for (int u = 0; u != nu; ++u) {
+          int a = lab[grid.index_q(u, v, w)];
+          int b = lab[grid.index_q(u, v, w_prev)];
+          if (a >= 0 && b >= 0)
+            impl::uf_union(comp_parent.data(), a, b);
+        }
+    }
+  // spatial components, numbered 0..n_comp-1
+  std::vector<int> comp_of(n_local);
+  int n_comp = 0;
+  for (int i = 0; i != n_local; ++i) {
+    int r = impl::uf_find(comp_parent.data(), i);
+    comp_of[i] = r == i ? n_comp++ : comp_of[r];
+  }
+  std::vector<int> comp_ref(n_comp);  // reference point for unwrapping
+  for (int i = n_local - 1; i >= 0; --i)
+    comp_ref[comp_of[i]] = root_point[i];
+
+  // 4. group symmetry-related components
+  std::vector<int> group(n_comp);
+  for (int i = 0; i != n_comp; ++i)
+    group[i] = i;
+  if (use_symmetry && grid.spacegroup && grid.spacegroup->number != 1) {
+    std::vector<GridOp> ops = grid.get_scaled_ops_except_id();
+    std::vector<std::vector<std::pair<int,int>>> pairs(nslabs);
+    parallel_for(0, nslabs, nslabs, [&](int s_begin, int s_end) {
+      for (int s = s_begin; s != s_end; ++s) {
+        std::vector<std::pair<int,int>>& out = pairs[s];
+        std::vector<std::pair<int,int>> last(ops.size(), {-1, -1});
+        for (int w = slab_begin(s); w != slab_begin(s + 1); ++w)
+          for (int v = 0; v != nv; ++v)
+            for (int u = 0; u != nu; ++u) {
+              int c = lab[grid.index_q(u, v, w)];
+              if (c < 0)
+                continue;
+              c = comp_of[c];
+              for (size_t k = 0; k != ops.size(); ++k) {
+                std::array<int, 3> t = ops[k].apply(u, v, w);
+                int m = lab[grid.index_n(t[0], t[1], t[2])];
+                if (m < 0)
+                  continue;
+                std::pair<int,int> p(c, comp_of[m]);
+                if (p.first != p.second && p != last[k])
+                  out.push_back(last[k] = p);
+              }
+            }
+      }
+    });
+    for (const std::vector<std::pair<int,int>>& v : pairs)
+      for (const std::pair<int,int>& p : v)
+        impl::uf_union(group.data(), p.first, p.second);
+  }
+  std::vector<Blob> blobs;
+  std::vector<int> blob_of(n_comp, -1);
+  for (int c = 0; c != n_comp; ++c) {
+    int g = impl::uf_find(group.data(), c);
+    if (g == c) {
+      blob_of[c] = (int) blobs.size();
+      blobs.emplace_back();
+      blobs.back().label = blob_of[c];
+    } else {
+      blob_of[c] = blob_of[g];
+    }
+  }
+
+  // 5. statistics (for the group representative only), calculated during
+  // breadth-first traversal of each component that unwraps the coordinates
+  // along the traversal tree, so that blobs can be bigger than half the cell
+  parallel_for(0, nw, nthreads, [&](int w_begin, int w_end) {
+    int end = grid.index_q(0, 0, w_end);
+    for (int idx = grid.index_q(0, 0, w_begin); idx != end; ++idx)
+      if (lab[idx] >= 0)
+        lab[idx] = comp_of[lab[idx]];
+  });
+  struct Acc {
+    size_t n = 0;
+    double sum = 0, su = 0, sv = 0, sw = 0, peak = 0;
+    std::array<int, 3> peak_at, lo, hi;
+  };
+  std::vector<Acc> total(blobs.size());
+  std::vector<int> reps;
+  for (int c = 0; c != n_comp; ++c)
+    if (group[c] == c)
+      reps.push_back(c);
+  // only points of component c are visited by the thread that handles c
+  std::vector<char> visited(grid.data.size(), 0);
+  const int chunk = 64;
+  int n_chunks = ((int) reps.size() + chunk - 1) / chunk;
+  parallel_for_dynamic(n_chunks, nthreads, [&](int ch) {
+    static const int steps[6][3] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0},
+                                    {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+    std::vector<std::array<int, 3>> queue;
+    int r_end = std::min((ch + 1) * chunk, (int) reps.size());
+    for (int r = ch * chunk; r != r_end; ++r) {
+      int c = reps[r];
+      Acc& a = total[blob_of[c]];
+      int ref = comp_ref[c];
+      queue.clear();
+      queue.push_back({{ref % nu, ref / nu % nv, ref / (nu * nv)}});
+      visited[ref] = 1;
+      for (size_t q = 0; q != queue.size(); ++q) {
+        std::array<int, 3> p = queue[q];
+        int idx = grid.index_q(modulo(p[0], nu), modulo(p[1], nv),
+                               modulo(p[2], nw));
+        double value = grid.data[idx];
+        if (a.n == 0 || value > a.peak) {
+          a.peak = value;
+          a.peak_at = p;
+        }
+        for (int i = 0; i != 3; ++i) {
+          a.lo[i] = a.n == 0 ? p[i] : std::min(a.lo[i], p[i]);
+          a.hi[i] = a.n == 0 ? p[i] : std::max(a.hi[i], p[i]);
+        }
+        ++a.n;
+        a.sum += value;
+        a.su += p[0];
+        a.sv += p[1];
+        a.sw += p[2];
+        for (const int* step : steps) {
+          std::array<int, 3> t = {{p[0] + step[0], p[1] + step[1],
+                                   p[2] + step[2]}};
+          int t_idx = grid.index_q(modulo(t[0], nu), modulo(t[1], nv),
+                                   modulo(t[2], nw));
+          if (lab[t_idx] == c && !visited[t_idx]) {
+            visited[t_idx] = 1;
+            queue.push_back(t);
+          }
+        }
+      }
+    }
+  });
+  // final labels
+  parallel_for(0, nw, nthreads, [&](int w_begin, int w_end) {
+    int end = grid.index_q(0, 0, w_end);
+    for (int idx = grid.index_q(0, 0, w_begin); idx != end; ++idx)
+      if (lab[idx] >= 0)
+        lab[idx] = blob_of[lab[idx]];
+  });
+
+  const double point_volume = grid.unit_cell.volume / grid.point_count();
+  auto to_position = [&](double x, double y, double z) {
+    return grid.unit_cell.orthogonalize(Fractional(x / nu, y / nv, z / nw));
+  };
+  for (int c : reps) {
+    const Acc& a = total[blob_of[c]];
+    Blob& blob = blobs[blob_of[c]];
+    blob.point_count = a.n;
+    blob.volume = a.n * point_volume;
+    blob.sum = a.sum;
+    blob.peak_value = a.peak;
+    blob.peak_pos = to_position(a.peak_at[0], a.peak_at[1], a.peak_at[2]);
+    blob.centroid = to_position(a.su / a.n, a.sv / a.n, a.sw / a.n);
+    blob.box_min = a.lo;
+    blob.box_max = a.hi;
+  }
+  return blobs;
+}
+
+template<typename T>
+std::vector<Blob> find_blobs(const Grid<T>& grid, double threshold,
+                             bool use_symmetry=true, int nthreads=0) {
+  Grid<int> labels;
+  return find_blobs(grid, threshold, labels, use_symmetry, nthreads);
+}
+
+} // namespace gemmi
+#endif
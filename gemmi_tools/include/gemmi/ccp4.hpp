@@ -6,19 +6,31 @@
 #define GEMMI_CCP4_HPP_
 
 #include <cassert>
-#include <cmath>     // for NAN, sqrt
+#include <cmath>     // for NAN, INFINITY, sqrt, floor, ceil
 #include <cstdint>   // for uint16_t, uint32_t
-#include <cstdio>    // for FILE
+#include <cstdio>    // for FILE, snprintf
 #include <cstring>   // for memcpy
+#include <cstddef>   // for ptrdiff_t
+#include <cstdlib>   // for strtod
+#include <algorithm> // for min, max, min_element, max_element
 #include <array>
+#include <future>    // for async, future
+#include <limits>    // for numeric_limits
+#include <memory>    // for shared_ptr
+#include <mutex>
 #include <string>
 #include <typeinfo>  // for typeid
+#include <type_traits> // for is_floating_point
 #include <vector>
 #include "symmetry.hpp"
 #include "fail.hpp"      // for fail
 #include "fileutil.hpp"  // for file_open, is_little_endian, ...
 #include "input.hpp"     // for FileStream
 #include "grid.hpp"
+#include "gzindex.hpp"   // for impl::gzip_member
+#include "mmap.hpp"      // for map_grid_data, MapAccess
+#include "threads.hpp"   // for parallel_for, ordered_pipeline
+#include "util.hpp"      // for iends_with
 
 namespace gemmi {
 
@@ -39,6 +51,11 @@ struct Ccp4 {
   // stores raw headers if the grid was read from ccp4 map
   std::vector<int32_t> ccp4_header;
   bool same_byte_order = true;
+  // Quantized maps (modes 0 and 1, T floating-point): integers q are stored
+  // and value = quant_offset + quant_scale * q. Non-zero quant_scale is
+  // written to (and read from) a header label "GEMMI QUANT scale offset".
+  double quant_scale = 0.;
+  double quant_offset = 0.;
 
   // methods to access info from ccp4 headers, w is word number from the spec
   void* header_word(int w) { return &ccp4_header.at(w - 1); }
@@ -131,6 +148,15 @@ struct Ccp4 {
     }
     assert(ccp4_header.size() >= 256);
     set_header_i32(4, mode);
+    if (quantized(mode)) {
+      // statistics of the stored integers, as other programs expect
+      set_header_float(20, float((hstats.dmin - quant_offset) / quant_scale));
+      set_header_float(21, float((hstats.dmax - quant_offset) / quant_scale));
+      set_header_float(22, float((hstats.dmean - quant_offset) / quant_scale));
+      set_header_float(55, float(hstats.rms / quant_scale));
+      set_quantization_label();
+      return;
+    }
     set_header_float(20, (float) hstats.dmin);
     set_header_float(21, (float) hstats.dmax);
     set_header_float(22, (float) hstats.dmean);
@@ -138,6 +164,85 @@ struct Ccp4 {
     // labels could be modified but it's not important
   }
 
+  bool quantized(int mode) const {
+    return quant_scale != 0 && (mode == 0 || mode == 1) &&
+           std::is_floating_point<T>::value;
+  }
+
+  // Sets quant_scale and quant_offset for mode 0 or 1 so that [lo, hi]
+  // is mapped to the whole range of integers; values outside are clipped.
+  void set_quantization(int mode, double lo, double hi) {
+    if (mode != 0 && mode != 1)
+      fail("Quantization is possible only in modes 0 and 1.");
+    if (!(hi > lo))
+      hi = lo + 1.;
+    double qmin = mode == 0 ? -128 : -32768;
+    double qmax = mode == 0 ? 127 : 32767;
+    quant_scale = (hi - lo) / (qmax - qmin);
+    quant_offset = lo - qmin * quant_scale;
+  }
+
+  // Quantization of the range dmean +/- sigma_range * rms, limited to
+  // [dmin, dmax] of the data; sigma_range <= 0 means [dmin, dmax].
+  // The error of each value within the range is up to quant_scale / 2.
+  void set_quantization_from_stats(int mode, double sigma_range=0.) {
+    hstats = calculate_data_statistics(grid.data);
+    double lo = hstats.dmin;
+    double hi = hstats.dmax;
+    if (sigma_range > 0) {
+      lo = std::max(lo, hstats.dmean - sigma_range * hstats.rms);
+      hi = std::min(hi, hstats.dmean + sigma_range * hstats.rms);
+    }
+    set_quantization(mode, lo, hi);
+  }
+
+  // labels: NLABL in word 56, then ten 80-character labels
+  int quantization_label_index() const {
+    int n = std::min(std::max(header_i32(56), 0), 10);
+    for (int i = 0; i != n; ++i)
+      if (header_str(57 + 20 * i, 12) == "GEMMI QUANT ")
+        return i;
+    return -1;
+  }
+
+  void set_quantization_label() {
+    int n = std::min(std::max(header_i32(56), 0), 10);
+    int idx = quantization_label_index();
+    if (idx < 0) {
+      idx = std::min(n, 9);
+      set_header_i32(56, idx + 1);
+    }
+    char buf[81];
+    std::snprintf(buf, 81, "GEMMI QUANT %.17g %.17g",
+                  quant_scale, quant_offset);
+    std::string label(buf);
+    label.resize(80, ' ');
+    set_header_str(57 + 20 * idx, label);
+  }
+
+  void read_quantization_label() {
+    quant_scale = quant_offset = 0.;
+    int mode = header_i32(4);
+    if ((mode != 0 && mode != 1) || !std::is_floating_point<T>::value)
+      return;
+    int idx = quantization_label_index();
+    if (idx < 0)
+      return;
+    std::string label = header_str(57 + 20 * idx);
+    const char* start = label.c_str() + 12;
+    char* end;
+    double scale = std::strtod(start, &end);
+    double offset = std::strtod(end, nullptr);
+    if (scale == 0 || !std::isfinite(scale) || !std::isfinite(offset))
+      return;
+    quant_scale = scale;
+    quant_offset = offset;
+    hstats.dmin = quant_offset + quant_scale * hstats.dmin;
+    hstats.dmax = quant_offset + quant_scale * hstats.dmax;
+    hstats.dmean = quant_offset + quant_scale * hstats.dmean;
+    hstats.rms = std::fabs(quant_scale) * hstats.rms;
+  }
+
   bool full_cell() const {
     if (ccp4_header.empty())
       return true; // assuming it's full cell
@@ -169,7 +274,7 @@ struct Ccp4 {
   }
 
   template<typename Stream>
-  void read_ccp4_header(Stream f, const std::string& path) {
+  void read_ccp4_header(Stream& f, const std::string& path) {
     const size_t hsize = 256;
     ccp4_header.resize(hsize);
     if (!f.read(ccp4_header.data(), 4 * hsize))
@@ -203,6 +308,7 @@ struct Ccp4 {
     hstats.dmax = header_float(21);
     hstats.dmean = header_float(22);
     hstats.rms = header_float(55);
+    read_quantization_label();
     grid.spacegroup = find_spacegroup_by_number(header_i32(23));
     auto pos = axis_positions();
     grid.axis_order = AxisOrder::Unknown;
@@ -210,27 +316,165 @@ struct Ccp4 {
       grid.axis_order = AxisOrder::XYZ;
   }
 
-  double setup(GridSetup mode, T default_value);
+  // nthreads <= 0 means the default (see set_default_thread_count()).
+  // The data is copied to a new vector, in parallel, in blocks of 16^3.
+  // With low_memory, maps that have each point of the new grid once
+  // (always in ReorderOnly mode) are permuted in place instead: no second
+  // copy of the data is allocated, but it's done by one thread and is
+  // several times slower.
+  double setup(GridSetup mode, T default_value, int nthreads=0,
+               bool low_memory=false);
+
+  // reads values stored in the file as given by MODE, converting them to T
+  // (and dequantizing them, see quant_scale); buffer is for reuse between
+  // calls, see impl::read_data()
+  template<typename Stream, typename Vec>
+  void read_ccp4_values(Stream& f, Vec& content,
+                        std::vector<char>* buffer=nullptr) const;
+
+  template<typename Stream>
+  void read_ccp4_data(Stream& f);
+
+  // Reads (after the header) only the data needed for grid points in the box
+  // [lo, hi] of fractional coordinates. Along axes that cover the whole cell
+  // the box may extend beyond the cell (values are wrapped), along other
+  // axes it is clipped to the map. The grid then contains the box in the
+  // file axis order and the header (NX, NY, NZ, NXSTART, ...) is updated,
+  // as for a file that contains only this box -- setup() can be called
+  // as usual. Each needed row is read with one seek and one read.
+  template<typename Stream>
+  void read_ccp4_region_data(Stream& f, const Fractional& lo,
+                             const Fractional& hi);
+
+  template<typename Stream>
+  void read_ccp4_region_stream(Stream& f, const std::string& path,
+                               const Fractional& lo, const Fractional& hi) {
+    read_ccp4_header(f, path);
+    read_ccp4_region_data(f, lo, hi);
+  }
+
+  // the same, but the box is in Cartesian coordinates; the region read is
+  // its bounding box in fractional coordinates
+  template<typename Stream>
+  void read_ccp4_region_stream(Stream& f, const std::string& path,
+                               const Position& lo, const Position& hi) {
+    read_ccp4_header(f, path);
+    Fractional flo(INFINITY, INFINITY, INFINITY);
+    Fractional fhi(-INFINITY, -INFINITY, -INFINITY);
+    for (int i = 0; i != 8; ++i) {
+      Position corner(i & 1 ? hi.x : lo.x, i & 2 ? hi.y : lo.y,
+                      i & 4 ? hi.z : lo.z);
+      Fractional fc = grid.unit_cell.fractionalize(corner);
+      for (int j = 0; j != 3; ++j) {
+        flo.at(j) = std::min(flo.at(j), fc.at(j));
+        fhi.at(j) = std::max(fhi.at(j), fc.at(j));
+      }
+    }
+    read_ccp4_region_data(f, flo, fhi);
+  }
+
+  // Box is either Fractional or Position.
+  template<typename Box>
+  void read_ccp4_region(const std::string& path,
+                        const Box& lo, const Box& hi) {
+    fileptr_t f = file_open(path.c_str(), "rb");
+    FileStream stream{f.get()};
+    read_ccp4_region_stream(stream, path, lo, hi);
+  }
 
   template<typename Stream>
-  void read_ccp4_stream(Stream f, const std::string& path);
+  void read_ccp4_stream(Stream f, const std::string& path) {
+    read_ccp4_header(f, path);
+    read_ccp4_data(f);
+  }
 
   void read_ccp4_file(const std::string& path) {
     fileptr_t f = file_open(path.c_str(), "rb");
     read_ccp4_stream(FileStream{f.get()}, path);
   }
 
+  // Like read_ccp4_file() followed by setup(GridSetup::Full, ...), but
+  // returns the data as GridView, which always covers the unit cell in
+  // the XYZ order and can be passed to algorithms that take views (e.g.
+  // find_peaks()). If the file has mode 2 in the native byte order, is
+  // in the XYZ order and covers the whole cell, and T is float, the data
+  // is memory-mapped from the file, without copying (the file is shared
+  // in the page cache between processes). Other maps are read, set up
+  // (points not in the map and not obtained from symmetry are set to
+  // default_value) and moved to the view. grid.data is left empty.
+  GridView<T> map_ccp4_file(const std::string& path,
+                            MapAccess access=MapAccess::ReadOnly,
+                            T default_value=
+                              std::numeric_limits<T>::has_quiet_NaN
+                              ? std::numeric_limits<T>::quiet_NaN() : T(),
+                            int nthreads=0) {
+    fileptr_t f = file_open(path.c_str(), "rb");
+    FileStream stream{f.get()};
+    read_ccp4_header(stream, path);
+    GridView<T> view;
+    if (header_i32(4) == 2 && same_byte_order && typeid(T) == typeid(float) &&
+        grid.axis_order == AxisOrder::XYZ) {
+      f.reset();
+      view.copy_metadata_from(grid);
+      // data starts after 1024-byte header and NSYMBT bytes of symmetry ops
+      map_grid_data(view, path, 1024 + (size_t) header_i32(24), access);
+    } else {
+      read_ccp4_data(stream);
+      setup(GridSetup::Full, default_value, nthreads);
+      view.copy_metadata_from(grid);
+      view.data = std::move(grid.data);
+      grid.data.clear();
+    }
+    return view;
+  }
+
   inline void read_ccp4_from_memory(const char* data, size_t size,
                                     const std::string& name) {
     return read_ccp4_stream(MemoryStream{data, data + size}, name);
   }
 
+  // Reads the data after the header in multiple threads, if the input is
+  // a gz file that allows it (see MaybeGzipped::read_in_parallel()).
+  // Values of mode 2 maps in the native byte order are decompressed
+  // directly into grid.data. Returns false if nothing was read.
   template<typename Input>
-  void read_ccp4(Input&& input) {
+  bool read_ccp4_data_in_parallel(Input& input, int nthreads) {
+    int mode = header_i32(4);
+    if (mode != 0 && mode != 1 && mode != 2 && mode != 6)
+      return false;
+    size_t n = (size_t) grid.nu * grid.nv * grid.nw;
+    std::uint64_t offset = 4 * ccp4_header.size();
+    if (mode == 2 && same_byte_order && typeid(T) == typeid(float)) {
+      grid.data.resize(n);
+      return input.read_in_parallel(offset, grid.data.data(), 4 * n,
+                                    nthreads);
+    }
+    size_t word_size = mode == 0 ? 1 : mode == 2 ? 4 : 2;
+    std::vector<char> raw(word_size * n);
+    if (!input.read_in_parallel(offset, raw.data(), raw.size(), nthreads))
+      return false;
+    MemoryStream stream{raw.data(), raw.data() + raw.size()};
+    grid.data.resize(n);
+    read_ccp4_values(stream, grid.data);
+    return true;
+  }
+
+  // Gz files are decompressed in parallel, without a second copy of the
+  // data, if they consist of gzip members with sizes in headers (written
+  // by bgzip, write_gz_parallel() or write_ccp4_map_async()) or have
+  // an up-to-date cached index -- any gz file can be opted in by calling
+  // get_gz_index() on it once. Other gz files are streamed in one thread.
+  template<typename Input>
+  void read_ccp4(Input&& input, int nthreads=0) {
     if (input.is_stdin())
       return read_ccp4_stream(FileStream{stdin}, "stdin");
-    if (input.is_compressed())
-      return read_ccp4_stream(input.get_uncompressing_stream(), input.path());
+    if (input.is_compressed()) {
+      auto stream = input.get_uncompressing_stream();
+      read_ccp4_header(stream, input.path());
+      if (!read_ccp4_data_in_parallel(input, nthreads))
+        read_ccp4_data(stream);
+      return;
+    }
     return read_ccp4_file(input.path());
   }
 
@@ -240,27 +484,88 @@ struct Ccp4 {
 
 namespace impl {
 
-template<typename Stream, typename TFile, typename TMem>
-void read_data(Stream& f, std::vector<TMem>& content) {
+// Reverses bytes of n values, each width bytes long. Written with shifts
+// on unsigned integers, which compilers vectorize (as byte shuffles).
+inline void swap_bytes_in_array(void* data, size_t n, size_t width) {
+  unsigned char* p = static_cast<unsigned char*>(data);
+  if (width == 2) {
+    for (size_t i = 0; i < n; ++i) {
+      std::uint16_t x;
+      std::memcpy(&x, p + 2 * i, 2);
+      x = std::uint16_t((x >> 8) | (x << 8));
+      std::memcpy(p + 2 * i, &x, 2);
+    }
+  } else if (width == 4) {
+    for (size_t i = 0; i < n; ++i) {
+      std::uint32_t x;
+      std::memcpy(&x, p + 4 * i, 4);
+      x = (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+      std::memcpy(p + 4 * i, &x, 4);
+    }
+  }
+}
+
+// Reads values stored as TFile, chunk by chunk. While a chunk is in cache,
+// bytes are swapped (if swap is set, i.e. the file has the other byte
+// order) and values are converted to the type of content, optionally
+// with value = offset + scale * stored_value.
+// The chunk is read into buffer, which can be passed to be reused when
+// many short arrays (e.g. rows) are read; it's resized only if needed.
+template<typename Stream, typename TFile, typename Vec>
+void read_data(Stream& f, Vec& content, bool swap=false,
+               double scale=1., double offset=0.,
+               std::vector<char>* buffer=nullptr) {
+  using TMem = typename Vec::value_type;
+  constexpr size_t chunk_size = 64 * 1024;
   if (typeid(TFile) == typeid(TMem)) {
-    size_t len = content.size();
-    if (!f.read(content.data(), sizeof(TMem) * len))
-      fail("Failed to read all the data from the map file.");
+    if (!swap) {
+      size_t len = content.size();
+      if (!f.read(content.data(), sizeof(TMem) * len))
+        fail("Failed to read all the data from the map file.");
+      return;
+    }
+    for (size_t i = 0; i < content.size(); i += chunk_size) {
+      size_t len = std::min(chunk_size, content.size() - i);
+      if (!f.read(content.data() + i, sizeof(TMem) * len))
+        fail("Failed to read all the data from the map file.");
+      swap_bytes_in_array(content.data() + i, len, sizeof(TMem));
+    }
   } else {
-    constexpr size_t chunk_size = 64 * 1024;
-    std::vector<TFile> work(chunk_size);
+    std::vector<char> local;
+    std::vector<char>& work = buffer ? *buffer : local;
+    size_t max_len = std::min(chunk_size, content.size());
+    if (work.size() < sizeof(TFile) * max_len)
+      work.resize(sizeof(TFile) * max_len);
+    const bool linear = scale != 1. || offset != 0.;
+    const TMem s = static_cast<TMem>(scale);
+    const TMem o = static_cast<TMem>(offset);
     for (size_t i = 0; i < content.size(); i += chunk_size) {
       size_t len = std::min(chunk_size, content.size() - i);
       if (!f.read(work.data(), sizeof(TFile) * len))
         fail("Failed to read all the data from the map file.");
-      for (size_t j = 0; j < len; ++j)
-        content[i+j] = static_cast<TMem>(work[j]);
+      if (swap)
+        swap_bytes_in_array(work.data(), len, sizeof(TFile));
+      const char* in = work.data();
+      TMem* out = content.data() + i;
+      // memcpy of one value compiles to a plain (unaligned) load
+      TFile v;
+      if (linear)
+        for (size_t j = 0; j < len; ++j) {
+          std::memcpy(&v, in + sizeof(TFile) * j, sizeof(TFile));
+          out[j] = o + s * static_cast<TMem>(v);
+        }
+      else
+        for (size_t j = 0; j < len; ++j) {
+          std::memcpy(&v, in + sizeof(TFile) * j, sizeof(TFile));
+          out[j] = static_cast<TMem>(v);
+        }
     }
   }
 }
 
-template<typename TFile, typename TMem>
-void write_data(const std::vector<TMem>& content, FILE* f) {
+template<typename TFile, typename Vec>
+void write_data(const Vec& content, FILE* f) {
+  using TMem = typename Vec::value_type;
   if (typeid(TMem) == typeid(TFile)) {
     size_t len = content.size();
     if (std::fwrite(content.data(), sizeof(TFile), len, f) != len)
@@ -278,36 +583,152 @@ void write_data(const std::vector<TMem>& content, FILE* f) {
   }
 }
 
+// Stores round((value - offset) / scale) clipped to the range of TFile
+// (an integer type); NaN becomes the minimum. The loop has no branches
+// or library calls, so that it can be vectorized.
+template<typename TFile, typename TMem>
+void quantize_values(const TMem* in, size_t len, double offset, double scale,
+                     TFile* out) {
+  const float lo = (float) std::numeric_limits<TFile>::min();
+  const float hi = (float) std::numeric_limits<TFile>::max();
+  const float off = (float) offset;
+  const float inv = float(1. / scale);
+  for (size_t i = 0; i < len; ++i) {
+    float x = ((float) in[i] - off) * inv;
+    x = x >= lo ? x : lo;
+    x = x <= hi ? x : hi;
+    out[i] = static_cast<TFile>(x + (x >= 0.f ? 0.5f : -0.5f));
+  }
+}
+
+template<typename TFile, typename Vec>
+void write_quantized_data(const Vec& content, double offset, double scale,
+                          FILE* f) {
+  constexpr size_t chunk_size = 64 * 1024;
+  std::vector<TFile> work(chunk_size);
+  for (size_t i = 0; i < content.size(); i += chunk_size) {
+    size_t len = std::min(chunk_size, content.size() - i);
+    quantize_values(content.data() + i, len, offset, scale, work.data());
+    if (std::fwrite(work.data(), sizeof(TFile), len, f) != len)
+      fail("Failed to write data to the map file.");
+  }
+}
+
+template<typename TFile, typename TMem>
+std::vector<unsigned char> quantize_to_bytes(const TMem* in, size_t len,
+                                             double offset, double scale) {
+  std::vector<TFile> q(len);
+  quantize_values(in, len, offset, scale, q.data());
+  const unsigned char* p = (const unsigned char*) q.data();
+  return std::vector<unsigned char>(p, p + len * sizeof(TFile));
+}
+
+// Returns len values converted to TFile, as bytes.
+template<typename TFile, typename TMem>
+std::vector<unsigned char> convert_to_bytes(const TMem* in, size_t len) {
+  std::vector<unsigned char> out(len * sizeof(TFile));
+  if (typeid(TMem) == typeid(TFile)) {
+    std::memcpy(out.data(), in, out.size());
+  } else {
+    for (size_t j = 0; j < len; ++j) {
+      TFile v = static_cast<TFile>(in[j]);
+      std::memcpy(&out[j * sizeof(TFile)], &v, sizeof(TFile));
+    }
+  }
+  return out;
+}
+
 } // namespace impl
 
 // This function was tested only on little-endian machines,
 // let us know if you need support for other architectures.
-template<typename T> template<typename Stream>
-void Ccp4<T>::read_ccp4_stream(Stream f, const std::string& path) {
-  read_ccp4_header(f, path);
-  grid.data.resize(grid.nu * grid.nv * grid.nw);
+template<typename T> template<typename Stream, typename Vec>
+void Ccp4<T>::read_ccp4_values(Stream& f, Vec& content,
+                               std::vector<char>* buffer) const {
   int mode = header_i32(4);
+  bool swap = !same_byte_order;
+  double scale = quantized(mode) ? quant_scale : 1.;
+  double offset = quantized(mode) ? quant_offset : 0.;
   if (mode == 0)
-    impl::read_data<Stream, std::int8_t>(f, grid.data);
+    impl::read_data<Stream, std::int8_t>(f, content, swap, scale, offset,
+                                         buffer);
   else if (mode == 1)
-    impl::read_data<Stream, std::int16_t>(f, grid.data);
+    impl::read_data<Stream, std::int16_t>(f, content, swap, scale, offset,
+                                          buffer);
   else if (mode == 2)
-    impl::read_data<Stream, float>(f, grid.data);
+    impl::read_data<Stream, float>(f, content, swap, 1., 0., buffer);
   else if (mode == 6)
-    impl::read_data<Stream, std::uint16_t>(f, grid.data);
+    impl::read_data<Stream, std::uint16_t>(f, content, swap, 1., 0., buffer);
   else
     fail("Only modes 0, 1, 2 and 6 are supported.");
+}
+
+template<typename T> template<typename Stream>
+void Ccp4<T>::read_ccp4_data(Stream& f) {
+  grid.data.resize(grid.nu * grid.nv * grid.nw);
+  read_ccp4_values(f, grid.data);
   //if (std::fgetc(f) != EOF)
   //  fail("The map file is longer then expected.");
+}
 
-  if (!same_byte_order) {
-    if (sizeof(T) == 2)
-      for (T& value : grid.data)
-        swap_two_bytes(&value);
-    else if (sizeof(T) == 4)
-      for (T& value : grid.data)
-        swap_four_bytes(&value);
+template<typename T> template<typename Stream>
+void Ccp4<T>::read_ccp4_region_data(Stream& f, const Fractional& lo,
+                                    const Fractional& hi) {
+  int mode = header_i32(4);
+  size_t word_size = mode == 0 ? 1 : mode == 2 ? 4 : 2;
+  auto pos = axis_positions();  // pos[i] - file axis of X (0), Y, Z
+  const int n[3] = { grid.nu, grid.nv, grid.nw };  // in file axis order
+  const int start[3] = { header_i32(5), header_i32(6), header_i32(7) };
+  int box_start[3];
+  // for each file axis: indices (in the file data) of consecutive box points
+  std::vector<int> src[3];
+  for (int i = 0; i != 3; ++i) {
+    int j = pos[i];
+    int sampl = header_i32(8 + i);  // MX, MY, MZ are in X, Y, Z order
+    if (sampl <= 0)
+      fail("Incorrect MX/MY/MZ records");
+    if (!(lo.at(i) <= hi.at(i)))
+      fail("read_ccp4_region: empty box");
+    int a = (int) std::floor(lo.at(i) * sampl);
+    int b = (int) std::ceil(hi.at(i) * sampl);
+    if (n[j] >= sampl) {  // whole cell along this axis
+      for (int k = a; k <= b; ++k)
+        src[j].push_back(modulo(k - start[j], sampl));
+    } else {
+      a = std::max(a, start[j]);
+      b = std::min(b, start[j] + n[j] - 1);
+      if (a > b)
+        fail("read_ccp4_region: the box is outside of the map");
+      for (int k = a; k <= b; ++k)
+        src[j].push_back(k - start[j]);
+    }
+    box_start[j] = a;
   }
+  int cmin = *std::min_element(src[0].begin(), src[0].end());
+  int cmax = *std::max_element(src[0].begin(), src[0].end());
+  std::vector<T> row(cmax - cmin + 1);
+  std::vector<char> buffer;  // reused for all rows
+  // data starts after 1024-byte header and NSYMBT bytes of symmetry ops
+  size_t data_offset = 1024 + (size_t) header_i32(24);
+  grid.nu = (int) src[0].size();
+  grid.nv = (int) src[1].size();
+  grid.nw = (int) src[2].size();
+  grid.data.resize(src[0].size() * src[1].size() * src[2].size());
+  size_t idx = 0;
+  for (int sec : src[2])
+    for (int r : src[1]) {
+      size_t offset = ((size_t) sec * n[1] + r) * n[0] + cmin;
+      if (!f.seek(std::uint64_t(data_offset + word_size * offset)))
+        fail("Failed to seek in the map file.");
+      read_ccp4_values(f, row, &buffer);
+      for (int c : src[0])
+        grid.data[idx++] = row[c - cmin];
+    }
+  set_header_3i32(1, grid.nu, grid.nv, grid.nw); // NX, NY, NZ
+  set_header_3i32(5, box_start[0], box_start[1], box_start[2]);
+  grid.axis_order = AxisOrder::Unknown;
+  if (pos[0] == 0 && pos[1] == 1 && pos[2] == 2 && full_cell())
+    grid.axis_order = AxisOrder::XYZ;
 }
 
 namespace impl {
@@ -323,7 +744,8 @@ template<> inline bool is_same(double a, double b) {
 }
 
 template<typename T>
-double Ccp4<T>::setup(GridSetup mode, T default_value) {
+double Ccp4<T>::setup(GridSetup mode, T default_value, int nthreads,
+                      bool low_memory) {
   double max_error = 0.0;
   if (grid.axis_order == AxisOrder::XYZ || ccp4_header.empty())
     return max_error;
@@ -332,15 +754,12 @@ double Ccp4<T>::setup(GridSetup mode, T default_value) {
   // get old metadata
   auto pos = axis_positions();
   int start[3] = { header_i32(5), header_i32(6), header_i32(7) };
-  int end[3] = { start[0] + grid.nu, start[1] + grid.nv, start[2] + grid.nw };
+  const int crs[3] = { grid.nu, grid.nv, grid.nw };
   // set new metadata
   if (mode == GridSetup::ReorderOnly) {
     set_header_3i32(5, start[pos[0]], start[pos[1]], start[pos[2]]);
-    for (int i = 0; i < 3; ++i) {
-      end[i] -= start[i];
+    for (int i = 0; i < 3; ++i)
       start[i] = 0;
-    }
-    int crs[3] = { grid.nu, grid.nv, grid.nw };
     grid.nu = crs[pos[0]];
     grid.nv = crs[pos[1]];
     grid.nw = crs[pos[2]];
@@ -353,33 +772,131 @@ double Ccp4<T>::setup(GridSetup mode, T default_value) {
   set_header_3i32(1, grid.nu, grid.nv, grid.nw); // NX, NY, NZ
   set_header_3i32(17, 1, 2, 3); // axes (MAPC, MAPR, MAPS)
   // now set the data
-  std::vector<T> full(grid.nu * grid.nv * grid.nw, default_value);
-  int it[3];
-  int idx = 0;
-  for (it[2] = start[2]; it[2] < end[2]; it[2]++) // sections
-    for (it[1] = start[1]; it[1] < end[1]; it[1]++) // rows
-      for (it[0] = start[0]; it[0] < end[0]; it[0]++) { // cols
-        T val = grid.data[idx++];
-        int new_index = grid.index_s(it[pos[0]], it[pos[1]], it[pos[2]]);
-        full[new_index] = val;
+  const int new_size[3] = { grid.nu, grid.nv, grid.nw };
+  const std::ptrdiff_t old_stride[3] = { 1, crs[0],
+                                         (std::ptrdiff_t) crs[0] * crs[1] };
+  // With low_memory, if the map has each point of the new grid once, the
+  // data is permuted in place, following the cycles of the permutation
+  // (old index -> new index); otherwise it's copied to a new vector.
+  bool in_place = low_memory;
+  for (int i = 0; i != 3; ++i)
+    in_place = in_place && crs[pos[i]] == new_size[i];
+  // For each new axis: offsets in the old data of points with the given
+  // coordinate (wrapped to the cell), or -1 if the map has no such points.
+  // If a point is present more than once, the last copy is used.
+  std::vector<std::ptrdiff_t> offsets[3];
+  for (int i = 0; i != 3; ++i) {
+    int j = pos[i];
+    offsets[i].assign(new_size[i], -1);
+    for (int k = 0; k != crs[j]; ++k)
+      offsets[i][modulo(start[j] + k, new_size[i])] = k * old_stride[j];
+  }
+  const std::ptrdiff_t new_stride[3] = { 1, grid.nu,
+                                         (std::ptrdiff_t) grid.nu * grid.nv };
+  if (in_place) {
+    // new index of the old point with index c + r * crs[0] + s * old_stride[2]
+    // is dst[0][c] + dst[1][r] + dst[2][s]
+    std::vector<size_t> dst[3];
+    for (int i = 0; i != 3; ++i) {
+      int j = pos[i];
+      dst[j].resize(crs[j]);
+      for (int k = 0; k != crs[j]; ++k)
+        dst[j][k] = modulo(start[j] + k, new_size[i]) * new_stride[i];
+    }
+    auto new_index = [&](size_t idx) {
+      size_t s = idx / old_stride[2];
+      size_t rest = idx - s * old_stride[2];
+      size_t r = rest / crs[0];
+      return dst[0][rest - r * crs[0]] + dst[1][r] + dst[2][s];
+    };
+    std::vector<bool> done(grid.data.size(), false);
+    for (size_t idx = 0; idx != grid.data.size(); ++idx) {
+      if (done[idx])
+        continue;
+      T value = grid.data[idx];
+      for (size_t dest = new_index(idx); dest != idx; dest = new_index(dest)) {
+        std::swap(value, grid.data[dest]);
+        done[dest] = true;
       }
-  grid.data = std::move(full);
-  if (mode == GridSetup::Full) {
-    grid.axis_order = AxisOrder::XYZ;
-    grid.symmetrize([&default_value](T a, T b) {
-        return impl::is_same(a, default_value) ? b : a;
+      grid.data[idx] = value;
+    }
+    // the old data is now in the new order
+    for (int i = 0; i != 3; ++i)
+      for (int k = 0; k != new_size[i]; ++k)
+        offsets[i][k] = k * new_stride[i];
+  }
+  const T* old_data = grid.data.data();
+  auto old_value = [&](int u, int v, int w) {
+    std::ptrdiff_t a = offsets[0][u], b = offsets[1][v], c = offsets[2][w];
+    return a < 0 || b < 0 || c < 0 ? default_value : old_data[a + b + c];
+  };
+  std::vector<T> full;
+  if (!in_place)
+    full.resize((size_t) grid.nu * grid.nv * grid.nw);
+  // in place, symmetry mates are read and written in the same vector;
+  // that's fine, because each orbit is read before it's written
+  T* out = in_place ? grid.data.data() : full.data();
+  bool full_mode = mode == GridSetup::Full || mode == GridSetup::FullCheck;
+  std::vector<GridOp> ops;
+  if (full_mode && grid.spacegroup && grid.spacegroup->number != 1)
+    ops = grid.get_scaled_ops_except_id();
+  if (ops.empty() && !in_place) {
+    // blocks of 16x16x16, to keep both old and new rows in cache
+    const int b = 16;
+    parallel_for(0, (grid.nw + b - 1) / b, nthreads, [&](int begin, int end) {
+      for (int w0 = begin * b; w0 < std::min(end * b, grid.nw); w0 += b)
+        for (int v0 = 0; v0 < grid.nv; v0 += b)
+          for (int u0 = 0; u0 < grid.nu; u0 += b)
+            for (int w = w0; w < std::min(w0 + b, grid.nw); ++w)
+              for (int v = v0; v < std::min(v0 + b, grid.nv); ++v)
+                for (int u = u0; u < std::min(u0 + b, grid.nu); ++u)
+                  out[grid.index_q(u, v, w)] = old_value(u, v, w);
     });
-  } else if (mode == GridSetup::FullCheck) {
-    grid.axis_order = AxisOrder::XYZ;
-    grid.symmetrize([&max_error, &default_value](T a, T b) {
-        if (impl::is_same(a, default_value)) {
-          return b;
-        } else {
-          if (!impl::is_same(b, default_value))
-            max_error = std::max(max_error, std::fabs(double(a - b)));
-          return a;
-        }
+  } else if (!ops.empty()) {
+    // The same as reordering followed by Grid::symmetrize(), but done in
+    // one pass: the values of symmetry mates are taken from the old data
+    // by the first point of each orbit (in raster order), which writes the
+    // result to all the points of the orbit. Orbits don't overlap, so they
+    // can be processed in parallel.
+    bool check = mode == GridSetup::FullCheck;
+    std::mutex mutex;
+    parallel_for(0, grid.nw, nthreads, [&](int w_begin, int w_end) {
+      std::vector<std::array<int, 3>> mates(ops.size());
+      double error = 0.0;
+      for (int w = w_begin; w != w_end; ++w)
+        for (int v = 0; v != grid.nv; ++v)
+          for (int u = 0; u != grid.nu; ++u) {
+            int idx = grid.index_q(u, v, w);
+            bool first = true;
+            for (size_t k = 0; k != ops.size() && first; ++k) {
+              std::array<int, 3> t = ops[k].apply(u, v, w);
+              mates[k] = {{ modulo(t[0], grid.nu), modulo(t[1], grid.nv),
+                            modulo(t[2], grid.nw) }};
+              first = grid.index_q(mates[k][0], mates[k][1],
+                                   mates[k][2]) >= idx;
+            }
+            if (!first)
+              continue;
+            T value = old_value(u, v, w);
+            for (const std::array<int, 3>& m : mates) {
+              T mate_value = old_value(m[0], m[1], m[2]);
+              if (impl::is_same(value, default_value))
+                value = mate_value;
+              else if (check && !impl::is_same(mate_value, default_value))
+                error = std::max(error, std::fabs(double(value - mate_value)));
+            }
+            out[idx] = value;
+            for (const std::array<int, 3>& m : mates)
+              out[grid.index_q(m[0], m[1], m[2])] = value;
+          }
+      std::lock_guard<std::mutex> lock(mutex);
+      max_error = std::max(max_error, error);
     });
+  }
+  if (!in_place)
+    grid.data = std::move(full);
+  if (full_mode) {
+    grid.axis_order = AxisOrder::XYZ;
   } else {
     grid.axis_order = AxisOrder::Unknown;
     if (pos[0] == 0 && pos[1] == 1 && pos[2] == 2 && full_cell())
@@ -394,7 +911,14 @@ void Ccp4<T>::write_ccp4_map(const std::string& path) const {
   fileptr_t f = file_open(path.c_str(), "wb");
   std::fwrite(ccp4_header.data(), 4, ccp4_header.size(), f.get());
   int mode = header_i32(4);
-  if (mode == 0)
+  if (quantized(mode)) {
+    if (mode == 0)
+      impl::write_quantized_data<std::int8_t>(grid.data, quant_offset,
+                                              quant_scale, f.get());
+    else
+      impl::write_quantized_data<std::int16_t>(grid.data, quant_offset,
+                                               quant_scale, f.get());
+  } else if (mode == 0)
     impl::write_data<std::int8_t>(grid.data, f.get());
   else if (mode == 1)
     impl::write_data<std::int16_t>(grid.data, f.get());
@@ -404,5 +928,68 @@ void Ccp4<T>::write_ccp4_map(const std::string& path) const {
     impl::write_data<std::uint16_t>(grid.data, f.get());
 }
 
+// Writes the map in a background thread and returns at once. The data is
+// converted to the file mode (and gzipped if path ends with .gz) in chunks
+// by up to nthreads threads and written in order; at most queue_size chunks
+// wait for writing. The map must not be modified before the returned
+// future is ready; get() re-throws errors. Gzipped output consists of
+// members that can be decompressed in parallel (see decompress_gz_file()).
+template<typename T>
+std::future<void> write_ccp4_map_async(std::shared_ptr<const Ccp4<T>> map,
+                                       const std::string& path,
+                                       int nthreads=0, size_t queue_size=8) {
+  assert(map->ccp4_header.size() >= 256);
+  int mode = map->header_i32(4);
+  if (mode != 0 && mode != 1 && mode != 2 && mode != 6)
+    fail("Only modes 0, 1, 2 and 6 are supported.");
+  return std::async(std::launch::async,
+                    [map, path, mode, nthreads, queue_size]() {
+    typedef std::vector<unsigned char> Bytes;
+    const size_t chunk_size = 1024 * 1024;
+    const T* values = map->grid.data.data();
+    const size_t n_values = map->grid.data.size();
+    const int gz_level = iends_with(path, ".gz") ? 6 : -1;
+    // chunk 0 is the header
+    size_t n_chunks = 1 + (n_values + chunk_size - 1) / chunk_size;
+    fileptr_t f = file_open(path.c_str(), "wb");
+    ordered_pipeline<Bytes>(n_chunks, nthreads, queue_size,
+      [&](size_t i) {
+        Bytes bytes;
+        if (i == 0) {
+          const std::vector<int32_t>& h = map->ccp4_header;
+          const unsigned char* p = (const unsigned char*) h.data();
+          bytes.assign(p, p + 4 * h.size());
+        } else {
+          const T* in = values + (i - 1) * chunk_size;
+          size_t len = std::min(chunk_size, n_values - (i - 1) * chunk_size);
+          double offset = map->quant_offset, scale = map->quant_scale;
+          if (map->quantized(mode) && mode == 0)
+            bytes = impl::quantize_to_bytes<std::int8_t>(in, len, offset,
+                                                         scale);
+          else if (map->quantized(mode))
+            bytes = impl::quantize_to_bytes<std::int16_t>(in, len, offset,
+                                                          scale);
+          else if (mode == 0)
+            bytes = impl::convert_to_bytes<std::int8_t>(in, len);
+          else if (mode == 1)
+            bytes = impl::convert_to_bytes<std::int16_t>(in, len);
+          else if (mode == 2)
+            bytes = impl::convert_to_bytes<float>(in, len);
+          else
+            bytes = impl::convert_to_bytes<std::uint16_t>(in, len);
+        }
+        if (gz_level >= 0)
+          bytes = impl::gzip_member(bytes.data(), bytes.size(), gz_level);
+        return bytes;
+      },
+      [&](size_t, Bytes& bytes) {
+        if (std::fwrite(bytes.data(), 1, bytes.size(), f.get()) != bytes.size())
+          fail("Failed to write " + path);
+      });
+    if (std::fclose(f.release()) != 0)
+      fail("Failed to write " + path);
+  });
+}
+
 } // namespace gemmi
 #endif
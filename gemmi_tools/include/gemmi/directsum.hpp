@@ -0,0 +1,213 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Density from map coefficients evaluated directly (by summation) on
+// a box of points, as an alternative to FFT + interpolation for small
+// boxes.
+
+#ifndef GEMMI_DIRECTSUM_HPP_
+#define GEMMI_DIRECTSUM_HPP_
+
+#include <algorithm>    // for stable_sort, unique
+#include <array>
+#include <cmath>        // for log2
+#include <complex>
+#include <vector>
+#include "fourier.hpp"  // for transform_f_phi_to_map, get_size_for_hkl
+#include "math.hpp"     // for Transform, rad, pi
+#include "symmetry.hpp" // for GroupOps, Op
+#include "threads.hpp"  // for parallel_for
+#include "fail.hpp"     // for fail
+
+namespace gemmi {
+
+// How sample_f_phi_on_frame() calculates the density.
+enum class FrameMethod : unsigned char { Auto, Direct, Fft };
+
+namespace impl {
+
+struct FPhiTerm {
+  Miller hkl;
+  double f;
+  double phi;  // in radians
+};
+
+// Unique reflections from one half of reciprocal space (generated by
+// symmetry and Friedel's law) with amplitudes doubled, except F000,
+// so that the density is a sum of f cos(2 pi h.x - phi).
+template<typename DataProxy>
+std::vector<FPhiTerm> expand_f_phi_terms(const DataProxy& data,
+                                         size_t f_col, size_t phi_col) {
+  if (!data.ok() || data.stride() < 5)
+    fail("No data.");
+  if (!data.spacegroup())
+    fail("No spacegroup.");
+  if (f_col >= data.stride() || phi_col >= data.stride())
+    fail("Map coefficients not found.");
+  GroupOps ops = data.spacegroup()->operations();
+  const Miller zero = {{0, 0, 0}};
+  std::vector<FPhiTerm> terms;
+  auto hkl_col = data.hkl_col();
+  for (size_t i = 0; i < data.size(); i += data.stride()) {
+    Miller hkl = data.get_hkl(i, hkl_col);
+    double f = data.get_num(i + f_col);
+    if (!(f > 0.))
+      continue;
+    double phi = rad(data.get_num(i + phi_col));
+    for (const Op& op : ops.sym_ops) {
+      FPhiTerm t{op.apply_to_hkl(hkl), f, phi + op.phase_shift(hkl)};
+      if (t.hkl < zero) {
+        t.hkl = {{-t.hkl[0], -t.hkl[1], -t.hkl[2]}};
+        t.phi = -t.phi;
+      }
+      terms.push_back(t);
+    }
+  }
+  auto by_hkl = [](const FPhiTerm& a, const FPhiTerm& b) {
+    return a.hkl < b.hkl;
+  };
+  std::stable_sort(terms.begin(), terms.end(), by_hkl);
+  terms.erase(std::unique(terms.begin(), terms.end(),
+                          [](const FPhiTerm& a, const FPhiTerm& b) {
+                            return a.hkl == b.hkl;
+                          }),
+              terms.end());
+  for (FPhiTerm& t : terms)
+    if (t.hkl != zero)
+      t.f *= 2;
+  return terms;
+}
+
+// GCC at -O2 vectorizes only loops with known trip counts (and before
+// GCC 12 none), so the inner loop of the direct summation requests
+// vectorization itself, independently of the optimization level of the
+// whole build. Clang vectorizes it at -O2.
+#if defined(__GNUC__) && !defined(__clang__) && !defined(__INTEL_COMPILER)
+# define GEMMI_VECTORIZE \
+    __attribute__((optimize("tree-vectorize", "vect-cost-model=dynamic")))
+#else
+# define GEMMI_VECTORIZE
+#endif
+
+// Adds the real part of z * y[j] * (xr[i] + i xi[i]) to point (i, j)
+// of n2 planes of n1 x n0 values, z being multiplied by step_c between
+// planes.
+GEMMI_VECTORIZE
+inline void add_term_to_planes(double* acc, int n0, int n1, int n2,
+                               std::complex<double> z,
+                               std::complex<double> step_c,
+                               const std::complex<double>* y,
+                               const double* xr, const double* xi) {
+  for (int k = 0; k != n2; ++k, z *= step_c) {
+    double* row = acc + (size_t) k * n1 * n0;
+    for (int j = 0; j != n1; ++j, row += n0) {
+      std::complex<double> p = z * y[j];
+      const double pr = p.real(), pi_ = p.imag();
+      for (int i = 0; i != n0; ++i)
+        row[i] += pr * xr[i] - pi_ * xi[i];
+    }
+  }
+}
+
+} // namespace impl
+
+// Calculates density on a box of points: point (i, j, k) is at
+// frame.apply(Vec3(i, j, k)) (orthogonal coordinates); values are returned
+// with i changing fastest. All the terms are summed for each point.
+// Along each frame axis exp(2 pi i h.x) is obtained by recurrence, so each
+// (point, reflection) pair costs only two multiply-adds in a vectorizable
+// loop.
+template<typename T, typename DataProxy>
+std::vector<T> direct_f_phi_on_frame(const DataProxy& data,
+                                     size_t f_col, size_t phi_col,
+                                     const Transform& frame,
+                                     std::array<int, 3> size,
+                                     int nthreads=0) {
+  std::vector<impl::FPhiTerm> terms =
+    impl::expand_f_phi_terms(data, f_col, phi_col);
+  const UnitCell& cell = data.unit_cell();
+  // the same in fractional coordinates
+  Transform fr = cell.frac.combine(frame);
+  const Mat33& m = fr.mat;
+  const Vec3 da(m[0][0], m[1][0], m[2][0]);
+  const Vec3 db(m[0][1], m[1][1], m[2][1]);
+  const Vec3 dc(m[0][2], m[1][2], m[2][2]);
+  const int n0 = size[0], n1 = size[1], n2 = size[2];
+  const size_t plane = (size_t) n0 * n1;
+  const double norm = 1. / cell.volume;
+  std::vector<T> out(plane * n2);
+  parallel_for(0, n2, nthreads, [&](int k_begin, int k_end) {
+    std::vector<double> acc(plane * (k_end - k_begin), 0.);
+    std::vector<double> xr(n0), xi(n0);
+    std::vector<std::complex<double>> y(n1);
+    for (const impl::FPhiTerm& t : terms) {
+      Vec3 h(t.hkl[0], t.hkl[1], t.hkl[2]);
+      std::complex<double> step_a = std::polar(1., 2 * pi() * h.dot(da));
+      std::complex<double> step_b = std::polar(1., 2 * pi() * h.dot(db));
+      std::complex<double> step_c = std::polar(1., 2 * pi() * h.dot(dc));
+      std::complex<double> x(1., 0.);
+      for (int i = 0; i != n0; ++i, x *= step_a) {
+        xr[i] = x.real();
+        xi[i] = x.imag();
+      }
+      y[0] = 1.;
+      for (int j = 1; j != n1; ++j)
+        y[j] = y[j-1] * step_b;
+      double phase = 2 * pi() * (h.dot(fr.vec) + h.dot(dc) * k_begin) - t.phi;
+      impl::add_term_to_planes(acc.data(), n0, n1, k_end - k_begin,
+                               std::polar(t.f, phase), step_c, y.data(),
+                               xr.data(), xi.data());
+    }
+    for (size_t i = 0; i != acc.size(); ++i)
+      out[k_begin * plane + i] = T(norm * acc[i]);
+  });
+  return out;
+}
+
+// Samples density on the box (as above) either by direct summation or by FFT of
+// the whole cell (with the given sample_rate) followed by trilinear
+// interpolation. Auto picks the method with fewer estimated operations;
+// the direct sum is chosen for small boxes and low resolution data.
+template<typename T, typename DataProxy>
+std::vector<T> sample_f_phi_on_frame(const DataProxy& data,
+                                     size_t f_col, size_t phi_col,
+                                     const Transform& frame,
+                                     std::array<int, 3> size,
+                                     FrameMethod method=FrameMethod::Auto,
+                                     double sample_rate=3.,
+                                     int nthreads=0) {
+  std::array<int, 3> cell_size = get_size_for_hkl(data, {{0, 0, 0}},
+                                                  sample_rate);
+  if (method == FrameMethod::Auto) {
+    double n_box = (double) size[0] * size[1] * size[2];
+    double n_cell = (double) cell_size[0] * cell_size[1] * cell_size[2];
+    // the number of terms is ~ (reflections in data) * (ops)
+    double n_terms = double(data.size() / data.stride()) *
+                     data.spacegroup()->operations().sym_ops.size();
+    // 2 multiply-adds (~4 flops) per (term, point) vs ~2.5 n log2(n) for
+    // a half-complex FFT, plus putting coefficients onto the grid, passes
+    // over the whole grid and interpolation
+    double direct_cost = 4 * n_terms * n_box;
+    double fft_cost = 2.5 * n_cell * std::log2(n_cell) + 4 * n_cell +
+                      n_terms + 8 * n_box;
+    method = direct_cost < fft_cost ? FrameMethod::Direct : FrameMethod::Fft;
+  }
+  if (method == FrameMethod::Direct)
+    return direct_f_phi_on_frame<T>(data, f_col, phi_col, frame, size,
+                                    nthreads);
+  Grid<T> map = transform_f_phi_to_map<T>(data, f_col, phi_col, cell_size,
+                                          sample_rate, true, nthreads);
+  const size_t plane = (size_t) size[0] * size[1];
+  std::vector<T> out(plane * size[2]);
+  parallel_for(0, size[2], nthreads, [&](int k_begin, int k_end) {
+    for (int k = k_begin; k != k_end; ++k)
+      for (int j = 0; j != size[1]; ++j)
+        for (int i = 0; i != size[0]; ++i) {
+          Position pos(frame.apply(Vec3(i, j, k)));
+          out[k * plane + j * size[0] + i] = map.interpolate_value(pos);
+        }
+  });
+  return out;
+}
+
+} // namespace gemmi
+#endif
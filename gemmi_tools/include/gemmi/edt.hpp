@@ -0,0 +1,396 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Euclidean distance transform of grid masks and morphological operations
+// (dilate, erode, open, close) built on it.
+
+#ifndef GEMMI_EDT_HPP_
+#define GEMMI_EDT_HPP_
+
+#include <algorithm>   // for sort, max
+#include <array>
+#include <cmath>       // for sqrt, INFINITY
+#include <vector>
+#include "grid.hpp"    // for Grid
+#include "threads.hpp" // for parallel_for, parallel_for_dynamic
+#include "fail.hpp"    // for fail
+
+namespace gemmi {
+
+namespace impl {
+
+// Exact 1D squared distance transform of a periodic line (Felzenszwalb &
+// Huttenlocher, 2012). f has n values (0 for features, INFINITY elsewhere,
+// or results of the previous pass), d receives the result. The line is
+// tiled three times to account for periodic images; v and z are workspace.
+inline void edt_1d_periodic(const double* f, double* d, int n, double spacing,
+                            std::vector<int>& v, std::vector<double>& z) {
+  const double s2 = spacing * spacing;
+  v.resize(3 * n);
+  z.resize(3 * n + 1);
+  int k = -1;
+  for (int q = 0; q != 3 * n; ++q) {
+    double fq = f[q % n];
+    if (fq == INFINITY)
+      continue;
+    double xq = q * spacing;
+    double vq_s = 0;
+    while (k >= 0) {
+      int p = v[k];
+      double xp = p * spacing;
+      // intersection of parabolas from p and q
+      vq_s = ((fq + xq * xq) - (f[p % n] + xp * xp)) / (2 * (xq - xp));
+      if (vq_s > z[k])
+        break;
+      --k;
+    }
+    ++k;
+    v[k] = q;
+    z[k] = k == 0 ? -INFINITY : vq_s;
+    z[k + 1] = INFINITY;
+  }
+  if (k < 0) {
+    for (int i = 0; i != n; ++i)
+      d[i] = INFINITY;
+    return;
+  }
+  int j = 0;
+  for (int i = 0; i != n; ++i) {
+    double x = (i + n) * spacing;
+    while (z[j + 1] < x)
+      ++j;
+    double dx = (i + n - v[j]);
+    d[i] = dx * dx * s2 + f[v[j] % n];
+  }
+}
+
+// Exact, separable EDT; requires the grid axes to be orthogonal.
+template<typename T>
+void edt_orthogonal(const Grid<T>& mask, std::vector<double>& dist2,
+                    int nthreads) {
+  const int n[3] = {mask.nu, mask.nv, mask.nw};
+  const size_t stride[3] = {1, (size_t) n[0], (size_t) n[0] * n[1]};
+  dist2.resize(mask.data.size());
+  for (size_t i = 0; i != dist2.size(); ++i)
+    dist2[i] = mask.data[i] != T() ? 0. : INFINITY;
+  for (int axis = 0; axis != 3; ++axis) {
+    // lines along axis are enumerated by the index of their first point
+    int a1 = (axis + 1) % 3, a2 = (axis + 2) % 3;
+    int n_lines = n[a1] * n[a2];
+    parallel_for(0, n_lines, nthreads, [&](int begin, int end) {
+      std::vector<double> f(n[axis]), d(n[axis]), z;
+      std::vector<int> v;
+      for (int line = begin; line != end; ++line) {
+        size_t start = (line % n[a1]) * stride[a1] +
+                       (line / n[a1]) * stride[a2];
+        for (int i = 0; i != n[axis]; ++i)
+          f[i] = dist2[start + i * stride[axis]];
+        edt_1d_periodic(f.data(), d.data(), n[axis], mask.spacing[axis], v, z);
+        for (int i = 0; i != n[axis]; ++i)
+          dist2[start + i * stride[axis]] = d[i];
+      }
+    });
+  }
+}
+
+// Grid offsets r such that every nearest seed s of a non-seed point has
+// a non-seed point at s + r for one of them. These are the Voronoi-relevant
+// vectors of the grid lattice (the shortest vector in each non-zero class
+// of L/2L, if it is unique up to sign), found by searching a small range,
+// together with the 26 neighbours (more offsets only cost time).
+inline std::vector<std::array<int, 3>> edt_relevant_offsets(const Mat33& m) {
+  std::vector<std::array<int, 3>> result;
+  for (int w = -1; w <= 1; ++w)
+    for (int v = -1; v <= 1; ++v)
+      for (int u = -1; u <= 1; ++u)
+        if (u != 0 || v != 0 || w != 0)
+          result.push_back({{u, v, w}});
+  const int range = 4;
+  for (int cls = 1; cls != 8; ++cls) {
+    double best = INFINITY, second = INFINITY;
+    std::array<int, 3> best_x = {{0, 0, 0}};
+    for (int w = -range; w <= range; ++w)
+      for (int v = -range; v <= range; ++v)
+        for (int u = -range; u <= range; ++u) {
+          if (((u & 1) | (v & 1) << 1 | (w & 1) << 2) != cls)
+            continue;
+          // count x and -x once
+          if (w < 0 || (w == 0 && (v < 0 || (v == 0 && u < 0))))
+            continue;
+          double d2 = m.multiply(Vec3(u, v, w)).length_sq();
+          if (d2 < best) {
+            second = best;
+            best = d2;
+            best_x = {{u, v, w}};
+          } else if (d2 < second) {
+            second = d2;
+          }
+        }
+    if (best < second * (1 - 1e-9)) {
+      result.push_back(best_x);
+      result.push_back({{-best_x[0], -best_x[1], -best_x[2]}});
+    }
+  }
+  return result;
+}
+
+// Exact EDT for any cell. The nearest seed must be on the boundary of the
+// mask (see edt_relevant_offsets()), so only boundary seeds are binned into
+// blocks of about 4x4x4 points. Each block of target points collects seed
+// blocks within a radius, ordered by the lower bound of the distance, and
+// each point checks these blocks until the bound exceeds its best distance.
+// If the radius turns out to be too small, the block is re-done with a
+// larger one. Blocks run in parallel.
+// The cost grows with the distances: a point at distance d from the mask
+// checks the seeds in all blocks within d, i.e. O(d^3) grid points. With
+// a finite cutoff the radius doesn't grow beyond it and the points not
+// closer than cutoff to the mask get INFINITY, so the cost is O(cutoff^3)
+// per point -- that's how the morphology operations call it.
+template<typename T>
+void edt_general(const Grid<T>& mask, std::vector<double>& dist2,
+                 int nthreads, double cutoff=INFINITY) {
+  const int n[3] = {mask.nu, mask.nv, mask.nw};
+  const Mat33& frac = mask.unit_cell.frac.mat;
+  Mat33 m = mask.unit_cell.orth.mat;
+  double h[3];  // distance between grid planes perpendicular to each axis
+  for (int i = 0; i != 3; ++i) {
+    for (int j = 0; j != 3; ++j)
+      m[j][i] /= n[i];
+    h[i] = 1. / (n[i] * Vec3(frac[i][0], frac[i][1], frac[i][2]).length());
+  }
+  dist2.resize(mask.data.size());
+  for (size_t i = 0; i != dist2.size(); ++i)
+    dist2[i] = mask.data[i] != T() ? 0. : INFINITY;
+
+  // blocks along each axis; block b starts at b * n / nb
+  int nb[3], bmin[3];
+  for (int i = 0; i != 3; ++i) {
+    nb[i] = std::max(1, n[i] / 4);
+    bmin[i] = n[i] / nb[i];
+  }
+  auto block_start = [&](int i, int b) {
+    return int((long long) b * n[i] / nb[i]);
+  };
+  const int n_blocks = nb[0] * nb[1] * nb[2];
+  auto floor_div = [](int x, int y) {
+    return x >= 0 ? x / y : -((-x + y - 1) / y);
+  };
+  auto block_coords = [&](int b, int* c) {
+    c[0] = b % nb[0];
+    c[1] = b / nb[0] % nb[1];
+    c[2] = b / (nb[0] * nb[1]);
+  };
+
+  // boundary seeds in each block
+  const std::vector<std::array<int, 3>> rel = edt_relevant_offsets(m);
+  std::vector<std::vector<std::array<int, 3>>> seeds(n_blocks);
+  parallel_for_dynamic(n_blocks, nthreads, [&](int b) {
+    int c[3];
+    block_coords(b, c);
+    for (int w = block_start(2, c[2]); w != block_start(2, c[2] + 1); ++w)
+      for (int v = block_start(1, c[1]); v != block_start(1, c[1] + 1); ++v)
+        for (int u = block_start(0, c[0]); u != block_start(0, c[0] + 1); ++u)
+          if (mask.data[mask.index_q(u, v, w)] != T())
+            for (const std::array<int, 3>& r : rel)
+              if (mask.get_value(u + r[0], v + r[1], w + r[2]) == T()) {
+                seeds[b].push_back({{u, v, w}});
+                break;
+              }
+  });
+  std::vector<int> nonempty;
+  for (int b = 0; b != n_blocks; ++b)
+    if (!seeds[b].empty())
+      nonempty.push_back(b);
+  if (nonempty.empty())
+    return;
+  // any point is closer than this to an image of any seed
+  const UnitCell& cell = mask.unit_cell;
+  const double max_dist = 0.5 * (cell.a + cell.b + cell.c);
+
+  struct Candidate {
+    double lb2;  // lower bound of squared distance from the target block
+    int block;
+    int shift[3];  // seed coordinates + shift = unwrapped coordinates
+    int lo[3], hi[3];  // unwrapped range of the block (inclusive)
+  };
+  parallel_for_dynamic(n_blocks, nthreads, [&](int target) {
+    int a[3];
+    block_coords(target, a);
+    std::vector<std::array<int, 3>> points;
+    for (int w = block_start(2, a[2]); w != block_start(2, a[2] + 1); ++w)
+      for (int v = block_start(1, a[1]); v != block_start(1, a[1] + 1); ++v)
+        for (int u = block_start(0, a[0]); u != block_start(0, a[0] + 1); ++u)
+          if (mask.data[mask.index_q(u, v, w)] == T())
+            points.push_back({{u, v, w}});
+    if (points.empty())
+      return;
+    std::vector<double> best(points.size());
+    std::vector<Candidate> cand;
+    double radius = std::max(bmin[0] * h[0],
+                             std::max(bmin[1] * h[1], bmin[2] * h[2]));
+    for (;;) {
+      // seed blocks at offsets d with lower bound <= radius
+      int dmax[3];
+      for (int i = 0; i != 3; ++i)
+        dmax[i] = radius < h[i] ? 0 : int((radius / h[i] - 1) / bmin[i]) + 1;
+      auto add = [&](const int* d) {
+        double lb = 0;
+        Candidate c;
+        int t[3];
+        for (int i = 0; i != 3; ++i) {
+          if (d[i] != 0)
+            lb = std::max(lb, ((std::abs(d[i]) - 1) * bmin[i] + 1) * h[i]);
+          int k = floor_div(a[i] + d[i], nb[i]);
+          t[i] = a[i] + d[i] - k * nb[i];
+          c.shift[i] = k * n[i];
+          c.lo[i] = block_start(i, t[i]) + c.shift[i];
+          c.hi[i] = block_start(i, t[i] + 1) - 1 + c.shift[i];
+        }
+        c.block = (t[2] * nb[1] + t[1]) * nb[0] + t[0];
+        c.lb2 = lb * lb;
+        if (!seeds[c.block].empty())
+          cand.push_back(c);
+      };
+      cand.clear();
+      double box = double(2 * dmax[0] + 1) * (2 * dmax[1] + 1) *
+                   (2 * dmax[2] + 1);
+      if (box <= (double) nonempty.size()) {
+        int d[3];
+        for (d[2] = -dmax[2]; d[2] <= dmax[2]; ++d[2])
+          for (d[1] = -dmax[1]; d[1] <= dmax[1]; ++d[1])
+            for (d[0] = -dmax[0]; d[0] <= dmax[0]; ++d[0])
+              add(d);
+      } else {
+        // all images of non-empty blocks within the box
+        for (int b : nonempty) {
+          int c[3], k_lo[3], k_hi[3];
+          block_coords(b, c);
+          for (int i = 0; i != 3; ++i) {
+            int base = c[i] - a[i];
+            k_lo[i] = -floor_div(dmax[i] + base, nb[i]);
+            k_hi[i] = floor_div(dmax[i] - base, nb[i]);
+          }
+          int d[3];
+          for (int kw = k_lo[2]; kw <= k_hi[2]; ++kw)
+            for (int kv = k_lo[1]; kv <= k_hi[1]; ++kv)
+              for (int ku = k_lo[0]; ku <= k_hi[0]; ++ku) {
+                d[0] = c[0] - a[0] + ku * nb[0];
+                d[1] = c[1] - a[1] + kv * nb[1];
+                d[2] = c[2] - a[2] + kw * nb[2];
+                add(d);
+              }
+        }
+      }
+      std::sort(cand.begin(), cand.end(),
+                [](const Candidate& x, const Candidate& y) {
+                  return x.lb2 < y.lb2;
+                });
+      double max_best = 0;
+      for (size_t j = 0; j != points.size(); ++j) {
+        const std::array<int, 3>& p = points[j];
+        double d2_min = INFINITY;
+        for (const Candidate& c : cand) {
+          if (c.lb2 >= d2_min)
+            break;
+          // tighter bound for this point
+          double lb = 0;
+          for (int i = 0; i != 3; ++i) {
+            int dist = std::max(0, std::max(c.lo[i] - p[i], p[i] - c.hi[i]));
+            lb = std::max(lb, dist * h[i]);
+          }
+          if (lb * lb >= d2_min)
+            continue;
+          for (const std::array<int, 3>& s : seeds[c.block]) {
+            Vec3 x(s[0] + c.shift[0] - p[0], s[1] + c.shift[1] - p[1],
+                   s[2] + c.shift[2] - p[2]);
+            d2_min = std::min(d2_min, m.multiply(x).length_sq());
+          }
+        }
+        best[j] = d2_min;
+        max_best = std::max(max_best, d2_min);
+      }
+      // exact if all blocks closer than the found distances were checked
+      if (max_best <= radius * radius)
+        break;
+      if (radius >= cutoff) {
+        for (double& d2 : best)
+          if (d2 > radius * radius)  // may be inexact
+            d2 = INFINITY;
+        break;
+      }
+      if (radius > 2 * max_dist)
+        fail("distance transform: internal error, no seed found");
+      radius = max_best != INFINITY ? std::sqrt(max_best) * (1 + 1e-9)
+                                    : 2 * radius;
+      radius = std::min(radius, cutoff);
+    }
+    for (size_t j = 0; j != points.size(); ++j)
+      dist2[mask.index_q(points[j][0], points[j][1], points[j][2])] = best[j];
+  });
+}
+
+} // namespace impl
+
+// Returns distance (in Angstroms) from each grid point to the nearest point
+// where mask is non-zero, taking into account periodic boundaries.
+// The result is exact and calculated in parallel. For orthogonal cells
+// a separable algorithm is used and the cost does not depend on distances;
+// for other cells the cost grows with the cube of the distances (see
+// edt_general()), unless max_distance is set -- then distances that are
+// not smaller than max_distance may be returned as INFINITY.
+template<typename T>
+Grid<float> distance_transform(const Grid<T>& mask, int nthreads=0,
+                               double max_distance=INFINITY) {
+  if (mask.axis_order != AxisOrder::XYZ)
+    fail("distance_transform: grid must cover the unit cell in XYZ order");
+  std::vector<double> dist2;
+  const UnitCell& cell = mask.unit_cell;
+  if (cell.alpha == 90. && cell.beta == 90. && cell.gamma == 90.)
+    impl::edt_orthogonal(mask, dist2, nthreads);
+  else
+    impl::edt_general(mask, dist2, nthreads, max_distance);
+  Grid<float> result;
+  result.unit_cell = mask.unit_cell;
+  result.spacegroup = mask.spacegroup;
+  result.set_size_without_checking(mask.nu, mask.nv, mask.nw);
+  for (size_t i = 0; i != dist2.size(); ++i)
+    result.data[i] = (float) std::sqrt(dist2[i]);
+  return result;
+}
+
+// Sets to 1 all points closer than radius to a non-zero point
+// (the same as set_points_around(radius, 1) around each non-zero point).
+// The distances are searched only up to the radius, so the cost doesn't
+// depend on how far the remaining points are from the mask.
+template<typename T>
+void dilate_mask(Grid<T>& mask, double radius, int nthreads=0) {
+  Grid<float> dist = distance_transform(mask, nthreads, radius);
+  for (size_t i = 0; i != mask.data.size(); ++i)
+    mask.data[i] = mask.data[i] != T() || dist.data[i] < radius ? 1 : 0;
+}
+
+// Sets to 0 all points closer than radius to a zero point.
+template<typename T>
+void erode_mask(Grid<T>& mask, double radius, int nthreads=0) {
+  for (T& x : mask.data)
+    x = x != T() ? 0 : 1;
+  dilate_mask(mask, radius, nthreads);
+  for (T& x : mask.data)
+    x = x != T() ? 0 : 1;
+}
+
+// erosion followed by dilation - removes features thinner than 2*radius
+template<typename T>
+void open_mask(Grid<T>& mask, double radius, int nthreads=0) {
+  erode_mask(mask, radius, nthreads);
+  dilate_mask(mask, radius, nthreads);
+}
+
+// dilation followed by erosion - fills gaps narrower than 2*radius
+template<typename T>
+void close_mask(Grid<T>& mask, double radius, int nthreads=0) {
+  dilate_mask(mask, radius, nthreads);
+  erode_mask(mask, radius, nthreads);
+}
+
+} // namespace gemmi
+#endif
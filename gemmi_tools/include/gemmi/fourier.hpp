@@ -5,11 +5,17 @@
 #ifndef GEMMI_FOURIER_HPP_
 #define GEMMI_FOURIER_HPP_
 
+#include <algorithm>     // for find, copy
 #include <array>
-#include <complex>       // for std::conj
+#include <complex>       // for std::conj, std::polar
+#include <memory>        // for unique_ptr
+#include <type_traits>   // for is_same
+#include <utility>       // for pair
+#include <vector>
 #include "grid.hpp"      // for Grid
 #include "math.hpp"      // for rad
 #include "symmetry.hpp"  // for GroupOps, Op
+#include "threads.hpp"   // for resolve_thread_count, parallel_for, ...
 #include "fail.hpp"      // for fail
 
 #ifdef  __INTEL_COMPILER
@@ -19,8 +25,11 @@
 
 #ifdef __MINGW32__  // MinGW may have problem with std::mutex etc
 # define POCKETFFT_CACHE_SIZE 0
+# define POCKETFFT_NO_MULTITHREADING
+#elif !defined(_WIN32)
+// the thread pool is restarted after fork() (e.g. Python multiprocessing)
+# define POCKETFFT_PTHREADS
 #endif
-#define POCKETFFT_NO_MULTITHREADING
 #include "third_party/pocketfft_hdronly.h"
 
 namespace gemmi {
@@ -147,82 +156,269 @@ void initialize_hkl_grid(ReciprocalGrid<T>& grid, const DataProxy& data,
   grid.set_size_without_checking(size[0], size[1], size[2]);
 }
 
+// Precomputed expansion of a list of reflections (typically the ASU
+// reflections of a dataset) to the hkl grid of the given size: for each
+// reflection, the grid indices of its symmetry equivalents with phase
+// factors, and pairs of points filled by add_friedel_mates().
+// Built once per (space group, reflection list, grid size), it makes
+// filling the grid a parallel scatter, with one sincos per reflection.
+// get_f_phi_on_grid() and get_value_on_grid() build it for each call.
+// If a grid point is reached from more than one reflection (duplicates
+// in the list), the first reflection with non-zero value wins, as in
+// a serial loop over reflections. Such points are rare; they are filled
+// after the scatter, serially.
+template<typename T>
+struct HklExpansion {
+  const SpaceGroup* spacegroup = nullptr;
+  std::array<int, 3> size = {{0, 0, 0}};
+  bool half_l = false;
+  AxisOrder axis_order = AxisOrder::Unknown;
+  std::vector<Miller> hkls;
+  // equivalents of i-th reflection are in [start[i], start[i+1]);
+  // entries after start.back() are points already reached from another
+  // reflection (reflection duplicated_from[j - start.back()])
+  std::vector<size_t> start;
+  std::vector<int> index;
+  std::vector<std::complex<T>> phase_factor;  // exp(i * sign * phase_shift)
+  std::vector<signed char> sign;  // -1: stored as -hkl, value conjugated
+  std::vector<int> duplicated_from;
+  // (target, source) for add_friedel_mates
+  std::vector<std::pair<int, int>> friedel_pairs;
+
+  template<typename DataProxy>
+  bool matches(const DataProxy& data, std::array<int, 3> size_, bool half_l_,
+               AxisOrder axis_order_) const {
+    if (data.spacegroup() != spacegroup || size_ != size ||
+        half_l_ != half_l || axis_order_ != axis_order ||
+        data.size() / data.stride() != hkls.size())
+      return false;
+    auto hkl_col = data.hkl_col();
+    for (size_t n = 0, i = 0; n != hkls.size(); ++n, i += data.stride())
+      if (data.get_hkl(i, hkl_col) != hkls[n])
+        return false;
+    return true;
+  }
+
+  template<typename DataProxy>
+  void build(const DataProxy& data, std::array<int, 3> size_, bool half_l_,
+             AxisOrder axis_order_, int nthreads=0) {
+    // grid of flags: 1 where a symmetry equivalent has been placed
+    ReciprocalGrid<signed char> taken;
+    initialize_hkl_grid(taken, data, size_, half_l_, axis_order_);
+    spacegroup = data.spacegroup();
+    size = size_;
+    half_l = half_l_;
+    axis_order = axis_order_;
+    GroupOps ops = spacegroup->operations();
+    const size_t n_ops = ops.sym_ops.size();
+    const int n_refl = int(data.size() / data.stride());
+    hkls.resize(n_refl);
+    auto hkl_col = data.hkl_col();
+    // candidates for all (reflection, op) pairs are calculated in parallel
+    std::vector<int> cand_index(n_refl * n_ops);
+    std::vector<std::complex<T>> cand_factor(n_refl * n_ops);
+    std::vector<signed char> cand_sign(n_refl * n_ops);
+    parallel_for(0, n_refl, nthreads, [&](int begin, int end) {
+      for (int n = begin; n != end; ++n) {
+        Miller hkl = data.get_hkl(n * data.stride(), hkl_col);
+        hkls[n] = hkl;
+        for (size_t k = 0; k != n_ops; ++k) {
+          const Op& op = ops.sym_ops[k];
+          auto hklp = op.apply_to_hkl(hkl);
+          int lp = hklp[2];
+          if (axis_order == AxisOrder::ZYX)
+            std::swap(hklp[0], hklp[2]);
+          int sgn = (!half_l || lp >= 0 ? 1 : -1);
+          size_t c = n * n_ops + k;
+          cand_index[c] = taken.index_n(sgn * hklp[0], sgn * hklp[1],
+                                        sgn * hklp[2]);
+          cand_factor[c] = std::complex<T>(
+                              std::polar(1., sgn * op.phase_shift(hkl)));
+          cand_sign[c] = (signed char) sgn;
+        }
+      }
+    });
+    // the first candidate for each grid point is used in the scatter,
+    // candidates from later reflections are kept for the serial pass
+    start.resize(n_refl + 1);
+    index.clear();
+    phase_factor.clear();
+    sign.clear();
+    index.reserve(cand_index.size());
+    phase_factor.reserve(cand_index.size());
+    sign.reserve(cand_index.size());
+    duplicated_from.clear();
+    std::vector<size_t> duplicates;
+    for (int n = 0; n != n_refl; ++n) {
+      start[n] = index.size();
+      for (size_t c = n * n_ops; c != (n + 1) * n_ops; ++c) {
+        if (!taken.data[cand_index[c]]) {
+          taken.data[cand_index[c]] = 1;
+          index.push_back(cand_index[c]);
+          phase_factor.push_back(cand_factor[c]);
+          sign.push_back(cand_sign[c]);
+        } else if (std::find(index.begin() + start[n], index.end(),
+                             cand_index[c]) == index.end()) {
+          duplicates.push_back(c);
+        }
+      }
+    }
+    start[n_refl] = index.size();
+    for (size_t c : duplicates) {
+      index.push_back(cand_index[c]);
+      phase_factor.push_back(cand_factor[c]);
+      sign.push_back(cand_sign[c]);
+      duplicated_from.push_back(int(c / n_ops));
+    }
+    // the same points as visited in add_friedel_mates()
+    friedel_pairs.clear();
+    if (ops.is_centric())
+      return;
+    int nu = taken.nu, nv = taken.nv, nw = taken.nw;
+    int w_end = axis_order == AxisOrder::XYZ && half_l ? 1 : nw;
+    int u_end = axis_order == AxisOrder::ZYX && half_l ? 1 : nu;
+    for (int w = 0; w != w_end; ++w) {
+      int w_ = w == 0 ? 0 : nw - w;
+      for (int v = 0; v != nv; ++v) {
+        int v_ = v == 0 ? 0 : nv - v;
+        for (int u = 0; u != u_end; ++u) {
+          int u_ = u == 0 ? 0 : nu - u;
+          int inv_idx = taken.index_q(u_, v_, w_);
+          if (taken.data[inv_idx])
+            friedel_pairs.emplace_back(taken.index_q(u, v, w), inv_idx);
+        }
+      }
+    }
+  }
+
+  // Does the same as get_f_phi_on_grid(), reusing grid's memory.
+  template<typename DataProxy>
+  void fill_f_phi(FPhiGrid<T>& grid, const DataProxy& data,
+                  size_t f_col, size_t phi_col, int nthreads=0) const {
+    if (!matches(data, size, half_l, axis_order))
+      fail("HklExpansion: reflections do not match");
+    if (f_col >= data.stride() || phi_col >= data.stride())
+      fail("Map coefficients not found.");
+    initialize_hkl_grid(grid, data, size, half_l, axis_order);
+    std::complex<T>* out = grid.data.data();
+    parallel_for_each_index(grid.data.size(), nthreads, [&](size_t i) {
+        out[i] = std::complex<T>();
+    });
+    auto value = [&](int n, std::complex<T>& val) {
+      size_t offset = n * data.stride();
+      T f = (T) data.get_num(offset + f_col);
+      if (!(f > 0.f))
+        return false;
+      double phi = rad(data.get_num(offset + phi_col));
+      val = std::complex<T>(T(f * std::cos(phi)), T(f * std::sin(phi)));
+      return true;
+    };
+    parallel_for(0, (int) hkls.size(), nthreads, [&](int begin, int end) {
+      std::complex<T> val;
+      for (int n = begin; n != end; ++n)
+        if (value(n, val))
+          for (size_t j = start[n]; j != start[n+1]; ++j)
+            out[index[j]] = (sign[j] > 0 ? val : std::conj(val)) *
+                            phase_factor[j];
+    });
+    std::complex<T> val;
+    for (size_t j = start.back(); j != index.size(); ++j)
+      if (out[index[j]] == std::complex<T>() &&
+          value(duplicated_from[j - start.back()], val))
+        out[index[j]] = (sign[j] > 0 ? val : std::conj(val)) * phase_factor[j];
+    add_friedel_mates_(out, nthreads);
+  }
+
+  // Does the same as get_value_on_grid(), reusing grid's memory.
+  template<typename V, typename DataProxy>
+  void fill_values(ReciprocalGrid<V>& grid, const DataProxy& data,
+                   size_t column, int nthreads=0) const {
+    if (!matches(data, size, half_l, axis_order))
+      fail("HklExpansion: reflections do not match");
+    if (column >= data.stride())
+      fail("Map coefficients not found.");
+    initialize_hkl_grid(grid, data, size, half_l, axis_order);
+    V* out = grid.data.data();
+    parallel_for_each_index(grid.data.size(), nthreads, [&](size_t i) {
+        out[i] = V();
+    });
+    parallel_for(0, (int) hkls.size(), nthreads, [&](int begin, int end) {
+      for (int n = begin; n != end; ++n) {
+        V val = (V) data.get_num(n * data.stride() + column);
+        if (val != 0.)
+          for (size_t j = start[n]; j != start[n+1]; ++j)
+            out[index[j]] = val;
+      }
+    });
+    for (size_t j = start.back(); j != index.size(); ++j)
+      if (out[index[j]] == V()) {
+        size_t n = duplicated_from[j - start.back()];
+        out[index[j]] = (V) data.get_num(n * data.stride() + column);
+      }
+    add_friedel_mates_(out, nthreads);
+  }
+
+private:
+  // Only a target that is still 0 is filled and only from a non-zero
+  // source, so a pair never writes to a point read by another pair.
+  template<typename V>
+  void add_friedel_mates_(V* out, int nthreads) const {
+    parallel_for_each_index(friedel_pairs.size(), nthreads, [&](size_t i) {
+        const std::pair<int, int>& p = friedel_pairs[i];
+        if (out[p.first] == V() && out[p.second] != V())
+          out[p.first] = friedel_mate_value(out[p.second]);
+    });
+  }
+};
+
+// Fills grid (reusing its memory) with map coefficients from data.
 // If half_l is true, grid has only data with l>=0.
 // Parameter size can be obtained from get_size_for_hkl().
+// If a grid point is reached from more than one reflection, the first
+// reflection with F > 0 wins. The symmetry expansion is calculated for
+// this call only (in parallel, see HklExpansion); to fill grids of the
+// same size from the same reflections repeatedly, keep an HklExpansion.
+template<typename T, typename DataProxy>
+void fill_f_phi_on_grid(FPhiGrid<T>& grid, const DataProxy& data,
+                        size_t f_col, size_t phi_col,
+                        std::array<int, 3> size, bool half_l,
+                        AxisOrder axis_order=AxisOrder::XYZ,
+                        int nthreads=0) {
+  HklExpansion<T> expansion;
+  expansion.build(data, size, half_l, axis_order, nthreads);
+  expansion.fill_f_phi(grid, data, f_col, phi_col, nthreads);
+}
+
 template<typename T, typename DataProxy>
 FPhiGrid<T> get_f_phi_on_grid(const DataProxy& data,
                               size_t f_col, size_t phi_col,
                               std::array<int, 3> size, bool half_l,
-                              AxisOrder axis_order=AxisOrder::XYZ) {
+                              AxisOrder axis_order=AxisOrder::XYZ,
+                              int nthreads=0) {
   FPhiGrid<T> grid;
-  initialize_hkl_grid(grid, data, size, half_l, axis_order);
-
-  if (f_col >= data.stride() || phi_col >= data.stride())
-    fail("Map coefficients not found.");
-  const std::complex<T> default_val; // initialized to 0+0i
-  GroupOps ops = grid.spacegroup->operations();
-  auto hkl_col = data.hkl_col();
-  for (size_t i = 0; i < data.size(); i += data.stride()) {
-    Miller hkl = data.get_hkl(i, hkl_col);
-    T f = (T) data.get_num(i + f_col);
-    if (f > 0.f) {
-      double phi = rad(data.get_num(i + phi_col));
-      for (const Op& op : ops.sym_ops) {
-        auto hklp = op.apply_to_hkl(hkl);
-        double shifted_phi = phi + op.phase_shift(hkl);
-        int lp = hklp[2];
-        if (axis_order == AxisOrder::ZYX)
-          std::swap(hklp[0], hklp[2]);
-        int sign = (!half_l || lp >= 0 ? 1 : -1);
-        int idx = grid.index_n(sign * hklp[0], sign * hklp[1], sign * hklp[2]);
-        if (grid.data[idx] == default_val)
-          grid.data[idx] = std::polar(f, (T) (sign * shifted_phi));
-      }
-    }
-  }
-  if (!ops.is_centric())
-    add_friedel_mates(grid);
+  fill_f_phi_on_grid(grid, data, f_col, phi_col, size, half_l, axis_order,
+                     nthreads);
   return grid;
 }
 
+// Like get_f_phi_on_grid(), for a single column; the first non-zero
+// value wins.
 template<typename T, typename DataProxy>
 ReciprocalGrid<T> get_value_on_grid(const DataProxy& data, size_t column,
                                     std::array<int, 3> size, bool half_l,
-                                    AxisOrder axis_order=AxisOrder::XYZ) {
+                                    AxisOrder axis_order=AxisOrder::XYZ,
+                                    int nthreads=0) {
   ReciprocalGrid<T> grid;
-  initialize_hkl_grid(grid, data, size, half_l, axis_order);
-
-  if (column >= data.stride())
-    fail("Map coefficients not found.");
-  GroupOps ops = grid.spacegroup->operations();
-  auto hkl_col = data.hkl_col();
-  for (size_t i = 0; i < data.size(); i += data.stride()) {
-    Miller hkl = data.get_hkl(i, hkl_col);
-    T val = (T) data.get_num(i + column);
-    if (val != 0.) {
-      for (const Op& op : ops.sym_ops) {
-        auto hklp = op.apply_to_hkl(hkl);
-        int lp = hklp[2];
-        if (axis_order == AxisOrder::ZYX)
-          std::swap(hklp[0], hklp[2]);
-        int sign = (!half_l || lp >= 0 ? 1 : -1);
-        int idx = grid.index_n(sign * hklp[0], sign * hklp[1], sign * hklp[2]);
-        if (grid.data[idx] == 0.)  // 0 is the default value
-          grid.data[idx] = val;
-      }
-    }
-  }
-  if (!ops.is_centric())
-    add_friedel_mates(grid);
+  HklExpansion<T> expansion;
+  expansion.build(data, size, half_l, axis_order, nthreads);
+  expansion.fill_values(grid, data, column, nthreads);
   return grid;
 }
 
-
+namespace impl {
+// sets metadata and size of the map that is calculated from hkl
 template<typename T>
-void transform_f_phi_grid_to_map_(FPhiGrid<T>&& hkl, Grid<T>& map) {
-  // x -> conj(x) is equivalent to changing axis direction before FFT
-  for (std::complex<T>& x : hkl.data)
-    x.imag(-x.imag());
+void prepare_map_for_f_phi_grid(const FPhiGrid<T>& hkl, Grid<T>& map) {
   map.spacegroup = hkl.spacegroup;
   map.unit_cell = hkl.unit_cell;
   map.axis_order = hkl.axis_order;
@@ -234,6 +430,56 @@ void transform_f_phi_grid_to_map_(FPhiGrid<T>&& hkl, Grid<T>& map) {
     check_grid_factors(map.spacegroup, hkl.nw, hkl.nv, nu);
     map.set_size_without_checking(nu, hkl.nv, hkl.nw);
   }
+}
+} // namespace impl
+
+// Precision of the FFT passes; grids are stored in T in either case.
+// Native: the transform is done in T. For T=float the rms error grows as
+// ~eps*sqrt(log2 N); it is ~2e-7 of the rms of values for grids of
+// 128^3-256^3 points (3e-7 after a roundtrip), far below the noise in
+// experimental maps. Compared with double, memory traffic is halved and
+// SIMD lanes are doubled, so the transform is ~2x faster (128^3-256^3,
+// benchmarks/bench_fft.cpp).
+// Double (opt-in): float data is converted to double, transformed and
+// rounded back, so only the final rounding to float is left. It is slower
+// than both native transforms and needs temporary grids in double; use it
+// for reference calculations or when the results are accumulated.
+enum class FftPrecision : unsigned char { Native, Double };
+
+namespace impl {
+// copies metadata and converts values (complex<float> <-> complex<double>)
+template<typename To, typename From>
+void copy_grid_base_as(const GridBase<From>& src, GridBase<To>& dst) {
+  dst.unit_cell = src.unit_cell;
+  dst.spacegroup = src.spacegroup;
+  dst.axis_order = src.axis_order;
+  dst.nu = src.nu, dst.nv = src.nv, dst.nw = src.nw;
+  dst.data.resize(src.data.size());
+  std::copy(src.data.begin(), src.data.end(), dst.data.begin());
+}
+} // namespace impl
+
+// nthreads <= 0 means the default (see set_default_thread_count()).
+template<typename T>
+void transform_f_phi_grid_to_map_(FPhiGrid<T>&& hkl, Grid<T>& map,
+                                  int nthreads=0,
+                                  FftPrecision precision=FftPrecision::Native) {
+  if (precision == FftPrecision::Double && !std::is_same<T, double>::value) {
+    FPhiGrid<double> hkl_d;
+    impl::copy_grid_base_as(hkl, hkl_d);
+    hkl_d.half_l = hkl.half_l;
+    std::vector<std::complex<T>>().swap(hkl.data);
+    Grid<double> map_d;
+    transform_f_phi_grid_to_map_(std::move(hkl_d), map_d, nthreads);
+    impl::copy_grid_base_as(map_d, map);
+    map.calculate_spacing();
+    return;
+  }
+  size_t nt = (size_t) resolve_thread_count(nthreads);
+  // x -> conj(x) is equivalent to changing axis direction before FFT
+  for (std::complex<T>& x : hkl.data)
+    x.imag(-x.imag());
+  impl::prepare_map_for_f_phi_grid(hkl, map);
   pocketfft::shape_t shape{(size_t)hkl.nw, (size_t)hkl.nv, (size_t)hkl.nu};
   std::ptrdiff_t s = sizeof(T);
   pocketfft::stride_t stride{2*s * hkl.nv * hkl.nu, 2*s * hkl.nu, 2*s};
@@ -245,15 +491,15 @@ void transform_f_phi_grid_to_map_(FPhiGrid<T>&& hkl, Grid<T>& map) {
     size_t last_axis = axes.back();
     axes.pop_back();
     pocketfft::c2c<T>(shape, stride, stride, axes, pocketfft::BACKWARD,
-                      &hkl.data[0], &hkl.data[0], norm);
+                      &hkl.data[0], &hkl.data[0], norm, nt);
     pocketfft::stride_t stride_out{map.nv * map.nu * s, map.nu * s, s};
     shape[0] = (size_t) map.nw;
     shape[2] = (size_t) map.nu;
     pocketfft::c2r<T>(shape, stride, stride_out, last_axis, pocketfft::BACKWARD,
-                      &hkl.data[0], &map.data[0], 1.0f);
+                      &hkl.data[0], &map.data[0], 1.0f, nt);
   } else {
     pocketfft::c2c<T>(shape, stride, stride, axes, pocketfft::BACKWARD,
-                      &hkl.data[0], &hkl.data[0], norm);
+                      &hkl.data[0], &hkl.data[0], norm, nt);
     assert(map.data.size() == hkl.data.size());
     for (size_t i = 0; i != map.data.size(); ++i)
       map.data[i] = hkl.data[i].real();
@@ -261,18 +507,92 @@ void transform_f_phi_grid_to_map_(FPhiGrid<T>&& hkl, Grid<T>& map) {
 }
 
 template<typename T>
-Grid<T> transform_f_phi_grid_to_map(FPhiGrid<T>&& hkl) {
+Grid<T> transform_f_phi_grid_to_map(FPhiGrid<T>&& hkl, int nthreads=0,
+                               FftPrecision precision=FftPrecision::Native) {
   Grid<T> map;
-  transform_f_phi_grid_to_map_(std::forward<FPhiGrid<T>>(hkl), map);
+  transform_f_phi_grid_to_map_(std::forward<FPhiGrid<T>>(hkl), map, nthreads,
+                               precision);
   return map;
 }
 
+// Transforms a stack of grids of the same size and kind; the content of
+// hkls is released. The grids are copied into one array with an extra
+// (batch) axis, so that the complex-to-complex passes are a single call
+// to pocketfft over the lines of all datasets, split between threads.
+// The last, complex-to-real pass writes to separate maps, one by one.
+// Only the sizes must be the same: each map gets the unit cell and space
+// group of its grid and is scaled by 1/V of its own cell.
+// Peak memory is the same as when transforming the grids one by one:
+// each input grid is freed after it has been copied.
+// The transform is done in T (FftPrecision::Native).
+template<typename T>
+std::vector<Grid<T>> transform_f_phi_grids_to_maps(
+                        std::vector<FPhiGrid<T>>&& hkls, int nthreads=0) {
+  std::vector<Grid<T>> maps(hkls.size());
+  if (hkls.empty())
+    return maps;
+  const FPhiGrid<T>& first = hkls[0];  // only the size is used below
+  for (const FPhiGrid<T>& hkl : hkls)
+    if (hkl.nu != first.nu || hkl.nv != first.nv || hkl.nw != first.nw ||
+        hkl.half_l != first.half_l || hkl.axis_order != first.axis_order)
+      fail("transform_f_phi_grids_to_maps: grids differ in size");
+  size_t nt = (size_t) resolve_thread_count(nthreads);
+  const size_t n = hkls.size();
+  const size_t points = hkls[0].data.size();
+  // not initialized (unlike std::vector); complex<T> is an array of two T
+  std::unique_ptr<T[]> buffer(new T[2 * n * points]);
+  std::complex<T>* stack = reinterpret_cast<std::complex<T>*>(buffer.get());
+  for (size_t i = 0; i != n; ++i) {
+    // x -> conj(x) is equivalent to changing axis direction before FFT
+    std::complex<T>* out = &stack[i * points];
+    for (const std::complex<T>& x : hkls[i].data)
+      *out++ = std::conj(x);
+    std::vector<std::complex<T>>().swap(hkls[i].data);
+    impl::prepare_map_for_f_phi_grid(hkls[i], maps[i]);
+  }
+  std::ptrdiff_t s = sizeof(T);
+  pocketfft::shape_t shape{n, (size_t)first.nw, (size_t)first.nv,
+                           (size_t)first.nu};
+  pocketfft::stride_t stride{2*s * (std::ptrdiff_t)points,
+                             2*s * first.nv * first.nu, 2*s * first.nu, 2*s};
+  pocketfft::shape_t axes{3, 2, 1};
+  if (first.axis_order == AxisOrder::ZYX)
+    std::swap(axes[0], axes[2]);
+  // 1/V is applied in the last pass, separately for each dataset
+  if (first.half_l) {
+    size_t last_axis = axes.back() - 1;  // in 3D shape of one grid
+    axes.pop_back();
+    pocketfft::c2c<T>(shape, stride, stride, axes, pocketfft::BACKWARD,
+                      stack, stack, T(1), nt);
+    const Grid<T>& m0 = maps[0];
+    pocketfft::shape_t shape_out{(size_t)m0.nw, (size_t)m0.nv, (size_t)m0.nu};
+    stride.erase(stride.begin());
+    pocketfft::stride_t stride_out{m0.nv * m0.nu * s, m0.nu * s, s};
+    for (size_t i = 0; i != n; ++i)
+      pocketfft::c2r<T>(shape_out, stride, stride_out, last_axis,
+                        pocketfft::BACKWARD, &stack[i * points],
+                        &maps[i].data[0], T(1.0 / maps[i].unit_cell.volume),
+                        nt);
+  } else {
+    pocketfft::c2c<T>(shape, stride, stride, axes, pocketfft::BACKWARD,
+                      stack, stack, T(1), nt);
+    for (size_t i = 0; i != n; ++i) {
+      T norm = T(1.0 / maps[i].unit_cell.volume);
+      for (size_t j = 0; j != points; ++j)
+        maps[i].data[j] = norm * stack[i * points + j].real();
+    }
+  }
+  return maps;
+}
+
 template<typename T, typename DataProxy>
 Grid<T> transform_f_phi_to_map(const DataProxy& data,
                                size_t f_col, size_t phi_col,
                                std::array<int, 3> size,
                                double sample_rate,
-                               bool exact_size=false) {
+                               bool exact_size=false,
+                               int nthreads=0,
+                               FftPrecision precision=FftPrecision::Native) {
   if (exact_size) {
     gemmi::check_if_hkl_fits_in(data, size);
     gemmi::check_grid_factors(data.spacegroup(), size[0], size[1], size[2]);
@@ -280,15 +600,31 @@ Grid<T> transform_f_phi_to_map(const DataProxy& data,
     size = get_size_for_hkl(data, size, sample_rate);
   }
   return transform_f_phi_grid_to_map(get_f_phi_on_grid<T>(data, f_col, phi_col,
-                                                          size, true));
+                                                          size, true,
+                                                          AxisOrder::XYZ,
+                                                          nthreads),
+                                     nthreads, precision);
 }
 
 template<typename T>
-FPhiGrid<T> transform_map_to_f_phi(const Grid<T>& map, bool half_l) {
-  FPhiGrid<T> hkl;
+void transform_map_to_f_phi_(const Grid<T>& map, FPhiGrid<T>& hkl,
+                             bool half_l, int nthreads=0,
+                             FftPrecision precision=FftPrecision::Native) {
+  if (precision == FftPrecision::Double && !std::is_same<T, double>::value) {
+    Grid<double> map_d;
+    impl::copy_grid_base_as(map, map_d);
+    map_d.calculate_spacing();
+    FPhiGrid<double> hkl_d;
+    transform_map_to_f_phi_(map_d, hkl_d, half_l, nthreads);
+    impl::copy_grid_base_as(hkl_d, hkl);
+    hkl.half_l = half_l;
+    return;
+  }
+  size_t nt = (size_t) resolve_thread_count(nthreads);
   hkl.unit_cell = map.unit_cell;
   hkl.half_l = half_l;
   hkl.spacegroup = map.spacegroup;
+  hkl.axis_order = AxisOrder::XYZ;
   int half_nw = map.nw / 2 + 1;
   hkl.set_size_without_checking(map.nu, map.nv, half_l ? half_nw : map.nw);
   T norm = T(map.unit_cell.volume / map.point_count());
@@ -297,10 +633,10 @@ FPhiGrid<T> transform_map_to_f_phi(const Grid<T>& map, bool half_l) {
   pocketfft::stride_t stride_in{s * hkl.nv * hkl.nu, s * hkl.nu, s};
   pocketfft::stride_t stride{2*s * hkl.nv * hkl.nu, 2*s * hkl.nu, 2*s};
   pocketfft::r2c<T>(shape, stride_in, stride, /*axis=*/0, pocketfft::FORWARD,
-                    &map.data[0], &hkl.data[0], norm);
+                    &map.data[0], &hkl.data[0], norm, nt);
   shape[0] = half_nw;
   pocketfft::c2c<T>(shape, stride, stride, {1, 2}, pocketfft::FORWARD,
-                    &hkl.data[0], &hkl.data[0], 1.0f);
+                    &hkl.data[0], &hkl.data[0], 1.0f, nt);
   if (!half_l)  // add Friedel pairs
     for (int w = half_nw; w != hkl.nw; ++w) {
       int w_ = hkl.nw - w;
@@ -316,8 +652,123 @@ FPhiGrid<T> transform_map_to_f_phi(const Grid<T>& map, bool half_l) {
     }
   for (int i = 0; i != hkl.nu * hkl.nv * half_nw; ++i)
     hkl.data[i].imag(-hkl.data[i].imag());
+}
+
+template<typename T>
+FPhiGrid<T> transform_map_to_f_phi(const Grid<T>& map, bool half_l,
+                                   int nthreads=0,
+                               FftPrecision precision=FftPrecision::Native) {
+  FPhiGrid<T> hkl;
+  transform_map_to_f_phi_(map, hkl, half_l, nthreads, precision);
   return hkl;
 }
 
+// Unique reflections as separate, contiguous arrays.
+template<typename T>
+struct AsuFPhiData {
+  std::vector<Miller> hkl;
+  std::vector<T> f;
+  std::vector<T> phi;  // in degrees
+};
+
+// Like transform_map_to_f_phi(), but returns only reflections with
+// d >= dmin from the reciprocal-space ASU (HklAsuChecker) of the map's
+// space group, without systematic absences and Nyquist terms.
+// The dense grid is used only internally.
+template<typename T>
+AsuFPhiData<T> transform_map_to_f_phi_asu(const Grid<T>& map, double dmin,
+                                          int nthreads=0) {
+  if (map.axis_order != AxisOrder::XYZ)
+    fail("transform_map_to_f_phi_asu: grid must cover the unit cell in XYZ");
+  if (!(dmin > 0))
+    fail("transform_map_to_f_phi_asu: dmin must be positive");
+  FPhiGrid<T> hkl;
+  transform_map_to_f_phi_(map, hkl, /*half_l=*/true, nthreads);
+  const SpaceGroup* sg = map.spacegroup ? map.spacegroup
+                                        : &get_spacegroup_p1();
+  HklAsuChecker asu(sg);
+  GroupOps gops = sg->operations();
+  const double max_1_d2 = 1. / (dmin * dmin);
+  // one list per l, concatenated in order at the end
+  std::vector<AsuFPhiData<T>> parts(hkl.nw);
+  parallel_for_dynamic(hkl.nw, nthreads, [&](int w) {
+    AsuFPhiData<T>& part = parts[w];
+    // l = w and l = -w (from Friedel mates: F(-h) = conj(F(h)))
+    for (int v = 0; v != hkl.nv; ++v) {
+      int k = v * 2 <= hkl.nv ? v : v - hkl.nv;
+      for (int u = 0; u != hkl.nu; ++u) {
+        int h = u * 2 <= hkl.nu ? u : u - hkl.nu;
+        if (2 * std::abs(h) == hkl.nu || 2 * std::abs(k) == hkl.nv ||
+            2 * w == map.nw)
+          continue;
+        Miller m = {{h, k, w}};
+        if (hkl.unit_cell.calculate_1_d2(m) > max_1_d2)
+          continue;
+        const std::complex<T>& val = hkl.data[hkl.index_q(u, v, w)];
+        for (int sign : {1, -1}) {
+          if (sign == -1) {
+            if (w == 0)  // -h is also in the half grid
+              break;
+            m = {{-h, -k, -w}};
+          }
+          if (asu.is_in(m[0], m[1], m[2]) &&
+              !gops.is_systematically_absent(m)) {
+            std::complex<T> c = sign == 1 ? val : std::conj(val);
+            part.hkl.push_back(m);
+            part.f.push_back(std::abs(c));
+            part.phi.push_back((T) phase_in_angles(c));
+          }
+        }
+      }
+    }
+  });
+  AsuFPhiData<T> result;
+  for (AsuFPhiData<T>& part : parts) {
+    result.hkl.insert(result.hkl.end(), part.hkl.begin(), part.hkl.end());
+    result.f.insert(result.f.end(), part.f.begin(), part.f.end());
+    result.phi.insert(result.phi.end(), part.phi.begin(), part.phi.end());
+  }
+  return result;
+}
+
+// Buffers for repeated transforms, typically of the same size, in
+// long-running workers. Memory of hkl and map is reused between calls
+// (it is only re-allocated when the size grows). 1D FFT plans are cached
+// by pocketfft (LRU cache keyed by length), so with a constant size
+// each call costs only the transform itself.
+template<typename T>
+struct FftWorkspace {
+  FPhiGrid<T> hkl;
+  Grid<T> map;
+  HklExpansion<T> expansion;
+  int nthreads = 0;
+  FftPrecision precision = FftPrecision::Native;
+
+  explicit FftWorkspace(int nthreads_=0) : nthreads(nthreads_) {}
+
+  // reads map coefficients into hkl (with half_l=true); the symmetry
+  // expansion is re-calculated only when reflections or size change
+  template<typename DataProxy>
+  FPhiGrid<T>& set_f_phi(const DataProxy& data, size_t f_col, size_t phi_col,
+                         std::array<int, 3> size) {
+    if (!expansion.matches(data, size, true, AxisOrder::XYZ))
+      expansion.build(data, size, true, AxisOrder::XYZ, nthreads);
+    expansion.fill_f_phi(hkl, data, f_col, phi_col, nthreads);
+    return hkl;
+  }
+
+  // hkl -> map; the content of hkl is overwritten
+  Grid<T>& f_phi_to_map() {
+    transform_f_phi_grid_to_map_(std::move(hkl), map, nthreads, precision);
+    return map;
+  }
+
+  // map -> hkl
+  FPhiGrid<T>& map_to_f_phi(bool half_l=true) {
+    transform_map_to_f_phi_(map, hkl, half_l, nthreads, precision);
+    return hkl;
+  }
+};
+
 } // namespace gemmi
 #endif
@@ -8,6 +8,7 @@
 #include <cassert>
 #include <complex>
 #include <algorithm>  // for fill
+#include <memory>     // for shared_ptr
 #include <numeric>    // for accumulate
 #include <vector>
 #include "unitcell.hpp"
@@ -100,6 +101,37 @@ std::complex<T> lerp_(std::complex<T> a, std::complex<T> b, double t) {
 
 template<typename T, typename V=std::int8_t> struct MaskedGrid;
 
+namespace impl {
+// https://en.wikipedia.org/wiki/Trilinear_interpolation
+// Used by Grid and GridView; x, y, z are grid coordinates, 0 <= x < nu, etc.
+template<typename G>
+typename G::value_type interpolate_grid_value(const G& g, double x, double y,
+                                              double z) {
+  using T = typename G::value_type;
+  double tmp;
+  double xd = std::modf(x, &tmp);
+  int u = (int) tmp;
+  double yd = std::modf(y, &tmp);
+  int v = (int) tmp;
+  double zd = std::modf(z, &tmp);
+  int w = (int) tmp;
+  assert(u >= 0 && v >= 0 && w >= 0);
+  assert(u < g.nu && v < g.nv && w < g.nw);
+  T avg[2];
+  for (int i = 0; i < 2; ++i) {
+    int wi = (i == 0 || w + 1 != g.nw ? w + i : 0);
+    size_t idx1 = g.index_q(u, v, wi);
+    int v2 = v + 1 != g.nv ? v + 1 : 0;
+    size_t idx2 = g.index_q(u, v2, wi);
+    int u_add = u + 1 != g.nu ? 1 : -u;
+    avg[i] = (T) lerp_(lerp_(g.data[idx1], g.data[idx1 + u_add], xd),
+                       lerp_(g.data[idx2], g.data[idx2 + u_add], xd),
+                       yd);
+  }
+  return (T) lerp_(avg[0], avg[1], zd);
+}
+} // namespace impl
+
 // Order of grid axis. Some Grid functionality works only with the XYZ order.
 // The values XYZ and XYZ are used only when the grid covers whole unit cell.
 enum class AxisOrder : unsigned char {
@@ -109,12 +141,117 @@ enum class AxisOrder : unsigned char {
   ZYX   // fast Z (or L), may not be fully supported everywhere
 };
 
+// Storage for grid values used by GridView. By default the values are
+// owned (std::vector), but the storage can also point to external memory:
+// a numpy array, shared memory or a memory-mapped file. External memory
+// is kept alive by keeper (if set). Copying always copies the values;
+// share() makes another storage that refers to the same memory.
+template<typename T>
+struct GridStorage {
+  using value_type = T;
+
+  GridStorage() = default;
+  GridStorage(const GridStorage& o) { operator=(o); }
+  GridStorage(GridStorage&& o) noexcept { operator=(std::move(o)); }
+  GridStorage& operator=(const GridStorage& o) {
+    if (this != &o)
+      assign(o.begin(), o.end());
+    return *this;
+  }
+  GridStorage& operator=(GridStorage&& o) noexcept {
+    vec_ = std::move(o.vec_);
+    owned_ = o.owned_;
+    ptr_ = owned_ ? vec_.data() : o.ptr_;
+    size_ = o.size_;
+    keeper_ = std::move(o.keeper_);
+    o.release();
+    return *this;
+  }
+  GridStorage& operator=(std::vector<T>&& v) {
+    release();
+    vec_ = std::move(v);
+    ptr_ = vec_.data();
+    size_ = vec_.size();
+    return *this;
+  }
+
+  // Copies values [first, last) to owned memory.
+  void assign(const T* first, const T* last) {
+    std::vector<T> v(first, last);
+    operator=(std::move(v));
+  }
+
+  // Use n values at ptr without copying. The caller must keep the memory
+  // alive for the lifetime of this storage (and of its shares), or pass
+  // a keeper that does it.
+  void borrow(T* ptr, size_t n, std::shared_ptr<void> keeper=nullptr) {
+    std::vector<T>().swap(vec_);
+    owned_ = false;
+    ptr_ = ptr;
+    size_ = n;
+    keeper_ = std::move(keeper);
+  }
+
+  // Returns storage that refers to the same values (no copy). If this
+  // storage is owned, it must outlive the returned one.
+  GridStorage share() {
+    GridStorage r;
+    r.borrow(ptr_, size_, keeper_);
+    return r;
+  }
+
+  bool is_owned() const { return owned_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  T* data() { return ptr_; }
+  const T* data() const { return ptr_; }
+  T& operator[](size_t i) { return ptr_[i]; }
+  const T& operator[](size_t i) const { return ptr_[i]; }
+  T* begin() { return ptr_; }
+  T* end() { return ptr_ + size_; }
+  const T* begin() const { return ptr_; }
+  const T* end() const { return ptr_ + size_; }
+
+  // Non-owned memory cannot be resized, but "resizing" to the same size
+  // is allowed.
+  void resize(size_t n) {
+    if (!owned_) {
+      if (n == size_)
+        return;
+      fail("grid data is not owned and cannot be resized");
+    }
+    vec_.resize(n);
+    ptr_ = vec_.data();
+    size_ = n;
+  }
+  // Makes the storage empty and owned.
+  void clear() {
+    release();
+  }
+
+private:
+  std::vector<T> vec_;
+  T* ptr_ = nullptr;
+  size_t size_ = 0;
+  std::shared_ptr<void> keeper_;
+  bool owned_ = true;
+
+  void release() {
+    std::vector<T>().swap(vec_);
+    owned_ = true;
+    ptr_ = nullptr;
+    size_ = 0;
+    keeper_.reset();
+  }
+};
+
 template<typename T>
 struct GridBase {
   struct Point {
     int u, v, w;
     T* value;
   };
+  using value_type = T;
 
   UnitCell unit_cell;
   const SpaceGroup* spacegroup = nullptr;
@@ -247,29 +384,9 @@ struct Grid : GridBase<T> {
     return unit_cell.orthogonalize(this->point_to_fractional(p));
   }
 
-  // https://en.wikipedia.org/wiki/Trilinear_interpolation
+  // trilinear, see impl::interpolate_grid_value()
   T interpolate_value(double x, double y, double z) const {
-    double tmp;
-    double xd = std::modf(x, &tmp);
-    int u = (int) tmp;
-    double yd = std::modf(y, &tmp);
-    int v = (int) tmp;
-    double zd = std::modf(z, &tmp);
-    int w = (int) tmp;
-    assert(u >= 0 && v >= 0 && w >= 0);
-    assert(u < nu && v < nv && w < nw);
-    T avg[2];
-    for (int i = 0; i < 2; ++i) {
-      int wi = (i == 0 || w + 1 != nw ? w + i : 0);
-      int idx1 = this->index_q(u, v, wi);
-      int v2 = v + 1 != nv ? v + 1 : 0;
-      int idx2 = this->index_q(u, v2, wi);
-      int u_add = u + 1 != nu ? 1 : -u;
-      avg[i] = (T) lerp_(lerp_(data[idx1], data[idx1 + u_add], xd),
-                         lerp_(data[idx2], data[idx2 + u_add], xd),
-                         yd);
-    }
-    return (T) lerp_(avg[0], avg[1], zd);
+    return impl::interpolate_grid_value(*this, x, y, z);
   }
   T interpolate_value(const Fractional& fctr) const {
     Fractional f = fctr.wrap_to_unit();
@@ -502,5 +619,101 @@ struct ReciprocalGrid : GridBase<T> {
 
 template<typename T> using FPhiGrid = ReciprocalGrid<std::complex<T>>;
 
+// Grid values in memory that can be owned by someone else (numpy array,
+// memory-mapped file). It is a separate type, because Grid must keep
+// the same layout as in gemmi (Grid objects are passed between modules).
+// GridView has the read accessors of Grid (index_q, index_n, get_value,
+// interpolate_value, spacing), so algorithms that only read a grid are
+// templated on the grid type and take a view without copying the values:
+// find_peaks() and resample() (as the source). Other algorithms need
+// a Grid (see to_grid()).
+template<typename T>
+struct GridView {
+  using value_type = T;
+
+  UnitCell unit_cell;
+  const SpaceGroup* spacegroup = nullptr;
+  GridStorage<T> data;
+  int nu = 0, nv = 0, nw = 0;
+  AxisOrder axis_order = AxisOrder::Unknown;
+  bool read_only = false;  // the memory must not be written to
+  double spacing[3] = {0., 0., 0.};
+
+  void calculate_spacing() {
+    spacing[0] = 1.0 / (nu * unit_cell.ar);
+    spacing[1] = 1.0 / (nv * unit_cell.br);
+    spacing[2] = 1.0 / (nw * unit_cell.cr);
+  }
+
+  template<typename G> void copy_metadata_from(const G& g) {
+    unit_cell = g.unit_cell;
+    spacegroup = g.spacegroup;
+    nu = g.nu;
+    nv = g.nv;
+    nw = g.nw;
+    axis_order = g.axis_order;
+    calculate_spacing();
+  }
+
+  // View of grid.data without copying; the grid must outlive the view.
+  static GridView of(Grid<T>& grid) {
+    GridView view;
+    view.copy_metadata_from(grid);
+    view.data.borrow(grid.data.data(), grid.data.size());
+    return view;
+  }
+
+  size_t point_count() const { return (size_t) nu * nv * nw; }
+  size_t index_q(int u, int v, int w) const {
+    return ((size_t) w * nv + v) * nu + u;
+  }
+  // Assumes (for efficiency) that -nu <= u < 2*nu, etc.
+  size_t index_n(int u, int v, int w) const {
+    if (u >= nu) u -= nu; else if (u < 0) u += nu;
+    if (v >= nv) v -= nv; else if (v < 0) v += nv;
+    if (w >= nw) w -= nw; else if (w < 0) w += nw;
+    return index_q(u, v, w);
+  }
+  size_t index_s(int u, int v, int w) const {
+    return index_q(modulo(u, nu), modulo(v, nv), modulo(w, nw));
+  }
+  T get_value_q(int u, int v, int w) const { return data[index_q(u, v, w)]; }
+  T get_value(int u, int v, int w) const { return data[index_s(u, v, w)]; }
+
+  T interpolate_value(double x, double y, double z) const {
+    return impl::interpolate_grid_value(*this, x, y, z);
+  }
+  T interpolate_value(const Fractional& fctr) const {
+    Fractional f = fctr.wrap_to_unit();
+    return interpolate_value(f.x * nu, f.y * nv, f.z * nw);
+  }
+  T interpolate_value(const Position& ctr) const {
+    return interpolate_value(unit_cell.fractionalize(ctr));
+  }
+
+  // Another view of the same values (no copy).
+  GridView share() {
+    GridView view;
+    view.copy_metadata_from(*this);
+    view.read_only = read_only;
+    view.data = data.share();
+    return view;
+  }
+
+  // Copies the values to a Grid.
+  Grid<T> to_grid() const {
+    Grid<T> grid;
+    grid.unit_cell = unit_cell;
+    grid.spacegroup = spacegroup;
+    grid.nu = nu;
+    grid.nv = nv;
+    grid.nw = nw;
+    grid.axis_order = axis_order;
+    grid.calculate_spacing();
+    grid.data.assign(data.begin(), data.end());
+    return grid;
+  }
+};
+
 } // namespace gemmi
 #endif
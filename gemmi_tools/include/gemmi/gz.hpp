@@ -12,6 +12,7 @@
 #include <zlib.h>
 #include "fail.hpp"     // fail
 #include "fileutil.hpp" // file_open
+#include "gzindex.hpp"  // decompress_gz_file, GzParallelReader
 #include "input.hpp"    // BasicInput
 #include "util.hpp"     // iends_with
 
@@ -77,22 +78,29 @@ public:
   }
   size_t memory_size() const { return memory_size_; }
 
+  // uses multiple threads if possible, see decompress_gz_file();
+  // doesn't write the index cache next to the file (reading a file
+  // should not create files)
   std::unique_ptr<char[]> memory() {
     if (!is_compressed())
       return BasicInput::memory();
-    memory_size_ = estimate_uncompressed_size(path());
-    open();
-    if (memory_size_ > 3221225471)
-      fail("For now gz files above 3 GiB uncompressed are not supported.");
-    std::unique_ptr<char[]> mem(new char[memory_size_]);
-    bool ok = big_gzread(file_, mem.get(), memory_size_);
-    if (!ok && !gzeof(file_)) {
-      int errnum;
-      std::string err_str = gzerror(file_, &errnum);
-      if (errnum)
-        fail("Error reading " + path() + ": " + err_str);
-    }
-    return mem;
+    return decompress_gz_file(path(), memory_size_, 0, false);
+  }
+
+  // Decompresses len bytes, starting at offset in the uncompressed data,
+  // using multiple threads. Returns false if the file is not compressed
+  // or if it can't be decompressed in parallel (see GzParallelReader):
+  // to make any gz file readable in parallel, cache its index first
+  // with get_gz_index().
+  bool read_in_parallel(std::uint64_t offset, void* buf, size_t len,
+                        int nthreads=0) {
+    if (!is_compressed())
+      return false;
+    GzParallelReader reader;
+    if (!reader.open(path()))
+      return false;
+    reader.read(offset, buf, len, nthreads);
+    return true;
   }
 
   GzStream get_uncompressing_stream() {
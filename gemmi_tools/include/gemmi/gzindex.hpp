@@ -0,0 +1,751 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Random access to gzipped files using an index of access points
+// (the method from zran.c in zlib examples). The index is built by
+// decompressing the file once and it can be cached in a file next to
+// the gz file. Also, parallel decompression and compression of whole
+// files.
+
+#ifndef GEMMI_GZINDEX_HPP_
+#define GEMMI_GZINDEX_HPP_
+
+#include <algorithm>    // for min, max, upper_bound, lower_bound
+#include <cstdint>      // for uint64_t, int64_t, uint32_t
+#include <cstdio>       // for FILE, fread, fwrite, rename, remove
+#include <cstring>      // for memcpy, memmove, memset
+#include <memory>       // for unique_ptr
+#include <functional>   // for hash
+#include <string>
+#include <thread>       // for this_thread::get_id
+#include <vector>
+#include <sys/stat.h>   // for stat
+#ifdef _WIN32
+# include <process.h>   // for _getpid
+#else
+# include <unistd.h>    // for getpid
+#endif
+#include <zlib.h>
+#include "fail.hpp"     // for fail
+#include "fileutil.hpp" // for file_open, fileptr_t
+#include "input.hpp"    // for FileStream
+#include "threads.hpp"  // for parallel_for, parallel_for_dynamic
+
+namespace gemmi {
+
+struct GzAccessPoint {
+  std::uint64_t out;  // offset in the uncompressed data
+  std::uint64_t in;   // offset of the first complete byte in the gz file
+  int bits;           // if non-zero, bits from the byte before in are used
+  bool member_start;  // at the start (gzip header) of a gzip member
+  std::vector<unsigned char> window;  // up to 32kB of data before out
+};
+
+struct GzIndex {
+  std::string path;           // gz file
+  std::uint64_t gz_size = 0;  // size and modification time of the gz file,
+  std::int64_t gz_mtime = 0;  // to check if the cached index is up-to-date
+  std::uint64_t span = 0;     // requested distance between access points
+  std::uint64_t uncompressed_size = 0;
+  std::vector<GzAccessPoint> points;
+
+  // the last access point at or before offset
+  const GzAccessPoint& point_before(std::uint64_t offset) const {
+    auto it = std::upper_bound(points.begin(), points.end(), offset,
+                   [](std::uint64_t x, const GzAccessPoint& p) {
+                     return x < p.out;
+                   });
+    return *(it - 1);
+  }
+};
+
+namespace impl {
+
+constexpr unsigned gz_window_size = 32768;
+constexpr unsigned gz_chunk_size = 65536;
+
+inline bool seek_file(std::FILE* f, std::uint64_t offset) {
+  return FileStream{f}.seek(offset);
+}
+
+inline void gz_file_stat(const std::string& path, std::uint64_t& size,
+                         std::int64_t& mtime) {
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0)
+    fail("Failed to stat file: " + path);
+  size = (std::uint64_t) st.st_size;
+  mtime = (std::int64_t) st.st_mtime;
+}
+
+// Writes buf to a temporary file next to path and renames it to path,
+// so that other processes never see a partially written file. The name
+// of the temporary file includes the process and thread id, so that
+// processes writing the same file at the same time don't interfere.
+inline void write_file_via_temp(const std::string& path,
+                                const std::vector<unsigned char>& buf) {
+#ifdef _WIN32
+  long pid = (long) _getpid();
+#else
+  long pid = (long) getpid();
+#endif
+  size_t tid = std::hash<std::thread::id>()(std::this_thread::get_id());
+  std::string tmp_path = path + "." + std::to_string(pid) + "-" +
+                         std::to_string(tid % 1000000) + ".tmp";
+  {
+    fileptr_t f = file_open(tmp_path.c_str(), "wb");
+    if (std::fwrite(buf.data(), 1, buf.size(), f.get()) != buf.size() ||
+        std::fflush(f.get()) != 0) {
+      f.reset();
+      std::remove(tmp_path.c_str());
+      fail("Failed to write " + tmp_path);
+    }
+  }
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    fail("Failed to write " + path);
+  }
+}
+
+struct Inflater {
+  z_stream strm;
+  explicit Inflater(int window_bits) {
+    std::memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, window_bits) != Z_OK)
+      fail("inflateInit2 failed");
+  }
+  ~Inflater() { inflateEnd(&strm); }
+  Inflater(const Inflater&) = delete;
+  Inflater& operator=(const Inflater&) = delete;
+};
+
+// Reads more input, if needed, so that at least n bytes are available
+// (unread bytes are moved to the start of the buffer). Returns false if
+// the file has less. Used to check the magic bytes of the next gzip
+// member, which can be split between two reads.
+inline bool gz_fill_input(z_stream& strm, std::vector<unsigned char>& input,
+                          std::FILE* f, uInt n) {
+  if (strm.avail_in >= n)
+    return true;
+  if (strm.avail_in != 0)
+    std::memmove(input.data(), strm.next_in, strm.avail_in);
+  strm.next_in = input.data();
+  while (strm.avail_in < n) {
+    size_t len = std::fread(input.data() + strm.avail_in, 1,
+                            input.size() - strm.avail_in, f);
+    if (len == 0)
+      break;
+    strm.avail_in += (uInt) len;
+  }
+  return strm.avail_in >= n;
+}
+
+// Decompresses the whole file, passes the data to sink(ptr, len) and
+// records access points.
+template<typename Sink>
+GzIndex scan_gz(const std::string& path, std::uint64_t span, Sink sink) {
+  GzIndex index;
+  index.path = path;
+  index.span = span;
+  gz_file_stat(path, index.gz_size, index.gz_mtime);
+  fileptr_t f = file_open(path.c_str(), "rb");
+  Inflater inf(47);  // 15 + 32: gzip or zlib header
+  z_stream& strm = inf.strm;
+  std::vector<unsigned char> input(gz_chunk_size);
+  std::vector<unsigned char> window(gz_window_size);
+  std::uint64_t totin = 0, totout = 0, last = 0, member_out = 0;
+  index.points.push_back(GzAccessPoint{0, 0, 0, true, {}});
+  for (;;) {
+    if (strm.avail_in == 0) {
+      strm.avail_in = (uInt) std::fread(input.data(), 1, input.size(),
+                                        f.get());
+      if (std::ferror(f.get()))
+        fail("Error reading " + path);
+      if (strm.avail_in == 0)
+        fail("Unexpected end of gz file: " + path);
+      strm.next_in = input.data();
+    }
+    if (strm.avail_out == 0) {
+      strm.avail_out = gz_window_size;
+      strm.next_out = window.data();
+    }
+    totin += strm.avail_in;
+    totout += strm.avail_out;
+    unsigned char* out_start = strm.next_out;
+    int ret = inflate(&strm, Z_BLOCK);
+    totin -= strm.avail_in;
+    totout -= strm.avail_out;
+    sink(out_start, (size_t) (strm.next_out - out_start));
+    if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR)
+      fail("Error decompressing " + path + ": " +
+           (strm.msg ? strm.msg : "zlib error"));
+    if (ret == Z_STREAM_END) {
+      // is it followed by another gzip member?
+      if (!gz_fill_input(strm, input, f.get(), 2) ||
+          strm.next_in[0] != 0x1f || strm.next_in[1] != 0x8b)
+        break;  // end of data (trailing garbage, if any, is ignored)
+      inflateReset(&strm);
+      index.points.push_back(GzAccessPoint{totout, totin, 0, true, {}});
+      last = member_out = totout;
+      continue;
+    }
+    if ((strm.data_type & 128) && !(strm.data_type & 64) &&
+        totout - last > span) {
+      GzAccessPoint p{totout, totin, strm.data_type & 7, false, {}};
+      // the last len bytes of the circular window buffer
+      size_t len = (size_t) std::min<std::uint64_t>(gz_window_size,
+                                                     totout - member_out);
+      size_t end = gz_window_size - strm.avail_out;
+      p.window.resize(len);
+      for (size_t i = 0; i != len; ++i)
+        p.window[i] = window[(end + gz_window_size - len + i) %
+                             gz_window_size];
+      index.points.push_back(std::move(p));
+      last = totout;
+    }
+  }
+  index.uncompressed_size = totout;
+  return index;
+}
+} // namespace impl
+
+// Decompresses the whole file and records access points every span bytes
+// of the uncompressed data (at deflate block boundaries). Each point takes
+// 32kB of memory, so span should not be much smaller than 1MB.
+// Concatenated gzip members (e.g. from pigz or bgzip) are supported.
+inline GzIndex build_gz_index(const std::string& path,
+                              std::uint64_t span=4*1024*1024) {
+  return impl::scan_gz(path, span, [](const unsigned char*, size_t) {});
+}
+
+// Binary file with the index, in the native byte order (it is meant as
+// a local cache). Windows of access points are compressed.
+inline void write_gz_index(const GzIndex& index, const std::string& path) {
+  std::vector<unsigned char> buf;
+  auto put = [&](const void* ptr, size_t n) {
+    const unsigned char* p = static_cast<const unsigned char*>(ptr);
+    buf.insert(buf.end(), p, p + n);
+  };
+  const std::uint32_t version = 1;
+  std::uint64_t n_points = index.points.size();
+  put("GEMMIGZI", 8);
+  put(&version, 4);
+  put(&index.gz_size, 8);
+  put(&index.gz_mtime, 8);
+  put(&index.span, 8);
+  put(&index.uncompressed_size, 8);
+  put(&n_points, 8);
+  std::vector<unsigned char> zwin(compressBound(impl::gz_window_size));
+  for (const GzAccessPoint& p : index.points) {
+    unsigned char flags[2] = {(unsigned char) p.bits,
+                              (unsigned char) p.member_start};
+    uLongf zlen = (uLongf) zwin.size();
+    if (compress2(zwin.data(), &zlen, p.window.data(),
+                  (uLong) p.window.size(), 6) != Z_OK)
+      fail("compress2 failed");
+    std::uint32_t lengths[2] = {(std::uint32_t) p.window.size(),
+                                (std::uint32_t) zlen};
+    put(&p.out, 8);
+    put(&p.in, 8);
+    put(flags, 2);
+    put(lengths, 8);
+    put(zwin.data(), zlen);
+  }
+  put("GEMMIGZI", 8);
+  impl::write_file_via_temp(path, buf);
+}
+
+// Returns false if the index file is missing, corrupted or out-of-date.
+inline bool read_gz_index(const std::string& path, const std::string& gz_path,
+                          GzIndex& index) {
+  std::FILE* fp = std::fopen(path.c_str(), "rb");
+  if (!fp)
+    return false;
+  fileptr_t f(fp, &std::fclose);
+  std::vector<unsigned char> buf;
+  unsigned char chunk[65536];
+  size_t n;
+  while ((n = std::fread(chunk, 1, sizeof(chunk), f.get())) != 0)
+    buf.insert(buf.end(), chunk, chunk + n);
+  size_t pos = 0;
+  auto get = [&](void* ptr, size_t len) {
+    if (pos + len > buf.size())
+      return false;
+    std::memcpy(ptr, buf.data() + pos, len);
+    pos += len;
+    return true;
+  };
+  char magic[8];
+  std::uint32_t version;
+  std::uint64_t n_points;
+  GzIndex idx;
+  idx.path = gz_path;
+  if (!get(magic, 8) || std::memcmp(magic, "GEMMIGZI", 8) != 0 ||
+      !get(&version, 4) || version != 1 ||
+      !get(&idx.gz_size, 8) || !get(&idx.gz_mtime, 8) || !get(&idx.span, 8) ||
+      !get(&idx.uncompressed_size, 8) || !get(&n_points, 8) ||
+      n_points == 0 || n_points > buf.size())
+    return false;
+  std::uint64_t gz_size;
+  std::int64_t gz_mtime;
+  impl::gz_file_stat(gz_path, gz_size, gz_mtime);
+  if (gz_size != idx.gz_size || gz_mtime != idx.gz_mtime)
+    return false;
+  idx.points.resize((size_t) n_points);
+  for (GzAccessPoint& p : idx.points) {
+    unsigned char flags[2];
+    std::uint32_t lengths[2];
+    if (!get(&p.out, 8) || !get(&p.in, 8) || !get(flags, 2) ||
+        !get(lengths, 8) || lengths[0] > impl::gz_window_size ||
+        pos + lengths[1] > buf.size())
+      return false;
+    p.bits = flags[0];
+    p.member_start = flags[1] != 0;
+    p.window.resize(lengths[0]);
+    uLongf len = lengths[0];
+    if (uncompress(p.window.data(), &len, buf.data() + pos, lengths[1])
+          != Z_OK || len != lengths[0])
+      return false;
+    pos += lengths[1];
+  }
+  if (!get(magic, 8) || std::memcmp(magic, "GEMMIGZI", 8) != 0)
+    return false;
+  index = std::move(idx);
+  return true;
+}
+
+inline std::string gz_index_path(const std::string& gz_path) {
+  return gz_path + "idx";  // file.map.gz -> file.map.gzidx
+}
+
+// Reads the cached index (file.gz -> file.gzidx) if it is up-to-date,
+// otherwise builds the index and tries to cache it (failure to write
+// the cache, e.g. in a read-only directory, is ignored).
+inline GzIndex get_gz_index(const std::string& path,
+                            std::uint64_t span=4*1024*1024,
+                            bool use_cache=true) {
+  GzIndex index;
+  if (use_cache && read_gz_index(gz_index_path(path), path, index))
+    return index;
+  index = build_gz_index(path, span);
+  if (use_cache) {
+    try {
+      write_gz_index(index, gz_index_path(path));
+    } catch (std::runtime_error&) {}
+  }
+  return index;
+}
+
+// Stream with the interface used in ccp4.hpp and mtz.hpp (read and seek).
+// seek() is cheap; the next read() starts decompressing from the nearest
+// access point, unless the position is a short distance ahead.
+// Each stream has own file handle, so different streams using the same
+// index can be used in different threads.
+class GzIndexedStream {
+public:
+  explicit GzIndexedStream(const GzIndex& index)
+    : index_(&index), f_(file_open(index.path.c_str(), "rb")), inf_(-15),
+      input_(impl::gz_chunk_size) {}
+
+  bool seek(std::uint64_t offset) {
+    pos_ = offset;
+    return offset <= index_->uncompressed_size;
+  }
+  std::uint64_t tell() const { return pos_; }
+
+  bool read(void* buf, size_t len) {
+    if (pos_ + len > index_->uncompressed_size)
+      return false;
+    if (!started_ || pos_ < out_ || pos_ - out_ > index_->span)
+      start_at(index_->point_before(pos_));
+    while (out_ < pos_) {  // skip data
+      unsigned char skip[impl::gz_chunk_size];
+      size_t n = (size_t) std::min<std::uint64_t>(sizeof(skip), pos_ - out_);
+      if (inflate_to(skip, n) != n)
+        return false;
+    }
+    size_t n = inflate_to(static_cast<unsigned char*>(buf), len);
+    pos_ += n;
+    return n == len;
+  }
+
+private:
+  const GzIndex* index_;
+  fileptr_t f_;
+  impl::Inflater inf_;
+  std::vector<unsigned char> input_;
+  std::uint64_t pos_ = 0;  // requested position
+  std::uint64_t out_ = 0;  // position of the decompressor
+  bool started_ = false;
+  bool raw_ = true;        // raw deflate (or gzip member with header)
+
+  void start_at(const GzAccessPoint& p) {
+    z_stream& strm = inf_.strm;
+    if (!impl::seek_file(f_.get(), p.in - (p.bits ? 1 : 0)))
+      fail("Failed to seek in " + index_->path);
+    raw_ = !p.member_start;
+    inflateReset2(&strm, raw_ ? -15 : 47);
+    strm.avail_in = 0;
+    if (p.bits) {
+      int c = std::fgetc(f_.get());
+      if (c == EOF)
+        fail("Unexpected end of " + index_->path);
+      inflatePrime(&strm, p.bits, c >> (8 - p.bits));
+    }
+    if (!p.window.empty())
+      inflateSetDictionary(&strm, p.window.data(), (uInt) p.window.size());
+    out_ = p.out;
+    started_ = true;
+  }
+
+  bool fill_input() {
+    return impl::gz_fill_input(inf_.strm, input_, f_.get(), 1);
+  }
+
+  // at the end of a gzip member: skips the trailer, returns false
+  // if no gzip member follows
+  bool next_member() {
+    z_stream& strm = inf_.strm;
+    if (raw_) {  // skip CRC32 and ISIZE
+      for (int i = 0; i != 8; ++i) {
+        if (!fill_input())
+          return false;
+        --strm.avail_in;
+        ++strm.next_in;
+      }
+    }
+    if (!impl::gz_fill_input(strm, input_, f_.get(), 2) ||
+        strm.next_in[0] != 0x1f || strm.next_in[1] != 0x8b)
+      return false;
+    raw_ = false;
+    inflateReset2(&strm, 47);
+    return true;
+  }
+
+  size_t inflate_to(unsigned char* dst, size_t len) {
+    z_stream& strm = inf_.strm;
+    size_t done = 0;
+    while (done != len) {
+      if (!fill_input())
+        fail("Unexpected end of " + index_->path);
+      uInt chunk = (uInt) std::min<size_t>(len - done, 1u << 30);
+      strm.next_out = dst + done;
+      strm.avail_out = chunk;
+      int ret = inflate(&strm, Z_NO_FLUSH);
+      size_t n = chunk - strm.avail_out;
+      done += n;
+      out_ += n;
+      if (ret == Z_STREAM_END) {
+        if (!next_member())
+          break;
+      } else if (ret != Z_OK && !(ret == Z_BUF_ERROR && n != 0)) {
+        fail("Error decompressing " + index_->path + ": " +
+             (strm.msg ? strm.msg : "zlib error"));
+      }
+    }
+    return done;
+  }
+};
+
+namespace impl {
+
+// Growing output buffer, in the form returned by MaybeGzipped::memory().
+struct GzOutput {
+  std::unique_ptr<char[]> data;
+  size_t size = 0;
+  size_t capacity = 0;
+  void append(const unsigned char* ptr, size_t n) {
+    if (size + n > capacity) {
+      size_t new_capacity = std::max(2 * capacity, size + n);
+      std::unique_ptr<char[]> new_data(new char[new_capacity]);
+      if (size != 0)
+        std::memcpy(new_data.get(), data.get(), size);
+      data = std::move(new_data);
+      capacity = new_capacity;
+    }
+    std::memcpy(data.get() + size, ptr, n);
+    size += n;
+  }
+};
+
+inline std::uint64_t read_le(const unsigned char* p, int n) {
+  std::uint64_t value = 0;
+  for (int i = n - 1; i >= 0; --i)
+    value = (value << 8) | p[i];
+  return value;
+}
+
+inline void write_le(std::vector<unsigned char>& out, std::uint64_t value,
+                     int n) {
+  for (int i = 0; i != n; ++i)
+    out.push_back((unsigned char) (value >> (8 * i)));
+}
+
+struct GzMember {
+  size_t in, in_size;  // position and size of the member in the gz file
+  size_t out, out_size;
+};
+
+// Compresses data as one gzip member, with its size stored in subfield GM
+// of the header (see gz_member_size()), so that members can be located
+// and decompressed in parallel.
+inline std::vector<unsigned char> gzip_member(const unsigned char* in,
+                                              size_t len, int level) {
+  z_stream strm;
+  std::memset(&strm, 0, sizeof(strm));
+  if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    fail("deflateInit2 failed");
+  std::vector<unsigned char> deflated(deflateBound(&strm, (uLong) len));
+  strm.next_in = const_cast<unsigned char*>(in);
+  strm.avail_in = (uInt) len;
+  strm.next_out = deflated.data();
+  strm.avail_out = (uInt) deflated.size();
+  int ret = deflate(&strm, Z_FINISH);
+  size_t deflated_size = deflated.size() - strm.avail_out;
+  deflateEnd(&strm);
+  if (ret != Z_STREAM_END)
+    fail("deflate failed");
+  const size_t header_size = 10 + 2 + 12;
+  const unsigned char header[10] = {0x1f, 0x8b, 8, 4 /*FEXTRA*/,
+                                    0, 0, 0, 0, 0, 255 /*OS: unknown*/};
+  std::vector<unsigned char> m(header, header + 10);
+  m.reserve(header_size + deflated_size + 8);
+  write_le(m, 12, 2);  // XLEN
+  m.push_back('G');
+  m.push_back('M');
+  write_le(m, 8, 2);   // subfield length
+  write_le(m, header_size + deflated_size + 8, 8);
+  m.insert(m.end(), deflated.begin(), deflated.begin() + deflated_size);
+  write_le(m, crc32(crc32(0L, Z_NULL, 0), in, (uInt) len), 4);
+  write_le(m, len, 4);
+  return m;
+}
+
+// Size of the gzip member starting at h, as stored in the extra field of
+// the header: subfield BC (BGZF, used by bgzip) or GM (write_gz_parallel()).
+// Returns 0 if the header has no such subfield.
+inline size_t gz_member_size(const unsigned char* h, size_t avail) {
+  // ID1, ID2, CM=8 (deflate), FLG with FEXTRA
+  if (avail < 18 || h[0] != 0x1f || h[1] != 0x8b || h[2] != 8 || !(h[3] & 4))
+    return 0;
+  size_t xlen = (size_t) read_le(h + 10, 2);
+  if (avail < 12 + xlen)
+    return 0;
+  size_t member_size = 0;
+  for (size_t x = 12; x + 4 <= 12 + xlen; ) {
+    size_t slen = (size_t) read_le(h + x + 2, 2);
+    if (h[x] == 'B' && h[x+1] == 'C' && slen == 2)
+      member_size = (size_t) read_le(h + x + 4, 2) + 1;
+    else if (h[x] == 'G' && h[x+1] == 'M' && slen == 8)
+      member_size = (size_t) read_le(h + x + 4, 8);
+    x += 4 + slen;
+  }
+  return member_size >= 12 + xlen + 8 ? member_size : 0;
+}
+
+// Returns false if any member doesn't have its size in the header.
+inline bool find_gz_members(const unsigned char* data, size_t size,
+                            std::vector<GzMember>& members) {
+  size_t pos = 0, out = 0;
+  while (pos < size) {
+    size_t member_size = gz_member_size(data + pos, size - pos);
+    if (member_size == 0 || member_size > size - pos)
+      return false;
+    // ISIZE
+    size_t out_size = (size_t) read_le(data + pos + member_size - 4, 4);
+    members.push_back(GzMember{pos, member_size, out, out_size});
+    pos += member_size;
+    out += out_size;
+  }
+  return !members.empty();
+}
+
+inline void inflate_gz_member(const unsigned char* in, size_t in_size,
+                              char* out, size_t out_size) {
+  Inflater inf(31);  // 15 + 16: gzip header
+  z_stream& strm = inf.strm;
+  strm.next_in = const_cast<unsigned char*>(in);
+  strm.avail_in = (uInt) in_size;
+  strm.next_out = reinterpret_cast<unsigned char*>(out);
+  strm.avail_out = (uInt) out_size;
+  int ret = inflate(&strm, Z_FINISH);
+  if (ret != Z_STREAM_END || strm.avail_out != 0)
+    fail("Error decompressing gzip member");
+}
+
+} // namespace impl
+
+// Parallel decompression of any range of a gz file that allows it:
+//  - if the file consists of gzip members with compressed sizes recorded
+//    in headers (written by bgzip or write_gz_parallel()), the whole
+//    compressed file is kept in memory and members are decompressed
+//    in parallel,
+//  - otherwise, if an up-to-date index (see get_gz_index()) is cached,
+//    spans between access points are decompressed in parallel.
+// Speculative decompression of arbitrary gzip files at guessed block
+// boundaries is not attempted.
+class GzParallelReader {
+public:
+  // Returns false if the file can be decompressed only sequentially.
+  bool open(const std::string& path) {
+    path_ = path;
+    members_.clear();
+    index_.points.clear();
+    fileptr_t f = file_open(path.c_str(), "rb");
+    gz_.resize(impl::gz_chunk_size);
+    gz_.resize(std::fread(gz_.data(), 1, gz_.size(), f.get()));
+    // if the first member has its size in the header, read the whole file
+    if (impl::gz_member_size(gz_.data(), gz_.size()) != 0) {
+      unsigned char chunk[65536];
+      size_t n;
+      while ((n = std::fread(chunk, 1, sizeof(chunk), f.get())) != 0)
+        gz_.insert(gz_.end(), chunk, chunk + n);
+      if (std::ferror(f.get()))
+        fail("Error reading " + path);
+      // if a later member has no size (e.g. files were concatenated),
+      // or there is trailing garbage, the cached index is tried
+      if (impl::find_gz_members(gz_.data(), gz_.size(), members_)) {
+        const impl::GzMember& last = members_.back();
+        size_ = last.out + last.out_size;
+        return true;
+      }
+      members_.clear();
+    }
+    std::vector<unsigned char>().swap(gz_);
+    if (read_gz_index(gz_index_path(path), path, index_)) {
+      size_ = index_.uncompressed_size;
+      return true;
+    }
+    index_.points.clear();
+    return false;
+  }
+
+  std::uint64_t uncompressed_size() const { return size_; }
+
+  // Decompresses len bytes, starting at offset in the uncompressed data.
+  void read(std::uint64_t offset, void* buf, size_t len, int nthreads=0) {
+    if (offset > size_ || len > size_ - offset)
+      fail("Unexpected end of " + path_);
+    char* out = static_cast<char*>(buf);
+    std::uint64_t end = offset + len;
+    if (!members_.empty()) {
+      std::vector<const impl::GzMember*> parts;
+      for (const impl::GzMember& m : members_)
+        if (m.out < end && m.out + m.out_size > offset)
+          parts.push_back(&m);
+      parallel_for_dynamic((int) parts.size(), nthreads, [&](int i) {
+        const impl::GzMember& m = *parts[i];
+        const unsigned char* in = gz_.data() + m.in;
+        if (m.out >= offset && m.out + m.out_size <= end) {
+          impl::inflate_gz_member(in, m.in_size, out + (m.out - offset),
+                                  m.out_size);
+        } else {  // member at the edge of the range
+          std::unique_ptr<char[]> tmp(new char[m.out_size]);
+          impl::inflate_gz_member(in, m.in_size, tmp.get(), m.out_size);
+          std::uint64_t b = std::max<std::uint64_t>(m.out, offset);
+          std::uint64_t e = std::min<std::uint64_t>(m.out + m.out_size, end);
+          std::memcpy(out + (b - offset), tmp.get() + (b - m.out),
+                      (size_t) (e - b));
+        }
+      });
+    } else if (!index_.points.empty()) {
+      const std::vector<GzAccessPoint>& points = index_.points;
+      int first = int(&index_.point_before(offset) - points.data());
+      int n_points = int(std::lower_bound(points.begin(), points.end(), end,
+                             [](const GzAccessPoint& p, std::uint64_t x) {
+                               return p.out < x;
+                             }) - points.begin());
+      // each thread decompresses a range of spans with one stream
+      parallel_for(first, n_points, nthreads, [&](int begin, int stop) {
+        std::uint64_t start = std::max(points[begin].out, offset);
+        std::uint64_t finish = stop == n_points ? end
+                             : std::min(points[stop].out, end);
+        if (start >= finish)
+          return;
+        GzIndexedStream stream(index_);
+        stream.seek(start);
+        if (!stream.read(out + (start - offset), (size_t) (finish - start)))
+          fail("Failed to decompress " + path_);
+      });
+    } else {
+      fail("GzParallelReader: not opened: " + path_);
+    }
+  }
+
+private:
+  std::string path_;
+  std::vector<unsigned char> gz_;
+  std::vector<impl::GzMember> members_;
+  GzIndex index_;
+  std::uint64_t size_ = 0;
+};
+
+// Decompresses the whole file, using up to nthreads threads if possible
+// (see GzParallelReader). Otherwise, the file is decompressed in one
+// thread; if use_cache is set the index is built on the way and cached,
+// so that the next reading of the same file is parallel.
+inline std::unique_ptr<char[]> decompress_gz_file(const std::string& path,
+                                                  size_t& size,
+                                                  int nthreads=0,
+                                                  bool use_cache=true) {
+  GzParallelReader reader;
+  if (reader.open(path)) {
+    size = (size_t) reader.uncompressed_size();
+    std::unique_ptr<char[]> mem(new char[size]);
+    reader.read(0, mem.get(), size, nthreads);
+    return mem;
+  }
+  fileptr_t f = file_open(path.c_str(), "rb");
+  impl::GzOutput output;
+  // ISIZE of the last member is the uncompressed size modulo 2^32 (if
+  // there is only one member), good enough as a hint
+  unsigned char isize[4];
+  if (std::fseek(f.get(), -4, SEEK_END) == 0 &&
+      std::fread(isize, 1, 4, f.get()) == 4) {
+    size_t hint = (size_t) impl::read_le(isize, 4);
+    // deflate can't compress more than ~1032:1
+    if (hint != 0 && hint / 1032 <= (size_t) std::ftell(f.get())) {
+      output.data.reset(new char[hint]);
+      output.capacity = hint;
+    }
+  }
+  f.reset();
+  GzIndex index = impl::scan_gz(path, 4*1024*1024,
+                                [&](const unsigned char* ptr, size_t n) {
+                                  output.append(ptr, n);
+                                });
+  if (use_cache) {
+    try {
+      write_gz_index(index, gz_index_path(path));
+    } catch (std::runtime_error&) {}
+  }
+  size = output.size;
+  return std::move(output.data);
+}
+
+// Writes data as a gzip file made of independent members, each with
+// member_size bytes of uncompressed data, compressed in parallel.
+// The compressed size of each member is stored in the header (extra
+// subfield GM), so that decompress_gz_file() can decompress members
+// in parallel. Any gzip reader can read the file.
+inline void write_gz_parallel(const std::string& path, const void* data,
+                              size_t size, int level=6, int nthreads=0,
+                              size_t member_size=4*1024*1024) {
+  if (member_size == 0 || member_size > 0xffffffff)
+    fail("write_gz_parallel: wrong member_size");
+  size_t n_members = std::max<size_t>(1, (size + member_size - 1) /
+                                         member_size);
+  std::vector<std::vector<unsigned char>> out(n_members);
+  const unsigned char* in = static_cast<const unsigned char*>(data);
+  parallel_for_dynamic((int) n_members, nthreads, [&](int i) {
+    size_t offset = i * member_size;
+    out[i] = impl::gzip_member(in + offset,
+                               std::min(member_size, size - offset), level);
+  });
+  fileptr_t f = file_open(path.c_str(), "wb");
+  for (const std::vector<unsigned char>& m : out)
+    if (std::fwrite(m.data(), 1, m.size(), f.get()) != m.size())
+      fail("Failed to write " + path);
+}
+
+} // namespace gemmi
+#endif
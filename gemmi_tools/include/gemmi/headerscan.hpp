@@ -0,0 +1,315 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Scanning directories of CCP4 maps and MTZ files, reading only headers
+// (unit cell, space group, grid size, resolution, columns), in parallel.
+// The results can be kept in a binary index file, which is updated
+// by re-reading only files that changed.
+
+#ifndef GEMMI_HEADERSCAN_HPP_
+#define GEMMI_HEADERSCAN_HPP_
+
+#include <array>
+#include <cmath>         // for NAN
+#include <cstdint>       // for int64_t, uint64_t, uint32_t
+#include <cstdio>        // for fread
+#include <cstring>       // for memcpy, memcmp
+#include <map>
+#include <memory>        // for unique_ptr
+#include <stdexcept>     // for runtime_error
+#include <string>
+#include <vector>
+#include "ccp4.hpp"      // for Ccp4
+#include "dirwalk.hpp"   // for DirWalk
+#include "fail.hpp"      // for fail
+#include "fileutil.hpp"  // for file_open, fileptr_t
+#include "gz.hpp"        // for MaybeGzipped
+#include "gzindex.hpp"   // for decompress_gz_file, impl::gz_file_stat
+#include "input.hpp"     // for FileStream, MemoryStream
+#include "mtz.hpp"       // for Mtz
+#include "threads.hpp"   // for parallel_for_dynamic
+#include "util.hpp"      // for giends_with
+
+namespace gemmi {
+
+enum class ScannedFileKind : unsigned char { Map=0, Mtz=1 };
+
+struct ScannedFile {
+  std::string path;
+  ScannedFileKind kind = ScannedFileKind::Map;
+  std::uint64_t file_size = 0;
+  std::int64_t mtime = 0;
+  std::string error;  // non-empty if the header could not be read
+  UnitCell cell;
+  int spacegroup_number = 0;
+  std::string spacegroup_hm;
+  // maps only
+  int mode = -1;
+  std::array<int, 3> grid_size = {{0, 0, 0}};  // MX, MY, MZ
+  std::array<int, 3> map_size = {{0, 0, 0}};   // NC, NR, NS
+  std::array<int, 3> map_start = {{0, 0, 0}};  // NCSTART, NRSTART, NSSTART
+  DataStats stats;
+  // MTZ only
+  int nreflections = 0;
+  double resolution_high = NAN;
+  double resolution_low = NAN;
+  std::vector<std::string> column_labels;
+  std::string column_types;
+};
+
+namespace impl {
+
+struct IsMapOrMtzFile {
+  static bool check(const std::string& filename) {
+    return giends_with(filename, ".ccp4") || giends_with(filename, ".map") ||
+           giends_with(filename, ".mrc") || giends_with(filename, ".mtz");
+  }
+};
+
+inline void read_map_header_info(ScannedFile& sf) {
+  Ccp4<float> ccp4;
+  if (iends_with(sf.path, ".gz")) {
+    // only the beginning of the file is decompressed
+    MaybeGzipped input(sf.path);
+    MaybeGzipped::GzStream stream = input.get_uncompressing_stream();
+    ccp4.read_ccp4_header(stream, sf.path);
+  } else {
+    fileptr_t f = file_open(sf.path.c_str(), "rb");
+    FileStream stream{f.get()};
+    ccp4.read_ccp4_header(stream, sf.path);
+  }
+  sf.cell = ccp4.grid.unit_cell;
+  sf.spacegroup_number = ccp4.header_i32(23);
+  if (ccp4.grid.spacegroup)
+    sf.spacegroup_hm = ccp4.grid.spacegroup->xhm();
+  sf.mode = ccp4.header_i32(4);
+  for (int i = 0; i != 3; ++i) {
+    sf.map_size[i] = ccp4.header_i32(1 + i);
+    sf.map_start[i] = ccp4.header_i32(5 + i);
+    sf.grid_size[i] = ccp4.header_i32(8 + i);
+  }
+  sf.stats = ccp4.hstats;
+}
+
+inline void read_mtz_header_info(ScannedFile& sf) {
+  Mtz mtz;
+  if (iends_with(sf.path, ".gz")) {
+    // MTZ headers are at the end, the whole file must be decompressed
+    size_t size = 0;
+    std::unique_ptr<char[]> mem = decompress_gz_file(sf.path, size, 1, false);
+    MemoryStream stream(mem.get(), mem.get() + size);
+    mtz.read_all_headers(stream);
+  } else {
+    fileptr_t f = file_open(sf.path.c_str(), "rb");
+    FileStream stream{f.get()};
+    mtz.read_all_headers(stream);
+  }
+  sf.cell = mtz.cell;
+  sf.spacegroup_number = mtz.spacegroup_number;
+  if (mtz.spacegroup)
+    sf.spacegroup_hm = mtz.spacegroup->xhm();
+  sf.nreflections = mtz.nreflections;
+  sf.resolution_high = mtz.resolution_high();
+  sf.resolution_low = mtz.resolution_low();
+  for (const Mtz::Column& col : mtz.columns) {
+    sf.column_labels.push_back(col.label);
+    sf.column_types += col.type;
+  }
+}
+
+} // namespace impl
+
+// Reads the header of a map or MTZ file (optionally gzipped).
+// Errors are not thrown, they are stored in ScannedFile::error.
+inline ScannedFile scan_file_header(const std::string& path) {
+  ScannedFile sf;
+  sf.path = path;
+  sf.kind = giends_with(path, ".mtz") ? ScannedFileKind::Mtz
+                                      : ScannedFileKind::Map;
+  try {
+    impl::gz_file_stat(path, sf.file_size, sf.mtime);
+    if (sf.kind == ScannedFileKind::Mtz)
+      impl::read_mtz_header_info(sf);
+    else
+      impl::read_map_header_info(sf);
+  } catch (std::runtime_error& e) {
+    sf.error = e.what();
+  }
+  return sf;
+}
+
+// Finds maps (.ccp4, .map, .mrc) and MTZ files (.mtz), optionally gzipped,
+// in the directory tree and reads their headers in parallel. Entries from
+// previous (e.g. read from an index) are re-used for files with unchanged
+// size and modification time.
+inline std::vector<ScannedFile>
+scan_file_headers(const std::string& top_dir, int nthreads=0,
+                  const std::vector<ScannedFile>& previous={}) {
+  std::vector<ScannedFile> files;
+  DirWalk<true, impl::IsMapOrMtzFile> walk(top_dir);
+  for (const std::string& path : walk) {
+    files.emplace_back();
+    files.back().path = path;
+  }
+  std::map<std::string, const ScannedFile*> old;
+  for (const ScannedFile& sf : previous)
+    if (sf.error.empty())
+      old.emplace(sf.path, &sf);
+  parallel_for_dynamic((int) files.size(), nthreads, [&](int i) {
+    ScannedFile& sf = files[i];
+    auto it = old.find(sf.path);
+    if (it != old.end()) {
+      std::uint64_t size;
+      std::int64_t mtime;
+      try {
+        impl::gz_file_stat(sf.path, size, mtime);
+        if (size == it->second->file_size && mtime == it->second->mtime) {
+          sf = *it->second;
+          return;
+        }
+      } catch (std::runtime_error&) {}
+    }
+    sf = scan_file_header(sf.path);
+  });
+  return files;
+}
+
+inline void write_header_index(const std::vector<ScannedFile>& files,
+                               const std::string& path) {
+  std::vector<unsigned char> buf;
+  auto put = [&](const void* ptr, size_t n) {
+    const unsigned char* p = static_cast<const unsigned char*>(ptr);
+    buf.insert(buf.end(), p, p + n);
+  };
+  auto put_str = [&](const std::string& s) {
+    std::uint32_t len = (std::uint32_t) s.size();
+    put(&len, 4);
+    put(s.data(), len);
+  };
+  const std::uint32_t version = 1;
+  std::uint64_t n_files = files.size();
+  put("GEMMIHDX", 8);
+  put(&version, 4);
+  put(&n_files, 8);
+  for (const ScannedFile& sf : files) {
+    put_str(sf.path);
+    put(&sf.kind, 1);
+    put(&sf.file_size, 8);
+    put(&sf.mtime, 8);
+    put_str(sf.error);
+    const double cell[6] = {sf.cell.a, sf.cell.b, sf.cell.c,
+                            sf.cell.alpha, sf.cell.beta, sf.cell.gamma};
+    put(cell, sizeof(cell));
+    put(&sf.spacegroup_number, 4);
+    put_str(sf.spacegroup_hm);
+    put(&sf.mode, 4);
+    put(sf.grid_size.data(), 12);
+    put(sf.map_size.data(), 12);
+    put(sf.map_start.data(), 12);
+    const double stats[4] = {sf.stats.dmin, sf.stats.dmax,
+                             sf.stats.dmean, sf.stats.rms};
+    put(stats, sizeof(stats));
+    put(&sf.nreflections, 4);
+    put(&sf.resolution_high, 8);
+    put(&sf.resolution_low, 8);
+    std::uint32_t n_columns = (std::uint32_t) sf.column_labels.size();
+    put(&n_columns, 4);
+    for (const std::string& label : sf.column_labels)
+      put_str(label);
+    put_str(sf.column_types);
+  }
+  put("GEMMIHDX", 8);
+  impl::write_file_via_temp(path, buf);
+}
+
+inline std::vector<ScannedFile> read_header_index(const std::string& path) {
+  fileptr_t f = file_open(path.c_str(), "rb");
+  std::vector<unsigned char> buf;
+  unsigned char chunk[65536];
+  size_t n;
+  while ((n = std::fread(chunk, 1, sizeof(chunk), f.get())) != 0)
+    buf.insert(buf.end(), chunk, chunk + n);
+  size_t pos = 0;
+  auto get = [&](void* ptr, size_t len) {
+    if (pos + len > buf.size())
+      fail("Corrupted header index: " + path);
+    std::memcpy(ptr, buf.data() + pos, len);
+    pos += len;
+  };
+  auto get_str = [&](std::string& s) {
+    std::uint32_t len;
+    get(&len, 4);
+    if (pos + len > buf.size())
+      fail("Corrupted header index: " + path);
+    s.assign((const char*) buf.data() + pos, len);
+    pos += len;
+  };
+  char magic[8];
+  std::uint32_t version;
+  std::uint64_t n_files;
+  get(magic, 8);
+  if (std::memcmp(magic, "GEMMIHDX", 8) != 0)
+    fail("Not a header index: " + path);
+  get(&version, 4);
+  if (version != 1)
+    fail("Unsupported version of header index: " + path);
+  get(&n_files, 8);
+  if (n_files > buf.size())
+    fail("Corrupted header index: " + path);
+  std::vector<ScannedFile> files((size_t) n_files);
+  for (ScannedFile& sf : files) {
+    get_str(sf.path);
+    get(&sf.kind, 1);
+    get(&sf.file_size, 8);
+    get(&sf.mtime, 8);
+    get_str(sf.error);
+    double cell[6];
+    get(cell, sizeof(cell));
+    if (cell[0] > 0)
+      sf.cell.set(cell[0], cell[1], cell[2], cell[3], cell[4], cell[5]);
+    get(&sf.spacegroup_number, 4);
+    get_str(sf.spacegroup_hm);
+    get(&sf.mode, 4);
+    get(sf.grid_size.data(), 12);
+    get(sf.map_size.data(), 12);
+    get(sf.map_start.data(), 12);
+    double stats[4];
+    get(stats, sizeof(stats));
+    sf.stats.dmin = stats[0];
+    sf.stats.dmax = stats[1];
+    sf.stats.dmean = stats[2];
+    sf.stats.rms = stats[3];
+    get(&sf.nreflections, 4);
+    get(&sf.resolution_high, 8);
+    get(&sf.resolution_low, 8);
+    std::uint32_t n_columns;
+    get(&n_columns, 4);
+    if (n_columns > buf.size())
+      fail("Corrupted header index: " + path);
+    sf.column_labels.resize(n_columns);
+    for (std::string& label : sf.column_labels)
+      get_str(label);
+    get_str(sf.column_types);
+  }
+  get(magic, 8);
+  if (std::memcmp(magic, "GEMMIHDX", 8) != 0)
+    fail("Corrupted header index: " + path);
+  return files;
+}
+
+// Scans top_dir, re-using entries from index_path (if it can be read)
+// for unchanged files, writes the updated index and returns it.
+inline std::vector<ScannedFile>
+update_header_index(const std::string& index_path, const std::string& top_dir,
+                    int nthreads=0) {
+  std::vector<ScannedFile> previous;
+  try {
+    previous = read_header_index(index_path);
+  } catch (std::runtime_error&) {}
+  std::vector<ScannedFile> files = scan_file_headers(top_dir, nthreads,
+                                                     previous);
+  write_header_index(files, index_path);
+  return files;
+}
+
+} // namespace gemmi
+#endif
@@ -7,6 +7,8 @@
 #define GEMMI_INPUT_HPP_
 
 #include <cassert>
+#include <cstdint> // for uint64_t
+#include <cstdio>  // for FILE, fread, fseeko
 #include <cstring> // for memchr
 #include <memory>  // for unique_ptr
 #include <string>
@@ -22,7 +24,14 @@ struct FileStream {
   int getc() { return std::fgetc(f); }
   // used in ccp4.hpp
   bool read(void* buf, size_t len) { return std::fread(buf, len, 1, f) == 1; }
-  bool seek(long offset) { return std::fseek(f, offset, SEEK_SET) == 0; }
+  // 64-bit offset (std::fseek takes long, which is 32-bit on Windows)
+  bool seek(std::uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(f, (__int64) offset, SEEK_SET) == 0;
+#else
+    return fseeko(f, (off_t) offset, SEEK_SET) == 0;
+#endif
+  }
 };
 
 struct MemoryStream {
@@ -50,7 +59,9 @@ struct MemoryStream {
     return true;
   }
 
-  int seek(long offset) {
+  bool seek(std::uint64_t offset) {
+    if (offset > std::uint64_t(end - start))
+      return false;
     cur = start + offset;
     return cur < end;
   }
@@ -80,6 +91,8 @@ public:
   // for reading (uncompressing into memory) the whole file at once
   std::unique_ptr<char[]> memory() { return nullptr; }
   size_t memory_size() const { return 0; };
+  // for decompressing a part of the file in multiple threads
+  bool read_in_parallel(std::uint64_t, void*, size_t, int=0) { return false; }
 
 private:
   std::string path_;
@@ -0,0 +1,151 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Local (sliding-window) real-space correlation between two maps,
+// calculated by FFT convolution in O(N log N) for any window size.
+
+#ifndef GEMMI_LOCALCORR_HPP_
+#define GEMMI_LOCALCORR_HPP_
+
+#include <cmath>        // for exp, sqrt, ceil
+#include <complex>
+#include <vector>
+#include "fourier.hpp"  // for pocketfft (with gemmi's configuration)
+#include "grid.hpp"     // for Grid
+#include "math.hpp"     // for calculate_data_statistics
+#include "threads.hpp"  // for parallel_for_each_index
+#include "fail.hpp"     // for fail
+
+namespace gemmi {
+
+enum class WindowShape : unsigned char {
+  Sphere,   // uniform weights within radius
+  Gaussian  // sigma = radius, truncated at 3 sigma
+};
+
+// Convolution of real grids with a fixed, symmetric kernel, done as
+// a product of half-complex spectra (r2c/c2r on all three axes).
+template<typename T>
+struct GridConvolution {
+  pocketfft::shape_t shape;
+  pocketfft::stride_t real_stride, complex_stride;
+  std::vector<std::complex<T>> kernel_spectrum;
+  std::vector<std::complex<T>> work;
+  size_t nthreads;
+
+  // kernel is normalized here to sum 1
+  GridConvolution(const Grid<T>& kernel, int nthreads_)
+    : nthreads(resolve_thread_count(nthreads_)) {
+    shape = {(size_t) kernel.nw, (size_t) kernel.nv, (size_t) kernel.nu};
+    std::ptrdiff_t s = sizeof(T);
+    std::ptrdiff_t hu = kernel.nu / 2 + 1;
+    real_stride = {s * kernel.nu * kernel.nv, s * kernel.nu, s};
+    complex_stride = {2 * s * hu * kernel.nv, 2 * s * hu, 2 * s};
+    kernel_spectrum.resize(hu * kernel.nv * kernel.nw);
+    T sum = kernel.sum();
+    if (sum == T(0))
+      fail("empty convolution kernel");
+    pocketfft::r2c<T>(shape, real_stride, complex_stride, {0, 1, 2},
+                      pocketfft::FORWARD, kernel.data.data(),
+                      kernel_spectrum.data(), T(1) / sum, nthreads);
+  }
+
+  // out may be the same as in
+  void apply(const T* in, T* out) {
+    work.resize(kernel_spectrum.size());
+    pocketfft::r2c<T>(shape, real_stride, complex_stride, {0, 1, 2},
+                      pocketfft::FORWARD, in, work.data(), T(1), nthreads);
+    for (size_t i = 0; i != work.size(); ++i)
+      work[i] *= kernel_spectrum[i];
+    T norm = T(1.0 / (shape[0] * shape[1] * shape[2]));
+    pocketfft::c2r<T>(shape, complex_stride, real_stride, {0, 1, 2},
+                      pocketfft::BACKWARD, work.data(), out, norm, nthreads);
+  }
+};
+
+// Window centered at grid point (0,0,0), wrapped periodically. If the window
+// is bigger than half the cell, weights of all periodic images are summed,
+// so that the convolution is the same as with a window in infinite space.
+template<typename T>
+Grid<T> make_window_kernel(const Grid<T>& grid, double radius,
+                           WindowShape shape) {
+  Grid<T> kernel;
+  kernel.unit_cell = grid.unit_cell;
+  kernel.set_size_without_checking(grid.nu, grid.nv, grid.nw);
+  double cutoff = shape == WindowShape::Sphere ? radius : 3 * radius;
+  double inv_2s2 = 1. / (2 * radius * radius);
+  int du = (int) std::ceil(cutoff / kernel.spacing[0]);
+  int dv = (int) std::ceil(cutoff / kernel.spacing[1]);
+  int dw = (int) std::ceil(cutoff / kernel.spacing[2]);
+  for (int w = -dw; w <= dw; ++w)
+    for (int v = -dv; v <= dv; ++v)
+      for (int u = -du; u <= du; ++u) {
+        Fractional fdelta(u * (1.0 / kernel.nu), v * (1.0 / kernel.nv),
+                          w * (1.0 / kernel.nw));
+        double d2 = kernel.unit_cell.orthogonalize_difference(fdelta)
+                    .length_sq();
+        if (d2 < cutoff * cutoff)
+          kernel.data[kernel.index_s(u, v, w)] +=
+            shape == WindowShape::Sphere ? T(1) : T(std::exp(-d2 * inv_2s2));
+      }
+  return kernel;
+}
+
+// Pearson correlation of a and b in a window around each point.
+// Maps are standardized first (global mean 0, rms 1), which limits loss
+// of precision in the E[x^2] - E[x]^2 terms when T is float.
+// Points where either local variance is negligible get 0.
+template<typename T>
+Grid<T> local_correlation(const Grid<T>& a, const Grid<T>& b, double radius,
+                          WindowShape shape=WindowShape::Sphere,
+                          int nthreads=0) {
+  if (a.nu != b.nu || a.nv != b.nv || a.nw != b.nw)
+    fail("local_correlation: grids differ in size");
+  if (a.axis_order != AxisOrder::XYZ || b.axis_order != AxisOrder::XYZ)
+    fail("local_correlation: grids must cover the unit cell in XYZ order");
+  const size_t n = a.data.size();
+  GridConvolution<T> conv(make_window_kernel(a, radius, shape), nthreads);
+  auto standardized = [&](const Grid<T>& g) {
+    DataStats st = calculate_data_statistics(g.data);
+    double mult = st.rms > 0 ? 1. / st.rms : 1.;
+    std::vector<T> v(n);
+    for (size_t i = 0; i != n; ++i)
+      v[i] = T((g.data[i] - st.dmean) * mult);
+    return v;
+  };
+  std::vector<T> xa = standardized(a);
+  std::vector<T> xb = standardized(b);
+  std::vector<T> mean_a(n), mean_b(n), tmp(n);
+  conv.apply(xa.data(), mean_a.data());
+  conv.apply(xb.data(), mean_b.data());
+  Grid<T> result;
+  result.unit_cell = a.unit_cell;
+  result.spacegroup = a.spacegroup;
+  result.set_size_without_checking(a.nu, a.nv, a.nw);
+  T* out = result.data.data();
+  // out temporarily holds var(a), then cov(a,b), then the correlation
+  const T eps = T(1e-6);
+  parallel_for_each_index(n, nthreads, [&](size_t i) {
+      tmp[i] = xa[i] * xa[i];
+  });
+  conv.apply(tmp.data(), out);
+  parallel_for_each_index(n, nthreads, [&](size_t i) {
+      out[i] -= mean_a[i] * mean_a[i];
+      tmp[i] = xb[i] * xb[i];
+  });
+  conv.apply(tmp.data(), tmp.data());
+  parallel_for_each_index(n, nthreads, [&](size_t i) {
+      // tmp <- var(a) * var(b) or 0, xa <- a * b
+      T var_b = tmp[i] - mean_b[i] * mean_b[i];
+      tmp[i] = out[i] > eps && var_b > eps ? out[i] * var_b : T(0);
+      xa[i] *= xb[i];
+  });
+  conv.apply(xa.data(), out);
+  parallel_for_each_index(n, nthreads, [&](size_t i) {
+      T cov = out[i] - mean_a[i] * mean_b[i];
+      out[i] = tmp[i] > T(0) ? cov / std::sqrt(tmp[i]) : T(0);
+  });
+  return result;
+}
+
+} // namespace gemmi
+#endif
@@ -294,8 +294,9 @@ struct DataStats {
   double rms = NAN;
 };
 
-template<typename T>
-DataStats calculate_data_statistics(const std::vector<T>& data) {
+// works with std::vector and other containers with the same interface
+template<typename Container>
+DataStats calculate_data_statistics(const Container& data) {
   DataStats stats;
   if (data.empty())
     return stats;
@@ -0,0 +1,78 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Memory-mapped file regions used as non-owning grid storage.
+// Multiple processes mapping the same file share it in the page cache.
+
+#ifndef GEMMI_MMAP_HPP_
+#define GEMMI_MMAP_HPP_
+
+#include <cstddef>   // for size_t
+#include <memory>    // for shared_ptr
+#include <string>
+#include "fail.hpp"  // for fail
+#include "grid.hpp"  // for GridView
+
+#ifndef _WIN32
+# include <fcntl.h>     // for open
+# include <sys/mman.h>  // for mmap, munmap
+# include <sys/stat.h>  // for fstat
+# include <unistd.h>    // for close, sysconf
+#endif
+
+namespace gemmi {
+
+enum class MapAccess : unsigned char {
+  ReadOnly,    // writing to the grid crashes the program (SIGSEGV)
+  CopyOnWrite  // modifications are private and never written to the file
+};
+
+// Maps length bytes of the file starting at offset (any offset - mmap()
+// alignment is handled here). Sets *ptr to the first requested byte.
+// The region is unmapped when the last copy of the returned keeper is gone.
+inline std::shared_ptr<void> map_file_region(const std::string& path,
+                                             size_t offset, size_t length,
+                                             MapAccess access, void** ptr) {
+#ifdef _WIN32
+  (void) offset, (void) length, (void) access, (void) ptr;
+  fail("Memory-mapped files are not supported on Windows: " + path);
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    fail("Failed to open file: " + path);
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || (size_t) st.st_size < offset + length) {
+    ::close(fd);
+    fail("File too short for the requested data: " + path);
+  }
+  size_t page = (size_t) ::sysconf(_SC_PAGESIZE);
+  size_t aligned_offset = offset / page * page;
+  size_t map_len = length + (offset - aligned_offset);
+  int prot = access == MapAccess::ReadOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+  void* base = ::mmap(nullptr, map_len, prot, MAP_PRIVATE, fd,
+                      (off_t) aligned_offset);
+  ::close(fd);  // the mapping stays valid after closing the descriptor
+  if (base == MAP_FAILED)
+    fail("mmap() failed for " + path);
+  *ptr = static_cast<char*>(base) + (offset - aligned_offset);
+  return std::shared_ptr<void>(base, [map_len](void* p) {
+    ::munmap(p, map_len);
+  });
+#endif
+}
+
+// Points grid.data at nu*nv*nw values of type T stored at the given offset
+// of the file. The grid size must be set before calling this function.
+// The file must have the native byte order.
+template<typename T>
+void map_grid_data(GridView<T>& grid, const std::string& path, size_t offset,
+                   MapAccess access=MapAccess::ReadOnly) {
+  size_t n = (size_t) grid.point_count();
+  void* ptr = nullptr;
+  std::shared_ptr<void> keeper = map_file_region(path, offset, n * sizeof(T),
+                                                 access, &ptr);
+  grid.data.borrow(static_cast<T*>(ptr), n, std::move(keeper));
+  grid.read_only = (access == MapAccess::ReadOnly);
+}
+
+} // namespace gemmi
+#endif
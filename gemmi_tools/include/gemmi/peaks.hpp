@@ -0,0 +1,209 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Peak search in maps: local maxima with sub-voxel refinement
+// and merging of symmetry-equivalent peaks.
+
+#ifndef GEMMI_PEAKS_HPP_
+#define GEMMI_PEAKS_HPP_
+
+#include <algorithm>    // for sort, push_heap, pop_heap
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "grid.hpp"     // for Grid, GridView
+#include "unitcell.hpp" // for UnitCell, Position
+#include "threads.hpp"  // for parallel_for
+#include "fail.hpp"     // for fail
+
+namespace gemmi {
+
+struct Peak {
+  double value;      // interpolated height
+  Position pos;      // refined position
+  int u, v, w;       // grid point of the local maximum
+  bool operator<(const Peak& o) const { return value > o.value; }
+};
+
+namespace impl {
+
+// Vertex of parabola through (-1, fm), (0, f0), (1, fp);
+// returns offset in [-0.5, 0.5] and adds height correction to value.
+inline double parabola_vertex(double fm, double f0, double fp, double& value) {
+  double curv = fm - 2 * f0 + fp;
+  if (curv >= 0)  // not a maximum along this axis (flat)
+    return 0.;
+  double off = 0.5 * (fm - fp) / curv;
+  off = std::max(-0.5, std::min(0.5, off));
+  value += 0.25 * (fp - fm) * off;
+  return off;
+}
+
+// Spatial hash of fractional positions (with periodic boundaries) that
+// finds if any stored point is closer than radius to a given position.
+// Bins are at least radius wide, so only 27 neighbouring bins are checked.
+struct PeriodicPointHash {
+  const UnitCell& cell;
+  double radius;
+  int nb[3];
+  std::unordered_map<long long, std::vector<Fractional>> bins;
+
+  PeriodicPointHash(const UnitCell& cell_, double radius_)
+    : cell(cell_), radius(radius_) {
+    // two points closer than radius differ by at most radius * |a*| in x
+    const double rec[3] = {cell.ar, cell.br, cell.cr};
+    for (int i = 0; i != 3; ++i)
+      nb[i] = (int) std::max(1., std::min(1e5, 1. / (radius * rec[i])));
+  }
+  long long key(const int* b) const {
+    return ((long long) b[2] * nb[1] + b[1]) * nb[0] + b[0];
+  }
+  void bin_of(const Fractional& f, int* b) const {
+    b[0] = std::min(nb[0] - 1, (int) (f.x * nb[0]));
+    b[1] = std::min(nb[1] - 1, (int) (f.y * nb[1]));
+    b[2] = std::min(nb[2] - 1, (int) (f.z * nb[2]));
+  }
+  void add(const Fractional& f) {
+    Fractional w = f.wrap_to_unit();
+    int b[3];
+    bin_of(w, b);
+    bins[key(b)].push_back(w);
+  }
+  bool has_point_near(const Fractional& f) const {
+    Fractional w = f.wrap_to_unit();
+    int b[3];
+    bin_of(w, b);
+    for (int dz = -1; dz <= 1; ++dz)
+      for (int dy = -1; dy <= 1; ++dy)
+        for (int dx = -1; dx <= 1; ++dx) {
+          int t[3] = {b[0] + dx, b[1] + dy, b[2] + dz};
+          int shift[3];
+          for (int i = 0; i != 3; ++i) {
+            shift[i] = t[i] < 0 ? -1 : t[i] >= nb[i] ? 1 : 0;
+            t[i] -= shift[i] * nb[i];
+          }
+          auto it = bins.find(key(t));
+          if (it == bins.end())
+            continue;
+          for (const Fractional& p : it->second) {
+            Fractional d(p.x + shift[0] - w.x, p.y + shift[1] - w.y,
+                         p.z + shift[2] - w.z);
+            if (cell.orthogonalize_difference(d).length_sq() <
+                radius * radius)
+              return true;
+          }
+        }
+    return false;
+  }
+};
+
+} // namespace impl
+
+// Finds local maxima (over 26 neighbours, periodic) higher than threshold.
+// On a plateau of equal values the point with the lowest index wins;
+// a plateau of irregular shape can give more than one peak.
+// If max_count > 0, only max_count highest peaks are returned; they are
+// selected using bounded heaps, one per thread. If merging leaves fewer
+// than max_count peaks from the truncated heaps, the search is repeated
+// with bigger heaps.
+// Peaks closer than merge_distance (A), taking into account symmetry of
+// grid.spacegroup and unit cell translations, are merged (the higher one
+// is kept). Merging uses a spatial hash of the symmetry images of kept
+// peaks. Returned peaks are sorted by value, the highest first.
+// G is Grid<T> or GridView<T> (which is searched without copying).
+template<typename G>
+std::vector<Peak> find_peaks(const G& grid, double threshold,
+                             size_t max_count=0, double merge_distance=0.,
+                             int nthreads=0) {
+  using T = typename G::value_type;
+  const int nu = grid.nu, nv = grid.nv, nw = grid.nw;
+  if (grid.axis_order != AxisOrder::XYZ)
+    fail("find_peaks: grid must cover the unit cell in XYZ order");
+  if (nu < 3 || nv < 3 || nw < 3)
+    fail("find_peaks: grid too small");
+  UnitCell cell = grid.unit_cell;
+  cell.set_cell_images_from_spacegroup(grid.spacegroup);
+  // each peak can have a symmetry mate in the candidate list
+  size_t capacity = max_count * (cell.images.size() + 1);
+  for (;;) {
+    std::vector<Peak> candidates;
+    bool truncated = false;
+    std::mutex mutex;
+    parallel_for(0, nw, nthreads, [&](int w_begin, int w_end) {
+      std::vector<Peak> heap;  // min-heap on value (see Peak::operator<)
+      bool dropped = false;
+      for (int w = w_begin; w != w_end; ++w)
+        for (int v = 0; v != nv; ++v)
+          for (int u = 0; u != nu; ++u) {
+            const size_t idx = grid.index_q(u, v, w);
+            T value = grid.data[idx];
+            if (!(value > threshold))
+              continue;
+            if (capacity != 0 && heap.size() == capacity &&
+                !(value > heap.front().value)) {
+              dropped = true;
+              continue;
+            }
+            bool is_max = true;
+            for (int dw = -1; dw <= 1 && is_max; ++dw)
+              for (int dv = -1; dv <= 1 && is_max; ++dv)
+                for (int du = -1; du <= 1; ++du) {
+                  if (du == 0 && dv == 0 && dw == 0)
+                    continue;
+                  size_t nb_idx = grid.index_n(u + du, v + dv, w + dw);
+                  T nb = grid.data[nb_idx];
+                  // Ties on plateaus: the point first in the raster order
+                  // of wrapped indices wins. The order is the same for all
+                  // points, so also a plateau that wraps around the cell
+                  // (where the offset of the neighbour would give a cycle)
+                  // has a winner.
+                  if (nb_idx < idx ? !(value > nb) : value < nb) {
+                    is_max = false;
+                    break;
+                  }
+                }
+            if (!is_max)
+              continue;
+            double h = value;
+            auto at = [&](int du, int dv, int dw) {
+              return (double) grid.data[grid.index_n(u + du, v + dv, w + dw)];
+            };
+            double ou = impl::parabola_vertex(at(-1,0,0), value, at(1,0,0), h);
+            double ov = impl::parabola_vertex(at(0,-1,0), value, at(0,1,0), h);
+            double ow = impl::parabola_vertex(at(0,0,-1), value, at(0,0,1), h);
+            Fractional f((u + ou) / nu, (v + ov) / nv, (w + ow) / nw);
+            heap.push_back(Peak{h, cell.orthogonalize(f), u, v, w});
+            std::push_heap(heap.begin(), heap.end());
+            if (capacity != 0 && heap.size() > capacity) {
+              std::pop_heap(heap.begin(), heap.end());
+              heap.pop_back();
+              dropped = true;
+            }
+          }
+      std::lock_guard<std::mutex> lock(mutex);
+      candidates.insert(candidates.end(), heap.begin(), heap.end());
+      truncated = truncated || dropped;
+    });
+    std::sort(candidates.begin(), candidates.end());
+    std::vector<Peak> peaks;
+    impl::PeriodicPointHash kept(cell, merge_distance);
+    for (const Peak& peak : candidates) {
+      if (max_count != 0 && peaks.size() == max_count)
+        break;
+      if (merge_distance > 0) {
+        Fractional f = cell.fractionalize(peak.pos);
+        if (kept.has_point_near(f))
+          continue;
+        kept.add(f);
+        for (const FTransform& image : cell.images)
+          kept.add(image.apply(f));
+      }
+      peaks.push_back(peak);
+    }
+    if (max_count == 0 || peaks.size() == max_count || !truncated)
+      return peaks;
+    capacity *= 4;
+  }
+}
+
+} // namespace gemmi
+#endif
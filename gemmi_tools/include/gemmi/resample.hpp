@@ -0,0 +1,102 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Resampling a map from one grid onto another grid (different cell,
+// spacing or frame of reference).
+
+#ifndef GEMMI_RESAMPLE_HPP_
+#define GEMMI_RESAMPLE_HPP_
+
+#include <array>
+#include <cmath>       // for floor
+#include "grid.hpp"    // for Grid, GridView, FPhiGrid
+#include "fourier.hpp" // for transform_map_to_f_phi, ...
+#include "math.hpp"    // for Transform
+#include "threads.hpp" // for parallel_for
+#include "fail.hpp"    // for fail
+
+namespace gemmi {
+
+// Wraps grid coordinate x to [0, n) as required by interpolate_value().
+inline double wrap_grid_coordinate(double x, int n) {
+  x -= std::floor(x / n) * n;
+  return x < n ? x : 0.;  // x == n can happen due to rounding
+}
+
+// Trilinear interpolation of n values along a straight line that starts
+// at point start and moves by step, both in grid coordinates of src.
+// G is Grid or GridView.
+template<typename G, typename T>
+void interpolate_row(const G& src, Vec3 start, const Vec3& step,
+                     int n, T* out) {
+  for (int i = 0; i != n; ++i, start += step)
+    out[i] = src.interpolate_value(wrap_grid_coordinate(start.x, src.nu),
+                                   wrap_grid_coordinate(start.y, src.nv),
+                                   wrap_grid_coordinate(start.z, src.nw));
+}
+
+// Fills dst (which must have unit cell and size already set) with values
+// interpolated from src. Transform tr maps Cartesian positions in the frame
+// of dst to Cartesian positions in the frame of src; identity by default.
+// The affine mapping from dst grid indices to src grid coordinates is
+// calculated once, so the inner loop only adds a constant step.
+// src can be also a GridView (e.g. a memory-mapped map), it's not copied.
+template<typename G, typename T>
+void resample(const G& src, Grid<T>& dst,
+              const Transform& tr=Transform(), int nthreads=0) {
+  if (src.axis_order != AxisOrder::XYZ)
+    fail("resample: source grid must cover the unit cell in XYZ order");
+  if (dst.point_count() == 0 || src.point_count() == 0)
+    fail("resample: empty grid");
+  // dst grid index -> dst fractional -> dst Cartesian -> src Cartesian
+  // -> src fractional -> src grid coordinate
+  Transform scale_dst;
+  scale_dst.mat = Mat33(1. / dst.nu, 0, 0,
+                        0, 1. / dst.nv, 0,
+                        0, 0, 1. / dst.nw);
+  Transform scale_src;
+  scale_src.mat = Mat33(src.nu, 0, 0,
+                        0, src.nv, 0,
+                        0, 0, src.nw);
+  Transform t = scale_src.combine(src.unit_cell.frac).combine(tr)
+                .combine(dst.unit_cell.orth).combine(scale_dst);
+  const Vec3 u_step(t.mat[0][0], t.mat[1][0], t.mat[2][0]);
+  parallel_for(0, dst.nw, nthreads, [&](int w_begin, int w_end) {
+    for (int w = w_begin; w != w_end; ++w)
+      for (int v = 0; v != dst.nv; ++v)
+        interpolate_row(src, t.apply(Vec3(0, v, w)), u_step, dst.nu,
+                        &dst.data[dst.index_q(0, v, w)]);
+  });
+}
+
+// Band-limited (exact for band-limited maps) resampling of src onto
+// a grid of the given size in the same unit cell, by zero-padding
+// (or truncating) the map coefficients. Size must be compatible
+// with the space group.
+template<typename T>
+Grid<T> resample_fourier(const Grid<T>& src, std::array<int, 3> size,
+                         int nthreads=0,
+                         FftPrecision precision=FftPrecision::Native) {
+  if (src.axis_order != AxisOrder::XYZ)
+    fail("resample_fourier: grid must cover the unit cell in XYZ order");
+  FPhiGrid<T> hkl = transform_map_to_f_phi(src, /*half_l=*/true, nthreads,
+                                           precision);
+  FPhiGrid<T> padded;
+  padded.unit_cell = hkl.unit_cell;
+  padded.spacegroup = hkl.spacegroup;
+  padded.half_l = true;
+  padded.axis_order = AxisOrder::XYZ;
+  check_grid_factors(padded.spacegroup, size[0], size[1], size[2]);
+  padded.set_size_without_checking(size[0], size[1], size[2] / 2 + 1);
+  // Nyquist terms are dropped, only |h| < min(n_src, n_dst) / 2 is copied.
+  int hmax = (std::min(src.nu, size[0]) - 1) / 2;
+  int kmax = (std::min(src.nv, size[1]) - 1) / 2;
+  int lmax = (std::min(src.nw, size[2]) - 1) / 2;
+  for (int l = 0; l <= lmax; ++l)
+    for (int k = -kmax; k <= kmax; ++k)
+      for (int h = -hmax; h <= hmax; ++h)
+        padded.data[padded.index_n(h, k, l)] = hkl.data[hkl.index_n(h, k, l)];
+  return transform_f_phi_grid_to_map(std::move(padded), nthreads, precision);
+}
+
+} // namespace gemmi
+#endif
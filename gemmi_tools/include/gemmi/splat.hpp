@@ -0,0 +1,116 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Batch operations on grid points around many atoms at once
+// (masking, density splatting), run in parallel.
+
+#ifndef GEMMI_SPLAT_HPP_
+#define GEMMI_SPLAT_HPP_
+
+#include <cmath>        // for sqrt, ceil, floor
+#include <vector>
+#include "grid.hpp"     // for Grid, modulo
+#include "unitcell.hpp" // for Position, Fractional
+#include "threads.hpp"  // for parallel_for_dynamic
+#include "fail.hpp"     // for fail
+
+namespace gemmi {
+
+// Calls func(point_value, d2, atom_index) for all grid points closer than
+// radii[i] to positions[i], for each i. It does the same as calling
+// Grid::use_points_around() for each atom, but:
+//  - atoms are binned into slabs of sections (w) and slabs are processed
+//    in parallel -- each slab is written by one thread only, so func does
+//    not need to be thread-safe as long as it only modifies point_value,
+//  - Cartesian offsets are updated incrementally along rows and the row
+//    limits are calculated analytically, without orthogonalizing each point.
+template<typename T, typename Func>
+void splat_atoms(Grid<T>& grid, const std::vector<Position>& positions,
+                 const std::vector<double>& radii, Func func, int nthreads=0) {
+  if (radii.size() != positions.size())
+    fail("splat_atoms: positions and radii differ in length");
+  if (grid.point_count() == 0)
+    fail("splat_atoms: grid not set up");
+  struct Sphere {
+    Vec3 center;  // orthogonalized wrapped fractional coordinates
+    double r2;
+    int u0, v0, w0, du, dv, dw;
+  };
+  const int nu = grid.nu, nv = grid.nv, nw = grid.nw;
+  const Mat33& orth = grid.unit_cell.orth.mat;
+  const Vec3 su = Vec3(orth[0][0], orth[1][0], orth[2][0]) / nu;
+  const Vec3 sv = Vec3(orth[0][1], orth[1][1], orth[2][1]) / nv;
+  const Vec3 sw = Vec3(orth[0][2], orth[1][2], orth[2][2]) / nw;
+  const double su_sq = su.length_sq();
+
+  nthreads = resolve_thread_count(nthreads);
+  const int nslabs = std::min(nw, 4 * nthreads);
+  std::vector<std::vector<int>> bins(nslabs);
+  std::vector<Sphere> spheres(positions.size());
+  for (size_t i = 0; i != positions.size(); ++i) {
+    Sphere& s = spheres[i];
+    double radius = radii[i];
+    Fractional fctr = grid.unit_cell.fractionalize(positions[i]).wrap_to_unit();
+    s.center = orth.multiply(fctr);
+    s.r2 = radius * radius;
+    s.du = (int) std::ceil(radius / grid.spacing[0]);
+    s.dv = (int) std::ceil(radius / grid.spacing[1]);
+    s.dw = (int) std::ceil(radius / grid.spacing[2]);
+    if (2 * s.du >= nu || 2 * s.dv >= nv || 2 * s.dw >= nw)
+      fail("grid operation failed: radius bigger than half the unit cell?");
+    s.u0 = iround(fctr.x * nu);
+    s.v0 = iround(fctr.y * nv);
+    s.w0 = iround(fctr.z * nw);
+    // atoms are processed in order, so back() catches all duplicates
+    for (int w = s.w0 - s.dw; w <= s.w0 + s.dw; ++w) {
+      std::vector<int>& bin = bins[(long long) modulo(w, nw) * nslabs / nw];
+      if (bin.empty() || bin.back() != (int) i)
+        bin.push_back((int) i);
+    }
+  }
+
+  parallel_for_dynamic(nslabs, nthreads, [&](int slab) {
+    // range of sections [w_begin, w_end) that belongs to this slab
+    int w_begin = int(((long long) slab * nw + nslabs - 1) / nslabs);
+    int w_end = int(((long long) (slab + 1) * nw + nslabs - 1) / nslabs);
+    for (int i : bins[slab]) {
+      const Sphere& s = spheres[i];
+      for (int w = s.w0 - s.dw; w <= s.w0 + s.dw; ++w) {
+        int wm = w < 0 ? w + nw : w >= nw ? w - nw : w;
+        if (wm < w_begin || wm >= w_end)
+          continue;
+        for (int v = s.v0 - s.dv; v <= s.v0 + s.dv; ++v) {
+          int vm = v < 0 ? v + nv : v >= nv ? v - nv : v;
+          // offset center-point is a - u * su; solve |a - u * su|^2 < r^2
+          Vec3 a = s.center - sv * v - sw * w;
+          double b = a.dot(su);
+          double disc = b * b - su_sq * (a.length_sq() - s.r2);
+          if (disc < 0)
+            continue;
+          double sq = std::sqrt(disc);
+          int u_lo = std::max(s.u0 - s.du, (int) std::ceil((b - sq) / su_sq));
+          int u_hi = std::min(s.u0 + s.du, (int) std::floor((b + sq) / su_sq));
+          int row = grid.index_q(0, vm, wm);
+          Vec3 d = a - su * u_lo;
+          for (int u = u_lo; u <= u_hi; ++u, d -= su) {
+            double d2 = d.length_sq();
+            if (d2 < s.r2) {
+              int um = u < 0 ? u + nu : u >= nu ? u - nu : u;
+              func(grid.data[row + um], d2, i);
+            }
+          }
+        }
+      }
+    }
+  });
+}
+
+// Sets all points within radii[i] from positions[i] to value.
+template<typename T>
+void mask_atoms(Grid<T>& grid, const std::vector<Position>& positions,
+                const std::vector<double>& radii, T value=1, int nthreads=0) {
+  splat_atoms(grid, positions, radii,
+              [value](T& point, double, int) { point = value; }, nthreads);
+}
+
+} // namespace gemmi
+#endif
@@ -383,6 +383,18 @@ struct GroupOps {
     return find_by_rotation({-Op::DEN,0,0, 0,-Op::DEN,0, 0,0,-Op::DEN}) != nullptr;
   }
 
+  bool is_systematically_absent(const Op::Miller& hkl) const {
+    for (auto i = cen_ops.begin() + 1; i != cen_ops.end(); ++i)
+      if ((hkl[0] * (*i)[0] + hkl[1] * (*i)[1] + hkl[2] * (*i)[2]) % Op::DEN != 0)
+        return true;
+    for (auto op = sym_ops.begin() + 1; op != sym_ops.end(); ++op)
+      if (op->apply_to_hkl(hkl) == hkl &&
+          (hkl[0] * op->tran[0] + hkl[1] * op->tran[1] +
+           hkl[2] * op->tran[2]) % Op::DEN != 0)
+        return true;
+    return false;
+  }
+
   void change_basis(const Op& cob) {
     if (sym_ops.empty() || cen_ops.empty())
       return;
@@ -0,0 +1,179 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Minimal helpers for running grid loops on several std::threads.
+
+#ifndef GEMMI_THREADS_HPP_
+#define GEMMI_THREADS_HPP_
+
+#include <algorithm>  // for min
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>    // for size_t
+#include <exception>  // for exception_ptr, rethrow_exception
+#include <mutex>
+#include <thread>
+#include <utility>    // for move
+#include <vector>
+
+namespace gemmi {
+
+namespace impl {
+inline std::atomic<int>& default_thread_count() {
+  static std::atomic<int> n(0);
+  return n;
+}
+} // namespace impl
+
+// Thread count used by functions called with nthreads <= 0.
+// 0 (the initial value) means: as many as the hardware supports.
+inline void set_default_thread_count(int n) {
+  impl::default_thread_count() = std::max(n, 0);
+}
+inline int get_default_thread_count() { return impl::default_thread_count(); }
+
+// nthreads <= 0 means: the default thread count (see above).
+inline int resolve_thread_count(int nthreads) {
+  if (nthreads <= 0)
+    nthreads = impl::default_thread_count();
+  if (nthreads <= 0)
+    nthreads = (int) std::thread::hardware_concurrency();
+  return std::max(nthreads, 1);
+}
+
+// Splits [begin, end) into up to nthreads contiguous ranges and calls
+// func(range_begin, range_end) for each range in a separate thread.
+// An exception thrown by any of the workers is re-thrown in the caller.
+template<typename Func>
+void parallel_for(int begin, int end, int nthreads, Func func) {
+  int n = end - begin;
+  if (n <= 0)
+    return;
+  nthreads = std::min(resolve_thread_count(nthreads), n);
+  if (nthreads == 1) {
+    func(begin, end);
+    return;
+  }
+  std::vector<std::exception_ptr> errors(nthreads);
+  std::vector<std::thread> threads;
+  threads.reserve(nthreads);
+  for (int i = 0; i != nthreads; ++i) {
+    int b = begin + int((long long) n * i / nthreads);
+    int e = begin + int((long long) n * (i + 1) / nthreads);
+    threads.emplace_back([&func, &errors, i, b, e]() {
+      try {
+        func(b, e);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    });
+  }
+  for (std::thread& t : threads)
+    t.join();
+  for (std::exception_ptr& err : errors)
+    if (err)
+      std::rethrow_exception(err);
+}
+
+// Calls func(i) for each i in [0, n). Indices are handed out one by one
+// to up to nthreads threads, which balances tasks of uneven cost.
+template<typename Func>
+void parallel_for_dynamic(int n, int nthreads, Func func) {
+  std::atomic<int> next(0);
+  nthreads = std::min(resolve_thread_count(nthreads), n);
+  parallel_for(0, nthreads, nthreads, [&](int, int) {
+    for (int i = next++; i < n; i = next++)
+      func(i);
+  });
+}
+
+// Calls func(i) for each i in [0, n), for elementwise operations on arrays
+// that may have more than INT_MAX elements.
+template<typename Func>
+void parallel_for_each_index(size_t n, int nthreads, Func func) {
+  const size_t chunk = 1 << 16;
+  int n_chunks = int((n + chunk - 1) / chunk);
+  parallel_for(0, n_chunks, nthreads, [&](int begin, int end) {
+    size_t stop = std::min(n, end * chunk);
+    for (size_t i = begin * chunk; i < stop; ++i)
+      func(i);
+  });
+}
+
+// Calls produce(i) for each i in [0, n) in up to nthreads worker threads
+// and consume(i, result) in the calling thread, in order of i, so that
+// producing (e.g. conversion and compression) overlaps with consuming
+// (e.g. writing to a file). Workers run at most max_ahead items ahead of
+// the consumer, which bounds the number of results kept in memory.
+template<typename Result, typename Produce, typename Consume>
+void ordered_pipeline(size_t n, int nthreads, size_t max_ahead,
+                      Produce produce, Consume consume) {
+  max_ahead = std::max<size_t>(max_ahead, 1);
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<Result> slots(max_ahead);
+  std::vector<char> ready(max_ahead, 0);
+  size_t next_item = 0;
+  size_t consumed = 0;
+  bool stop = false;
+  std::exception_ptr error;
+  auto set_error = [&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error)
+      error = std::current_exception();
+    stop = true;
+  };
+  auto worker = [&]() {
+    for (;;) {
+      size_t i;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() {
+          return stop || next_item >= n || next_item < consumed + max_ahead;
+        });
+        if (stop || next_item >= n)
+          return;
+        i = next_item++;
+      }
+      try {
+        Result r = produce(i);
+        std::lock_guard<std::mutex> lock(mutex);
+        slots[i % max_ahead] = std::move(r);
+        ready[i % max_ahead] = 1;
+      } catch (...) {
+        set_error();
+      }
+      cv.notify_all();
+    }
+  };
+  int n_workers = (int) std::min<size_t>(resolve_thread_count(nthreads), n);
+  std::vector<std::thread> threads;
+  threads.reserve(n_workers);
+  for (int i = 0; i < n_workers; ++i)
+    threads.emplace_back(worker);
+  try {
+    for (size_t i = 0; i < n; ++i) {
+      Result r;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]() { return stop || ready[i % max_ahead]; });
+        if (stop)
+          break;
+        r = std::move(slots[i % max_ahead]);
+        ready[i % max_ahead] = 0;
+        ++consumed;
+      }
+      cv.notify_all();
+      consume(i, r);
+    }
+  } catch (...) {
+    set_error();
+    cv.notify_all();
+  }
+  for (std::thread& t : threads)
+    t.join();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+} // namespace gemmi
+#endif
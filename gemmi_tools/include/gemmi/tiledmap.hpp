@@ -0,0 +1,441 @@
+// Copyright 2019 Global Phasing Ltd.
+//
+// Compressed file format for grids with random access to tiles.
+// Header (cell, space group, grid size, axis order) is followed by a table
+// of tiles and by tiles -- blocks of up to 64^3 points, each compressed
+// independently with zlib (optionally after quantization to 8 or 16 bits).
+// A box can be read by decompressing only the tiles that intersect it.
+
+#ifndef GEMMI_TILEDMAP_HPP_
+#define GEMMI_TILEDMAP_HPP_
+
+#include <algorithm>    // for min, max
+#include <array>
+#include <cmath>        // for isfinite, round
+#include <cstdint>      // for uint8_t, uint16_t, uint32_t, uint64_t
+#include <cstdio>       // for fread, fwrite
+#include <cstring>      // for memcpy, memset
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "fail.hpp"     // for fail
+#include "fileutil.hpp" // for file_open, fileptr_t
+#include "grid.hpp"     // for Grid, modulo
+#include "gzindex.hpp"  // for impl::seek_file, impl::read_le, ...
+#include "symmetry.hpp" // for find_spacegroup_by_name
+#include "threads.hpp"  // for parallel_for, parallel_for_dynamic
+
+namespace gemmi {
+
+// How the values of a tile are stored. Values are always float32 in the
+// file; bytes of multi-byte values are shuffled (all first bytes, then all
+// second bytes, ...) before compression, which improves compression ratio.
+enum class TileEncoding : std::uint8_t {
+  Float32=0,  // lossless
+  Quant8=1,   // value = offset + q * scale, q is 8-bit
+  Quant16=2   // the same, 16-bit
+};
+
+struct TileInfo {
+  std::uint64_t offset;  // in the file
+  std::uint32_t size;    // compressed size
+  TileEncoding encoding;
+  float offset_value;    // for quantized tiles
+  float scale;
+};
+
+struct TiledMapHeader {
+  UnitCell unit_cell;
+  const SpaceGroup* spacegroup = nullptr;
+  int nu = 0, nv = 0, nw = 0;
+  AxisOrder axis_order = AxisOrder::Unknown;
+  int tile_size = 64;
+  std::vector<TileInfo> tiles;  // u (tile index) changes fastest
+
+  std::array<int, 3> tile_counts() const {
+    return {{(nu + tile_size - 1) / tile_size, (nv + tile_size - 1) / tile_size,
+             (nw + tile_size - 1) / tile_size}};
+  }
+};
+
+namespace impl {
+
+constexpr size_t tiled_header_size = 128;
+constexpr size_t tiled_entry_size = 24;
+
+inline void shuffle_bytes(const unsigned char* in, size_t n, int width,
+                          unsigned char* out) {
+  for (size_t i = 0; i != n; ++i)
+    for (int b = 0; b != width; ++b)
+      out[b * n + i] = in[i * width + b];
+}
+
+inline void unshuffle_bytes(const unsigned char* in, size_t n, int width,
+                            unsigned char* out) {
+  for (size_t i = 0; i != n; ++i)
+    for (int b = 0; b != width; ++b)
+      out[i * width + b] = in[b * n + i];
+}
+
+// Encodes values of one tile, returns compressed data.
+inline std::vector<unsigned char> encode_tile(const std::vector<float>& values,
+                                              int quant_bits, int level,
+                                              TileInfo& info) {
+  const size_t n = values.size();
+  info.encoding = TileEncoding::Float32;
+  info.offset_value = 0.f;
+  info.scale = 0.f;
+  float vmin = values[0], vmax = values[0];
+  bool all_finite = true;  // NaN and +/-inf can't be quantized
+  for (float v : values) {
+    if (!std::isfinite(v))
+      all_finite = false;
+    vmin = std::min(vmin, v);
+    vmax = std::max(vmax, v);
+  }
+  std::vector<unsigned char> raw;
+  if (quant_bits != 0 && all_finite) {
+    double levels = quant_bits == 8 ? 255. : 65535.;
+    info.encoding = quant_bits == 8 ? TileEncoding::Quant8
+                                    : TileEncoding::Quant16;
+    info.offset_value = vmin;
+    info.scale = float((double(vmax) - vmin) / levels);
+    double inv = info.scale > 0 ? 1. / info.scale : 0.;
+    int width = quant_bits / 8;
+    std::vector<unsigned char> q(n * width);
+    for (size_t i = 0; i != n; ++i) {
+      double x = std::round((values[i] - vmin) * inv);
+      std::uint16_t k = (std::uint16_t) std::min(std::max(x, 0.), levels);
+      q[i * width] = (unsigned char) (k & 0xff);
+      if (width == 2)
+        q[i * width + 1] = (unsigned char) (k >> 8);
+    }
+    raw.resize(q.size());
+    shuffle_bytes(q.data(), n, width, raw.data());
+  } else {
+    std::vector<unsigned char> le(n * 4);
+    for (size_t i = 0; i != n; ++i) {
+      std::uint32_t u;
+      std::memcpy(&u, &values[i], 4);
+      for (int b = 0; b != 4; ++b)
+        le[4 * i + b] = (unsigned char) (u >> (8 * b));
+    }
+    raw.resize(le.size());
+    shuffle_bytes(le.data(), n, 4, raw.data());
+  }
+  uLongf zlen = compressBound((uLong) raw.size());
+  std::vector<unsigned char> out(zlen);
+  if (compress2(out.data(), &zlen, raw.data(), (uLong) raw.size(), level)
+      != Z_OK)
+    fail("compress2 failed");
+  out.resize(zlen);
+  info.size = (std::uint32_t) zlen;
+  return out;
+}
+
+inline void decode_tile(const std::vector<unsigned char>& data,
+                        const TileInfo& info, std::vector<float>& values) {
+  const size_t n = values.size();
+  int width = info.encoding == TileEncoding::Quant8 ? 1 :
+              info.encoding == TileEncoding::Quant16 ? 2 : 4;
+  std::vector<unsigned char> raw(n * width);
+  uLongf len = (uLongf) raw.size();
+  if (uncompress(raw.data(), &len, data.data(), (uLong) data.size()) != Z_OK ||
+      len != raw.size())
+    fail("Corrupted tile in tiled map");
+  std::vector<unsigned char> bytes(raw.size());
+  unshuffle_bytes(raw.data(), n, width, bytes.data());
+  if (width == 4) {
+    for (size_t i = 0; i != n; ++i) {
+      std::uint32_t u = (std::uint32_t) read_le(&bytes[4 * i], 4);
+      std::memcpy(&values[i], &u, 4);
+    }
+  } else {
+    for (size_t i = 0; i != n; ++i) {
+      unsigned k = width == 1 ? bytes[i] : (unsigned) read_le(&bytes[2 * i], 2);
+      values[i] = info.offset_value + k * info.scale;
+    }
+  }
+}
+
+inline void put_le(unsigned char* p, std::uint64_t value, int n) {
+  for (int i = 0; i != n; ++i)
+    p[i] = (unsigned char) (value >> (8 * i));
+}
+
+inline void put_f32(unsigned char* p, float f) {
+  std::uint32_t u;
+  std::memcpy(&u, &f, 4);
+  put_le(p, u, 4);
+}
+
+inline float get_f32(const unsigned char* p) {
+  std::uint32_t u = (std::uint32_t) read_le(p, 4);
+  float f;
+  std::memcpy(&f, &u, 4);
+  return f;
+}
+
+inline void put_f64(unsigned char* p, double d) {
+  std::uint64_t u;
+  std::memcpy(&u, &d, 8);
+  put_le(p, u, 8);
+}
+
+inline double get_f64(const unsigned char* p) {
+  std::uint64_t u = read_le(p, 8);
+  double d;
+  std::memcpy(&d, &u, 8);
+  return d;
+}
+
+// Reads and decodes tile (tu, tv, tw); data and values are work buffers,
+// values get su*sv*sw values of the tile, where s* is the tile's size.
+inline void read_tile(std::FILE* f, const std::string& path,
+                      const TiledMapHeader& header, int tu, int tv, int tw,
+                      std::vector<unsigned char>& data,
+                      std::vector<float>& values, int* s) {
+  const int ts = header.tile_size;
+  std::array<int, 3> nt = header.tile_counts();
+  const TileInfo& info = header.tiles[(tw * nt[1] + tv) * nt[0] + tu];
+  data.resize(info.size);
+  if (!seek_file(f, info.offset) ||
+      std::fread(data.data(), data.size(), 1, f) != 1)
+    fail("Failed to read tile from " + path);
+  s[0] = std::min(ts, header.nu - tu * ts);
+  s[1] = std::min(ts, header.nv - tv * ts);
+  s[2] = std::min(ts, header.nw - tw * ts);
+  values.resize((size_t) s[0] * s[1] * s[2]);
+  decode_tile(data, info, values);
+}
+
+} // namespace impl
+
+// Writes grid in the tiled format (little-endian). quant_bits: 0 (lossless),
+// 8 or 16 -- quantization with offset and scale per tile; the error is up to
+// half of (max - min) / 255 or / 65535 of the tile. Tiles with NaN or
+// infinity are always stored losslessly. Tiles are compressed in parallel.
+template<typename T>
+void write_tiled_map(const Grid<T>& grid, const std::string& path,
+                     int quant_bits=0, int level=6, int nthreads=0,
+                     int tile_size=64) {
+  if (quant_bits != 0 && quant_bits != 8 && quant_bits != 16)
+    fail("write_tiled_map: quant_bits must be 0, 8 or 16");
+  if (tile_size <= 0 || tile_size > 256)
+    fail("write_tiled_map: wrong tile size");
+  TiledMapHeader header;
+  header.nu = grid.nu, header.nv = grid.nv, header.nw = grid.nw;
+  header.tile_size = tile_size;
+  std::array<int, 3> nt = header.tile_counts();
+  int n_tiles = nt[0] * nt[1] * nt[2];
+  header.tiles.resize(n_tiles);
+  std::vector<std::vector<unsigned char>> compressed(n_tiles);
+  parallel_for_dynamic(n_tiles, nthreads, [&](int t) {
+    int u0 = t % nt[0] * tile_size;
+    int v0 = t / nt[0] % nt[1] * tile_size;
+    int w0 = t / (nt[0] * nt[1]) * tile_size;
+    int u1 = std::min(u0 + tile_size, grid.nu);
+    int v1 = std::min(v0 + tile_size, grid.nv);
+    int w1 = std::min(w0 + tile_size, grid.nw);
+    std::vector<float> values;
+    values.reserve((size_t) (u1 - u0) * (v1 - v0) * (w1 - w0));
+    for (int w = w0; w != w1; ++w)
+      for (int v = v0; v != v1; ++v)
+        for (int u = u0; u != u1; ++u)
+          values.push_back((float) grid.data[grid.index_q(u, v, w)]);
+    compressed[t] = impl::encode_tile(values, quant_bits, level,
+                                      header.tiles[t]);
+  });
+  std::vector<unsigned char> head(impl::tiled_header_size, 0);
+  std::memcpy(head.data(), "GEMMITIL", 8);
+  impl::put_le(&head[8], 1, 4);  // version
+  impl::put_le(&head[12], (std::uint32_t) tile_size, 4);
+  impl::put_le(&head[16], (std::uint32_t) grid.nu, 4);
+  impl::put_le(&head[20], (std::uint32_t) grid.nv, 4);
+  impl::put_le(&head[24], (std::uint32_t) grid.nw, 4);
+  impl::put_le(&head[28], (std::uint32_t) grid.axis_order, 4);
+  const UnitCell& cell = grid.unit_cell;
+  const double params[6] = {cell.a, cell.b, cell.c,
+                            cell.alpha, cell.beta, cell.gamma};
+  for (int i = 0; i != 6; ++i)
+    impl::put_f64(&head[32 + 8 * i], params[i]);
+  impl::put_le(&head[80], grid.spacegroup ? grid.spacegroup->ccp4 : 0, 4);
+  if (grid.spacegroup) {
+    std::string hm = grid.spacegroup->xhm();
+    std::memcpy(&head[84], hm.c_str(), std::min<size_t>(hm.size(), 40));
+  }
+  std::vector<unsigned char> table(n_tiles * impl::tiled_entry_size);
+  std::uint64_t offset = head.size() + table.size();
+  for (int t = 0; t != n_tiles; ++t) {
+    TileInfo& info = header.tiles[t];
+    info.offset = offset;
+    offset += info.size;
+    unsigned char* e = &table[t * impl::tiled_entry_size];
+    impl::put_le(e, info.offset, 8);
+    impl::put_le(e + 8, info.size, 4);
+    e[12] = (unsigned char) info.encoding;
+    impl::put_f32(e + 16, info.offset_value);
+    impl::put_f32(e + 20, info.scale);
+  }
+  fileptr_t f = file_open(path.c_str(), "wb");
+  bool ok = std::fwrite(head.data(), head.size(), 1, f.get()) == 1 &&
+            std::fwrite(table.data(), table.size(), 1, f.get()) == 1;
+  for (const std::vector<unsigned char>& c : compressed)
+    ok = ok && std::fwrite(c.data(), c.size(), 1, f.get()) == 1;
+  if (!ok)
+    fail("Failed to write " + path);
+}
+
+inline TiledMapHeader read_tiled_map_header(const std::string& path) {
+  fileptr_t f = file_open(path.c_str(), "rb");
+  unsigned char head[impl::tiled_header_size];
+  if (std::fread(head, sizeof(head), 1, f.get()) != 1 ||
+      std::memcmp(head, "GEMMITIL", 8) != 0)
+    fail("Not a tiled map: " + path);
+  if (impl::read_le(head + 8, 4) != 1)
+    fail("Unsupported version of tiled map: " + path);
+  TiledMapHeader header;
+  header.tile_size = (int) impl::read_le(head + 12, 4);
+  header.nu = (int) impl::read_le(head + 16, 4);
+  header.nv = (int) impl::read_le(head + 20, 4);
+  header.nw = (int) impl::read_le(head + 24, 4);
+  header.axis_order = (AxisOrder) impl::read_le(head + 28, 4);
+  double p[6];
+  for (int i = 0; i != 6; ++i)
+    p[i] = impl::get_f64(head + 32 + 8 * i);
+  header.unit_cell.set(p[0], p[1], p[2], p[3], p[4], p[5]);
+  char hm[41] = {0};
+  std::memcpy(hm, head + 84, 40);
+  if (hm[0] != '\0')
+    header.spacegroup = find_spacegroup_by_name(hm);
+  // (the limit on the size keeps tile_counts() from overflowing)
+  const int max_size = 1 << 30;
+  if (header.tile_size <= 0 || header.tile_size > 256 ||
+      header.nu <= 0 || header.nv <= 0 || header.nw <= 0 ||
+      header.nu > max_size || header.nv > max_size || header.nw > max_size ||
+      impl::read_le(head + 28, 4) > (std::uint64_t) AxisOrder::ZYX)
+    fail("Corrupted header of tiled map: " + path);
+  // sizes are checked against the file size before anything is allocated
+  std::uint64_t file_size;
+  std::int64_t mtime;
+  impl::gz_file_stat(path, file_size, mtime);
+  const int n[3] = {header.nu, header.nv, header.nw};
+  std::array<int, 3> nt = header.tile_counts();
+  std::uint64_t n_tiles = (std::uint64_t) nt[0] * nt[1] * nt[2];
+  std::uint64_t data_start = impl::tiled_header_size +
+                             n_tiles * impl::tiled_entry_size;
+  if (n_tiles > file_size / impl::tiled_entry_size || data_start > file_size)
+    fail("Truncated tiled map (tile table): " + path);
+  std::vector<unsigned char> table((size_t) n_tiles * impl::tiled_entry_size);
+  if (std::fread(table.data(), table.size(), 1, f.get()) != 1)
+    fail("Failed to read tile table: " + path);
+  header.tiles.resize((size_t) n_tiles);
+  for (size_t t = 0; t != header.tiles.size(); ++t) {
+    const unsigned char* e = &table[t * impl::tiled_entry_size];
+    TileInfo& info = header.tiles[t];
+    info.offset = impl::read_le(e, 8);
+    info.size = (std::uint32_t) impl::read_le(e + 8, 4);
+    if (e[12] > (unsigned char) TileEncoding::Quant16)
+      fail("Unknown tile encoding in tiled map: " + path);
+    info.encoding = (TileEncoding) e[12];
+    info.offset_value = impl::get_f32(e + 16);
+    info.scale = impl::get_f32(e + 20);
+    if (info.offset < data_start || info.offset > file_size ||
+        info.size > file_size - info.offset)
+      fail("Truncated tiled map (tile " + std::to_string(t) + "): " + path);
+    // zlib can't compress more than ~1032:1
+    std::uint64_t tile_points = 1;
+    for (int a = 0; a != 3; ++a) {
+      int c = int(a == 0 ? t % nt[0] : a == 1 ? t / nt[0] % nt[1]
+                                              : t / (nt[0] * nt[1]));
+      tile_points *= std::min(header.tile_size, n[a] - c * header.tile_size);
+    }
+    if (info.size < tile_points / 1032)
+      fail("Corrupted tile " + std::to_string(t) + " in " + path);
+  }
+  return header;
+}
+
+// Reads values in a box of size[0] x size[1] x size[2] points starting at
+// grid point start (coordinates are wrapped, as in a periodic grid).
+// Returns values with u changing fastest. Only tiles that intersect
+// the box are read; they are decompressed in parallel.
+inline std::vector<float> read_tiled_map_box(const std::string& path,
+                                             const TiledMapHeader& header,
+                                             std::array<int, 3> start,
+                                             std::array<int, 3> size,
+                                             int nthreads=0) {
+  const int n[3] = {header.nu, header.nv, header.nw};
+  const int ts = header.tile_size;
+  std::array<int, 3> nt = header.tile_counts();
+  // for each axis and tile: pairs (index in box, index in tile)
+  std::vector<std::vector<std::pair<int, int>>> along[3];
+  std::vector<int> used[3];  // tiles intersecting the box
+  for (int a = 0; a != 3; ++a) {
+    if (size[a] < 0)
+      fail("read_tiled_map_box: negative size");
+    along[a].resize(nt[a]);
+    for (int i = 0; i != size[a]; ++i) {
+      int c = modulo(start[a] + i, n[a]);
+      along[a][c / ts].emplace_back(i, c % ts);
+    }
+    for (int t = 0; t != nt[a]; ++t)
+      if (!along[a][t].empty())
+        used[a].push_back(t);
+  }
+  std::vector<float> out((size_t) size[0] * size[1] * size[2]);
+  int n_used = int(used[0].size() * used[1].size() * used[2].size());
+  parallel_for(0, n_used, nthreads, [&](int begin, int end) {
+    fileptr_t f = file_open(path.c_str(), "rb");
+    std::vector<unsigned char> data;
+    std::vector<float> values;
+    for (int k = begin; k != end; ++k) {
+      int tu = used[0][k % used[0].size()];
+      int tv = used[1][k / used[0].size() % used[1].size()];
+      int tw = used[2][k / (used[0].size() * used[1].size())];
+      int s[3];  // size of this tile
+      impl::read_tile(f.get(), path, header, tu, tv, tw, data, values, s);
+      for (const std::pair<int, int>& w : along[2][tw])
+        for (const std::pair<int, int>& v : along[1][tv])
+          for (const std::pair<int, int>& u : along[0][tu])
+            out[((size_t) w.first * size[1] + v.first) * size[0] + u.first] =
+              values[((size_t) w.second * s[1] + v.second) * s[0] + u.second];
+    }
+  });
+  return out;
+}
+
+// Reads the whole map; tiles are decoded in parallel, each directly
+// into the grid.
+template<typename T=float>
+Grid<T> read_tiled_map(const std::string& path, int nthreads=0) {
+  TiledMapHeader header = read_tiled_map_header(path);
+  Grid<T> grid;
+  grid.unit_cell = header.unit_cell;
+  grid.spacegroup = header.spacegroup;
+  grid.set_size_without_checking(header.nu, header.nv, header.nw);
+  grid.axis_order = header.axis_order;
+  const int ts = header.tile_size;
+  std::array<int, 3> nt = header.tile_counts();
+  parallel_for(0, nt[0] * nt[1] * nt[2], nthreads, [&](int begin, int end) {
+    fileptr_t f = file_open(path.c_str(), "rb");
+    std::vector<unsigned char> data;
+    std::vector<float> values;
+    for (int t = begin; t != end; ++t) {
+      int tu = t % nt[0], tv = t / nt[0] % nt[1], tw = t / (nt[0] * nt[1]);
+      int s[3];
+      impl::read_tile(f.get(), path, header, tu, tv, tw, data, values, s);
+      const float* in = values.data();
+      for (int w = tw * ts; w != tw * ts + s[2]; ++w)
+        for (int v = tv * ts; v != tv * ts + s[1]; ++v) {
+          T* out = &grid.data[grid.index_q(tu * ts, v, w)];
+          for (int u = 0; u != s[0]; ++u)
+            out[u] = (T) *in++;
+        }
+    }
+  });
+  return grid;
+}
+
+} // namespace gemmi
+#endif
@@ -0,0 +1,604 @@
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+#include <pybind11/numpy.h>
+
+#include <chrono>
+#include <future>
+#include <memory>
+
+#include <gemmi/blobs.hpp>
+#include <gemmi/ccp4.hpp>
+#include <gemmi/directsum.hpp>
+#include <gemmi/edt.hpp>
+#include <gemmi/fourier.hpp>
+#include <gemmi/grid.hpp>
+#include <gemmi/gzindex.hpp>
+#include <gemmi/headerscan.hpp>
+#include <gemmi/localcorr.hpp>
+#include <gemmi/mmap.hpp>
+#include <gemmi/peaks.hpp>
+#include <gemmi/resample.hpp>
+#include <gemmi/splat.hpp>
+#include <gemmi/threads.hpp>
+#include <gemmi/tiledmap.hpp>
+
+namespace py = pybind11;
+using namespace gemmi;
+
+
+// The array is referenced (not copied) by the view; the reference is
+// released with the GIL held, because views may be destroyed in threads.
+GridView<float> grid_view_of_array(py::array_t<float, 0> arr,
+	const UnitCell& cell, const SpaceGroup* sg)
+{
+	if (arr.ndim() != 3 || !(arr.flags() & py::array::f_style))
+		throw std::invalid_argument("expected F-contiguous 3D array (nu, nv, nw)");
+	if (!arr.writeable())
+		throw std::invalid_argument("expected writeable array");
+	GridView<float> view;
+	view.unit_cell = cell;
+	view.spacegroup = sg;
+	view.nu = (int) arr.shape(0);
+	view.nv = (int) arr.shape(1);
+	view.nw = (int) arr.shape(2);
+	view.axis_order = AxisOrder::XYZ;
+	py::object* owner = new py::object(arr);
+	std::shared_ptr<void> keeper(owner, [](void* p)
+		{
+			py::gil_scoped_acquire gil;
+			delete static_cast<py::object*>(p);
+		});
+	view.data.borrow(arr.mutable_data(), (size_t) arr.size(), keeper);
+	return view;
+}
+
+std::vector<Position> positions_from_array(py::array_t<double> positions)
+{
+	auto r = positions.unchecked<2>();
+	if (r.shape(1) != 3)
+		throw std::invalid_argument("positions must have shape (N, 3)");
+	std::vector<Position> result;
+	result.reserve(r.shape(0));
+	for (ssize_t i = 0; i < r.shape(0); i++)
+		result.emplace_back(r(i, 0), r(i, 1), r(i, 2));
+	return result;
+}
+
+template<typename Stream>
+void read_ccp4_region_from(Stream& stream, const std::string& path,
+	const std::array<double, 3>& lo, const std::array<double, 3>& hi,
+	bool fractional, Ccp4<float>& ccp4)
+{
+	if (fractional)
+		ccp4.read_ccp4_region_stream(stream, path,
+			Fractional(lo[0], lo[1], lo[2]), Fractional(hi[0], hi[1], hi[2]));
+	else
+		ccp4.read_ccp4_region_stream(stream, path,
+			Position(lo[0], lo[1], lo[2]), Position(hi[0], hi[1], hi[2]));
+}
+
+// Map coefficients from numpy arrays, with the interface of the data
+// proxies used in fourier.hpp (columns: h, k, l, F, phi).
+struct ArrayFPhiProxy
+{
+	UnitCell cell;
+	const SpaceGroup* sg;
+	std::vector<double> v;
+
+	ArrayFPhiProxy(py::array_t<int> hkl, py::array_t<double> f,
+		py::array_t<double> phi, const UnitCell& cell_, const SpaceGroup* sg_)
+		: cell(cell_), sg(sg_)
+	{
+		auto h = hkl.unchecked<2>();
+		auto rf = f.unchecked<1>();
+		auto rp = phi.unchecked<1>();
+		if (h.shape(1) != 3 || rf.shape(0) != h.shape(0) || rp.shape(0) != h.shape(0))
+			throw std::invalid_argument("expected hkl (N, 3), f (N) and phi (N)");
+		v.reserve(5 * h.shape(0));
+		for (ssize_t i = 0; i < h.shape(0); i++)
+			v.insert(v.end(), { (double) h(i, 0), (double) h(i, 1),
+				(double) h(i, 2), rf(i), rp(i) });
+	}
+	bool ok() const { return true; }
+	size_t stride() const { return 5; }
+	size_t size() const { return v.size(); }
+	const SpaceGroup* spacegroup() const { return sg; }
+	const UnitCell& unit_cell() const { return cell; }
+	std::array<size_t, 3> hkl_col() const { return {{ 0, 1, 2 }}; }
+	int get_int(size_t n) const { return (int) v[n]; }
+	double get_num(size_t n) const { return v[n]; }
+	Miller get_hkl(size_t n, const std::array<size_t, 3>& c) const
+	{
+		return {{ get_int(n + c[0]), get_int(n + c[1]), get_int(n + c[2]) }};
+	}
+};
+
+// Map being written in the background by write_ccp4_map_async().
+struct MapWriteFuture
+{
+	std::shared_future<void> future;
+
+	bool done() const
+	{
+		return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+	}
+	// re-throws an exception from the writing thread
+	void wait() const { future.get(); }
+};
+
+template<typename T>
+void add_morphology(py::module& m)
+{
+	m.def("distance_transform",
+		[](const Grid<T>& mask, int nthreads, double max_distance)
+		{
+			return distance_transform(mask, nthreads, max_distance);
+		},
+		py::arg("mask"), py::arg("nthreads") = 0,
+		py::arg("max_distance") = INFINITY,
+		py::call_guard<py::gil_scoped_release>(),
+		"Distance (A) from each point to the nearest non-zero point;\n"
+		"distances >= max_distance may be returned as inf"
+			);
+	m.def("dilate_mask", &dilate_mask<T>,
+		py::arg("mask"), py::arg("radius"), py::arg("nthreads") = 0,
+		py::call_guard<py::gil_scoped_release>());
+	m.def("erode_mask", &erode_mask<T>,
+		py::arg("mask"), py::arg("radius"), py::arg("nthreads") = 0,
+		py::call_guard<py::gil_scoped_release>());
+	m.def("open_mask", &open_mask<T>,
+		py::arg("mask"), py::arg("radius"), py::arg("nthreads") = 0,
+		py::call_guard<py::gil_scoped_release>());
+	m.def("close_mask", &close_mask<T>,
+		py::arg("mask"), py::arg("radius"), py::arg("nthreads") = 0,
+		py::call_guard<py::gil_scoped_release>());
+}
+
+
+void add_grid_tools(py::module& m) {
+
+	m.def("set_default_thread_count", &set_default_thread_count,
+		py::arg("n"),
+		"Set thread count used when nthreads=0 (0: all hardware threads)"
+			);
+	m.def("get_default_thread_count", &get_default_thread_count);
+
+	add_morphology<float>(m);
+	add_morphology<int8_t>(m);
+
+	py::class_<Blob>(m, "Blob")
+		.def_readonly("label", &Blob::label)
+		.def_readonly("point_count", &Blob::point_count)
+		.def_readonly("volume", &Blob::volume)
+		.def_readonly("sum", &Blob::sum)
+		.def_readonly("peak_value", &Blob::peak_value)
+		.def_readonly("peak_pos", &Blob::peak_pos)
+		.def_readonly("centroid", &Blob::centroid)
+		.def_readonly("box_min", &Blob::box_min)
+		.def_readonly("box_max", &Blob::box_max)
+		.def("__repr__", [](const Blob& self)
+			{
+				return "<gemmi_tools.Blob " + std::to_string(self.label) + " with "
+					+ std::to_string(self.point_count) + " points>";
+			});
+
+	m.def("find_blobs",
+		[](const Grid<float>& grid, double threshold, bool use_symmetry,
+			int nthreads)
+		{
+			return find_blobs(grid, threshold, use_symmetry, nthreads);
+		},
+		py::arg("grid"), py::arg("threshold"), py::arg("use_symmetry") = true,
+		py::arg("nthreads") = 0,
+		py::call_guard<py::gil_scoped_release>(),
+		"Find connected regions of points above threshold"
+			);
+
+	m.def("label_blobs",
+		[](const Grid<float>& grid, double threshold, bool use_symmetry,
+			int nthreads)
+		{
+			Grid<int> labels;
+			std::vector<Blob> blobs;
+			{
+				py::gil_scoped_release release;
+				blobs = find_blobs(grid, threshold, labels, use_symmetry, nthreads);
+			}
+			// the grid index order is the F-order of the array
+			py::array_t<int> arr({ grid.nu, grid.nv, grid.nw },
+				{ sizeof(int), sizeof(int) * grid.nu,
+				  sizeof(int) * grid.nu * grid.nv });
+			std::copy(labels.data.begin(), labels.data.end(), arr.mutable_data());
+			return py::make_tuple(blobs, arr);
+		},
+		py::arg("grid"), py::arg("threshold"), py::arg("use_symmetry") = true,
+		py::arg("nthreads") = 0,
+		"Find blobs; returns (blobs, labels array with -1 below threshold)"
+			);
+
+	py::class_<GridView<float>>(m, "GridView")
+		.def_readonly("unit_cell", &GridView<float>::unit_cell)
+		.def_readonly("spacegroup", &GridView<float>::spacegroup)
+		.def_readonly("read_only", &GridView<float>::read_only)
+		.def_property_readonly("shape", [](const GridView<float>& self)
+			{
+				return py::make_tuple(self.nu, self.nv, self.nw);
+			})
+		.def_property_readonly("is_owned", [](const GridView<float>& self)
+			{
+				return self.data.is_owned();
+			})
+		// F-ordered array that shares memory with (and keeps alive) the view
+		.def_property_readonly("array", [](py::object self)
+			{
+				GridView<float>& view = self.cast<GridView<float>&>();
+				py::array_t<float> arr({ view.nu, view.nv, view.nw },
+					{ sizeof(float), sizeof(float) * view.nu,
+					  sizeof(float) * view.nu * view.nv },
+					view.data.data(), self);
+				if (view.read_only)
+					arr.attr("setflags")(py::arg("write") = false);
+				return arr;
+			})
+		.def("to_grid", &GridView<float>::to_grid,
+			py::call_guard<py::gil_scoped_release>(),
+			"Copy the values to a new Grid"
+			);
+
+	m.def("grid_view_of_array", &grid_view_of_array,
+		py::arg("array").noconvert(), py::arg("cell"), py::arg("spacegroup"),
+		"Make a view that shares memory with a float32 F-ordered numpy array"
+			);
+
+	m.def("map_grid_file",
+		[](const std::string& path, size_t offset, std::array<int, 3> size,
+			const UnitCell& cell, const SpaceGroup* sg, bool copy_on_write)
+		{
+			GridView<float> view;
+			view.unit_cell = cell;
+			view.spacegroup = sg;
+			view.nu = size[0];
+			view.nv = size[1];
+			view.nw = size[2];
+			view.axis_order = AxisOrder::XYZ;
+			map_grid_data(view, path, offset,
+				copy_on_write ? MapAccess::CopyOnWrite : MapAccess::ReadOnly);
+			return view;
+		},
+		py::arg("path"), py::arg("offset"), py::arg("size"), py::arg("cell"),
+		py::arg("spacegroup"), py::arg("copy_on_write") = true,
+		py::call_guard<py::gil_scoped_release>(),
+		"Make a view of float32 values memory-mapped from a file"
+			);
+
+	m.def("map_ccp4_file",
+		[](const std::string& path, bool copy_on_write, float default_value,
+			int nthreads)
+		{
+			Ccp4<float> ccp4;
+			return ccp4.map_ccp4_file(path,
+				copy_on_write ? MapAccess::CopyOnWrite : MapAccess::ReadOnly,
+				default_value, nthreads);
+		},
+		py::arg("path"), py::arg("copy_on_write") = true,
+		py::arg("default_value") = NAN, py::arg("nthreads") = 0,
+		py::call_guard<py::gil_scoped_release>(),
+		"Read a CCP4 map into a view of the whole cell in XYZ order;"
+		" mode 2 XYZ maps of the whole cell in native byte order are"
+		" memory-mapped, other maps are read and set up"
+			);
+
+	m.def("read_ccp4_region",
+		[](const std::string& path, std::array<double, 3> lo,
+			std::array<double, 3> hi, bool fractional)
+		{
+			Ccp4<float> ccp4;
+			if (iends_with(path, ".gz"))
+			{
+				// seeks using an index of the gz file, cached as file.gzidx
+				GzIndex index = get_gz_index(path);
+				GzIndexedStream stream(index);
+				read_ccp4_region_from(stream, path, lo, hi, fractional, ccp4);
+			}
+			else
+			{
+				fileptr_t f = file_open(path.c_str(), "rb");
+				FileStream stream{f.get()};
+				read_ccp4_region_from(stream, path, lo, hi, fractional, ccp4);
+			}
+			ccp4.setup(GridSetup::ReorderOnly, NAN);
+			std::array<int, 3> start = {{ccp4.header_i32(5), ccp4.header_i32(6),
+				ccp4.header_i32(7)}};
+			return std::make_pair(ccp4.grid, start);
+		},
+		py::arg("path"), py::arg("lo"), py::arg("hi"),
+		py::arg("fractional") = false,
+		py::call_guard<py::gil_scoped_release>(),
+		"Read only the part of CCP4 map (can be gzipped) that covers the box "
+		"[lo, hi]; returns (grid, start) where start is the grid point of "
+		"the box origin"
+			);
+
+	py::class_<MapWriteFuture>(m, "MapWriteFuture")
+		.def("done", &MapWriteFuture::done)
+		.def("wait", &MapWriteFuture::wait,
+			py::call_guard<py::gil_scoped_release>());
+	m.def("write_ccp4_map_async",
+		[](const Grid<float>& grid, const std::string& path, int mode,
+			bool quantize, double sigma_range, int nthreads, size_t queue_size)
+		{
+			// a copy, so that the grid can be modified while it is written
+			std::shared_ptr<Ccp4<float>> ccp4(new Ccp4<float>());
+			ccp4->grid.unit_cell = grid.unit_cell;
+			ccp4->grid.spacegroup = grid.spacegroup;
+			ccp4->grid.nu = grid.nu, ccp4->grid.nv = grid.nv, ccp4->grid.nw = grid.nw;
+			ccp4->grid.axis_order = grid.axis_order;
+			ccp4->grid.data = std::vector<float>(grid.data.begin(), grid.data.end());
+			if (quantize)
+				ccp4->set_quantization_from_stats(mode, sigma_range);
+			ccp4->update_ccp4_header(mode, true);
+			return MapWriteFuture{write_ccp4_map_async<float>(ccp4, path,
+				nthreads, queue_size).share()};
+		},
+		py::arg("grid"), py::arg("path"), py::arg("mode") = 2,
+		py::arg("quantize") = false, py::arg("sigma_range") = 0.,
+		py::arg("nthreads") = 0, py::arg("queue_size") = 8,
+		py::call_guard<py::gil_scoped_release>(),
+		"Start writing grid as CCP4 map (gzipped if path ends with .gz)"
+		" in the background; returns MapWriteFuture. With quantize, mode 0"
+		" or 1 stores the range mean +/- sigma_range * rms (or min-max if"
+		" sigma_range is 0) with scale and offset in a header label"
+			);
+
+	py::enum_<ScannedFileKind>(m, "ScannedFileKind")
+		.value("Map", ScannedFileKind::Map)
+		.value("Mtz", ScannedFileKind::Mtz);
+	py::class_<ScannedFile>(m, "ScannedFile")
+		.def_readonly("path", &ScannedFile::path)
+		.def_readonly("kind", &ScannedFile::kind)
+		.def_readonly("file_size", &ScannedFile::file_size)
+		.def_readonly("mtime", &ScannedFile::mtime)
+		.def_readonly("error", &ScannedFile::error)
+		.def_readonly("cell", &ScannedFile::cell)
+		.def_readonly("spacegroup_number", &ScannedFile::spacegroup_number)
+		.def_readonly("spacegroup_hm", &ScannedFile::spacegroup_hm)
+		.def_readonly("mode", &ScannedFile::mode)
+		.def_readonly("grid_size", &ScannedFile::grid_size)
+		.def_readonly("map_size", &ScannedFile::map_size)
+		.def_readonly("map_start", &ScannedFile::map_start)
+		.def_property_readonly("dmin", [](const ScannedFile& sf) { return sf.stats.dmin; })
+		.def_property_readonly("dmax", [](const ScannedFile& sf) { return sf.stats.dmax; })
+		.def_property_readonly("dmean", [](const ScannedFile& sf) { return sf.stats.dmean; })
+		.def_property_readonly("rms", [](const ScannedFile& sf) { return sf.stats.rms; })
+		.def_readonly("nreflections", &ScannedFile::nreflections)
+		.def_readonly("resolution_high", &ScannedFile::resolution_high)
+		.def_readonly("resolution_low", &ScannedFile::resolution_low)
+		.def_readonly("column_labels", &ScannedFile::column_labels)
+		.def_readonly("column_types", &ScannedFile::column_types)
+		.def("__repr__", [](const ScannedFile& sf)
+		{
+			return "<ScannedFile " + sf.path + ">";
+		});
+	m.def("scan_file_headers",
+		[](const std::string& top_dir, int nthreads)
+		{
+			return scan_file_headers(top_dir, nthreads);
+		},
+		py::arg("top_dir"), py::arg("nthreads") = 0,
+		py::call_guard<py::gil_scoped_release>(),
+		"Read headers of all maps and MTZ files (optionally gzipped) in the"
+		" directory tree"
+			);
+	m.def("read_header_index", &read_header_index, py::arg("path"),
+		py::call_guard<py::gil_scoped_release>()
+			);
+	m.def("update_header_index", &update_header_index,
+		py::arg("index_path"), py::arg("top_dir"), py::arg("nthreads") = 0,
+		py::call_guard<py::gil_scoped_release>(),
+		"Scan the directory tree re-reading only files that changed since"
+		" the index was written; write the index and return its entries"
+			);
+
+	m.def("write_tiled_map", &write_tiled_map<float>,
+		py::arg("grid"), py::arg("path"), py::arg("quant_bits") = 0,
+		py::arg("level") = 6, py::arg("nthreads") = 0, py::arg("tile_size") = 64,
+		py::call_guard<py::gil_scoped_release>(),
+		"Write grid as tiles compressed independently; quant_bits 8 or 16"
+		" makes it lossy"
+			);
+	m.def("read_tiled_map", &read_tiled_map<float>,
+		py::arg("path"), py::arg("nthreads") = 0,
+		py::call_guard<py::gil_scoped_release>()
+			);
+	m.def("read_tiled_map_box",
+		[](const std::string& path, std::array<int, 3> start,
+			std::array<int, 3> size, int nthreads)
+		{
+			std::vector<float> values;
+			{
+				py::gil_scoped_release release;
+				TiledMapHeader header = read_tiled_map_header(path);
+				values = read_tiled_map_box(path, header, start, size, nthreads);
+			}
+			py::array_t<float> arr({ size[0], size[1], size[2] },
+				{ sizeof(float), sizeof(float) * size[0],
+				  sizeof(float) * size[0] * size[1] });
+			std::copy(values.begin(), values.end(), arr.mutable_data());
+			return arr;
+		},
+		py::arg("path"), py::arg("start"), py::arg("size"),
+		py::arg("nthreads") = 0,
+		"Read a box of grid points (wrapped periodically) from tiled map,"
+		" decompressing only the tiles that intersect it"
+			);
+
+	m.def("mask_atoms",
+		[](Grid<float>& grid, py::array_t<double> positions,
+			std::vector<double> radii, float value, int nthreads)
+		{
+			std::vector<Position> pos = positions_from_array(positions);
+			py::gil_scoped_release release;
+			mask_atoms(grid, pos, radii, value, nthreads);
+		},
+		py::arg("grid"), py::arg("positions"), py::arg("radii"),
+		py::arg("value") = 1.f, py::arg("nthreads") = 0,
+		"Set grid points within radii of Cartesian positions (N, 3) to value"
+			);
+
+	py::enum_<WindowShape>(m, "WindowShape")
+		.value("Sphere", WindowShape::Sphere)
+		.value("Gaussian", WindowShape::Gaussian);
+
+	m.def("local_correlation", &local_correlation<float>,
+		py::arg("a"), py::arg("b"), py::arg("radius"),
+		py::arg("shape") = WindowShape::Sphere, py::arg("nthreads") = 0,
+		py::call_guard<py::gil_scoped_release>(),
+		"Correlation of two maps in a sliding window (RSCC map), by FFT"
+			);
+
+	m.def("resample",
+		[](const Grid<float>& src, Grid<float>& dst, int nthreads)
+		{
+			resample(src, dst, Transform(), nthreads);
+		},
+		py::arg("src"), py::arg("dst"), py::arg("nthreads") = 0,
+		py::call_guard<py::gil_scoped_release>(),
+		"Interpolate src onto dst (unit cell and size of dst must be set)"
+			);
+
+	m.def("resample",
+		[](const Grid<float>& src, Grid<float>& dst, const Transform& transform,
+			int nthreads)
+		{
+			resample(src, dst, transform, nthreads);
+		},
+		py::arg("src"), py::arg("dst"), py::arg("transform"),
+		py::arg("nthreads") = 0,
+		py::call_guard<py::gil_scoped_release>(),
+		"Interpolate src onto dst; transform maps dst positions to src positions"
+			);
+
+	py::enum_<FftPrecision>(m, "FftPrecision")
+		.value("Native", FftPrecision::Native)
+		.value("Double", FftPrecision::Double);
+
+	m.def("resample_fourier",
+		[](const Grid<float>& src, std::array<int, 3> size, int nthreads,
+			FftPrecision precision)
+		{
+			return resample_fourier(src, size, nthreads, precision);
+		},
+		py::arg("src"), py::arg("size"), py::arg("nthreads") = 0,
+		py::arg("precision") = FftPrecision::Native,
+		py::call_guard<py::gil_scoped_release>(),
+		"Band-limited resampling onto a grid of another size in the same cell"
+			);
+
+	py::class_<Peak>(m, "Peak")
+		.def_readonly("value", &Peak::value)
+		.def_readonly("pos", &Peak::pos)
+		.def_readonly("u", &Peak::u)
+		.def_readonly("v", &Peak::v)
+		.def_readonly("w", &Peak::w)
+		.def("__repr__", [](const Peak& self)
+			{
+				return "<gemmi_tools.Peak " + std::to_string(self.value) + " at ("
+					+ std::to_string(self.u) + ", " + std::to_string(self.v) + ", "
+					+ std::to_string(self.w) + ")>";
+			});
+
+	m.def("find_peaks", &find_peaks<Grid<float>>,
+		py::arg("grid"), py::arg("threshold"), py::arg("max_count") = 0,
+		py::arg("merge_distance") = 0., py::arg("nthreads") = 0,
+		py::call_guard<py::gil_scoped_release>(),
+		"Find local maxima above threshold, the highest first"
+			);
+	// the same for a GridView (e.g. a memory-mapped map), without copying
+	m.def("find_peaks", &find_peaks<GridView<float>>,
+		py::arg("grid"), py::arg("threshold"), py::arg("max_count") = 0,
+		py::arg("merge_distance") = 0., py::arg("nthreads") = 0,
+		py::call_guard<py::gil_scoped_release>(),
+		"Find local maxima above threshold, the highest first"
+			);
+
+	py::enum_<FrameMethod>(m, "FrameMethod")
+		.value("Auto", FrameMethod::Auto)
+		.value("Direct", FrameMethod::Direct)
+		.value("Fft", FrameMethod::Fft);
+
+	m.def("sample_f_phi_on_frame",
+		[](py::array_t<int> hkl, py::array_t<double> f, py::array_t<double> phi,
+			const UnitCell& cell, const SpaceGroup* sg, const Transform& frame,
+			std::array<int, 3> size, FrameMethod method, double sample_rate,
+			int nthreads)
+		{
+			ArrayFPhiProxy data(hkl, f, phi, cell, sg);
+			std::vector<float> values;
+			{
+				py::gil_scoped_release release;
+				values = sample_f_phi_on_frame<float>(data, 3, 4, frame, size,
+					method, sample_rate, nthreads);
+			}
+			// i changes fastest, i.e. F-order array (size[0], size[1], size[2])
+			py::array_t<float> arr({ size[0], size[1], size[2] },
+				{ sizeof(float), sizeof(float) * size[0],
+				  sizeof(float) * size[0] * size[1] });
+			std::copy(values.begin(), values.end(), arr.mutable_data());
+			return arr;
+		},
+		py::arg("hkl"), py::arg("f"), py::arg("phi"), py::arg("cell"),
+		py::arg("spacegroup"), py::arg("frame"), py::arg("size"),
+		py::arg("method") = FrameMethod::Auto, py::arg("sample_rate") = 3.,
+		py::arg("nthreads") = 0,
+		"Density from map coefficients (phi in degrees) at points"
+		" frame.apply((i, j, k)) of a box"
+			);
+
+	m.def("transform_f_phi_to_maps",
+		[](py::array_t<int> hkl, std::vector<py::array_t<double>> f,
+			std::vector<py::array_t<double>> phi, const UnitCell& cell,
+			const SpaceGroup* sg, std::array<int, 3> size, double sample_rate,
+			int nthreads)
+		{
+			if (f.empty() || f.size() != phi.size())
+				throw std::invalid_argument("expected the same number of F and phi arrays");
+			std::vector<ArrayFPhiProxy> data;
+			for (size_t i = 0; i != f.size(); ++i)
+				data.emplace_back(hkl, f[i], phi[i], cell, sg);
+			py::gil_scoped_release release;
+			size = get_size_for_hkl(data[0], size, sample_rate);
+			// the reflections are the same, so is the symmetry expansion
+			HklExpansion<float> expansion;
+			expansion.build(data[0], size, true, AxisOrder::XYZ, nthreads);
+			std::vector<FPhiGrid<float>> grids(data.size());
+			for (size_t i = 0; i != data.size(); ++i)
+				expansion.fill_f_phi(grids[i], data[i], 3, 4, nthreads);
+			return transform_f_phi_grids_to_maps(std::move(grids), nthreads);
+		},
+		py::arg("hkl"), py::arg("f"), py::arg("phi"), py::arg("cell"),
+		py::arg("spacegroup"), py::arg("size") = std::array<int, 3>{{0, 0, 0}},
+		py::arg("sample_rate") = 3., py::arg("nthreads") = 0,
+		"Maps from lists of F and phi (degrees) for the same reflections,"
+		" transformed in one batch"
+			);
+
+	m.def("transform_map_to_f_phi_asu",
+		[](const Grid<float>& map, double dmin, int nthreads)
+		{
+			AsuFPhiData<float> data;
+			{
+				py::gil_scoped_release release;
+				data = transform_map_to_f_phi_asu(map, dmin, nthreads);
+			}
+			py::array_t<int> hkl({ data.hkl.size(), (size_t) 3 });
+			int* out = hkl.mutable_data();
+			for (const Miller& m : data.hkl)
+				out = std::copy(m.begin(), m.end(), out);
+			return py::make_tuple(hkl, py::array_t<float>(data.f.size(), data.f.data()),
+				py::array_t<float>(data.phi.size(), data.phi.data()));
+		},
+		py::arg("map"), py::arg("dmin"), py::arg("nthreads") = 0,
+		"Structure factors of the map to dmin, only ASU; returns (hkl, F, phi)"
+			);
+
+}
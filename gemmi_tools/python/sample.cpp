@@ -10,6 +10,8 @@
 namespace py = pybind11;
 using namespace gemmi;
 
+void add_grid_tools(py::module& m);
+
 
 template<typename T>
 std::map<std::vector<int>, gemmi::Position> 
@@ -185,6 +187,7 @@ PYBIND11_MODULE(gemmi_tools_python, mg) {
 	mg.doc() = "General MacroMolecular I/O";
 	mg.attr("__version__") = "N/A";
 	add_sample(mg);
+	add_grid_tools(mg);
 	
 }
 
@@ -0,0 +1,60 @@
+// Minimal checking helpers for the C++ tests (no test framework is
+// vendored). Each test is a small program that returns non-zero when
+// any check fails; ctest runs them.
+
+#ifndef GEMMI_TOOLS_TESTS_CHECK_HPP_
+#define GEMMI_TOOLS_TESTS_CHECK_HPP_
+
+#include <cmath>    // for fabs
+#include <cstdio>   // for fprintf
+#include <exception>
+#include <string>
+
+namespace check {
+
+inline int& failures() { static int n = 0; return n; }
+
+inline void report(const char* file, int line, const std::string& msg) {
+  std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, msg.c_str());
+  ++failures();
+}
+
+inline int result(const char* name) {
+  if (failures() == 0)
+    std::printf("%s: OK\n", name);
+  else
+    std::printf("%s: %d check(s) failed\n", name, failures());
+  return failures() == 0 ? 0 : 1;
+}
+
+} // namespace check
+
+#define CHECK(cond) \
+  do { if (!(cond)) check::report(__FILE__, __LINE__, #cond); } while (0)
+
+#define CHECK_NEAR(a, b, eps) \
+  do { \
+    double a_ = (a), b_ = (b); \
+    if (!(std::fabs(a_ - b_) <= (eps))) \
+      check::report(__FILE__, __LINE__, #a " = " + std::to_string(a_) + \
+                    " != " #b " = " + std::to_string(b_)); \
+  } while (0)
+
+// Checks that the expression throws std::exception (e.g. from fail()).
+#define CHECK_THROWS(expr) \
+  do { \
+    bool thrown_ = false; \
+    try { expr; } catch (std::exception&) { thrown_ = true; } \
+    if (!thrown_) check::report(__FILE__, __LINE__, #expr " did not throw"); \
+  } while (0)
+
+// Runs a test function, counting an unexpected exception as a failure.
+#define RUN_TEST(func) \
+  do { \
+    try { func(); } catch (std::exception& e) { \
+      check::report(__FILE__, __LINE__, \
+                    std::string(#func " threw: ") + e.what()); \
+    } \
+  } while (0)
+
+#endif
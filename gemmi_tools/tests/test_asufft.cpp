@@ -0,0 +1,73 @@
+// Tests of transform_f_phi_grid_to_asu_map() against the full-cell FFT.
+
+#include <random>
+#include <gemmi/asufft.hpp>
+#include <gemmi/symmetry.hpp>  // for find_spacegroup_by_name
+#include "check.hpp"
+
+using namespace gemmi;
+
+static Grid<float> random_symmetric_map(const char* hm, int nu, int nv,
+                                        int nw, unsigned seed) {
+  Grid<float> grid;
+  grid.spacegroup = find_spacegroup_by_name(hm);
+  grid.set_unit_cell(20, 20, 24, 90, 90, 90);
+  grid.set_size(nu, nv, nw);
+  std::mt19937 rng(seed);
+  std::normal_distribution<float> normal;
+  for (float& x : grid.data)
+    x = normal(rng);
+  grid.symmetrize_max();
+  return grid;
+}
+
+static void test_against_full_fft() {
+  struct Case { const char* hm; int n[3]; double fraction; };
+  const Case cases[] = {
+    {"P 1", {12, 12, 16}, 1.},
+    {"P 1 21 1", {12, 12, 16}, 0.5},
+    {"P 21 21 21", {12, 12, 16}, 0.5},
+    {"C 1 2 1", {12, 16, 12}, 0.25},
+    {"P 4 21 2", {16, 16, 12}, 0.25},
+  };
+  for (const Case& c : cases) {
+    Grid<float> map = random_symmetric_map(c.hm, c.n[0], c.n[1], c.n[2], 1);
+    FPhiGrid<float> hkl = transform_map_to_f_phi(map, true);
+    Grid<float> full = transform_f_phi_grid_to_map(FPhiGrid<float>(hkl));
+    SlabMap<float> slab = transform_f_phi_grid_to_asu_map(std::move(hkl), 2);
+    CHECK(slab.nu == map.nu && slab.nv == map.nv && slab.nw == map.nw);
+    CHECK(slab.axis == 0 || slab.axis == 1);
+    // slab can be one section thicker than the fraction of the cell
+    int n_axis = slab.axis == 0 ? slab.nu : slab.nv;
+    CHECK(slab.length <= c.fraction * n_axis + 1);
+    std::array<int, 3> size = slab.stored_size();
+    CHECK(slab.data.size() == (size_t) size[0] * size[1] * size[2]);
+    double max_diff = 0;
+    for (int w = 0; w != map.nw; ++w)
+      for (int v = 0; v != map.nv; ++v)
+        for (int u = 0; u != map.nu; ++u)
+          max_diff = std::max(max_diff, (double) std::fabs(
+                slab.get_value(u, v, w) - full.get_value_q(u, v, w)));
+    CHECK_NEAR(max_diff, 0., 1e-4);
+    Grid<float> expanded = slab.expand(2);
+    max_diff = 0;
+    for (size_t i = 0; i != map.data.size(); ++i)
+      max_diff = std::max(max_diff,
+                          (double) std::fabs(expanded.data[i] - map.data[i]));
+    CHECK_NEAR(max_diff, 0., 1e-4);
+    CHECK_NEAR(slab.get_value(-1, 2 * map.nv + 1, 5),
+               map.get_value(-1, 1, 5), 1e-4);
+  }
+}
+
+static void test_errors() {
+  Grid<float> map = random_symmetric_map("P 1", 8, 8, 8, 2);
+  CHECK_THROWS(transform_f_phi_grid_to_asu_map(
+                 transform_map_to_f_phi(map, false)));
+}
+
+int main() {
+  RUN_TEST(test_against_full_fft);
+  RUN_TEST(test_errors);
+  return check::result("asufft");
+}
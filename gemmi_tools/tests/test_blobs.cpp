@@ -0,0 +1,135 @@
+// Tests of find_blobs().
+
+#include <random>
+#include <gemmi/blobs.hpp>
+#include <gemmi/symmetry.hpp>  // for find_spacegroup_by_name
+#include "check.hpp"
+
+using namespace gemmi;
+
+static Grid<float> make_grid(const char* sg, int nu, int nv, int nw) {
+  Grid<float> grid;
+  grid.spacegroup = find_spacegroup_by_name(sg);
+  grid.set_unit_cell(20, 21, 22, 90, 90, 90);
+  grid.set_size(nu, nv, nw);
+  return grid;
+}
+
+// Labels must be constant within and different between 6-connected
+// (periodic) regions above the threshold; checked by flood fill.
+static void test_random_labels() {
+  Grid<float> grid = make_grid("P 1", 16, 18, 20);
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<float> uni(0.f, 1.f);
+  for (float& x : grid.data)
+    x = uni(rng);
+  Grid<int> labels;
+  std::vector<Blob> blobs = find_blobs(grid, 0.6, labels, false, 3);
+  Grid<int> ref = labels;
+  ref.fill(-1);
+  int n_ref = 0;
+  size_t max_point_count = 0;
+  for (int start = 0; start != (int) grid.data.size(); ++start) {
+    if (!(grid.data[start] > 0.6f) || ref.data[start] >= 0)
+      continue;
+    std::vector<int> queue(1, start);
+    ref.data[start] = n_ref;
+    for (size_t q = 0; q != queue.size(); ++q) {
+      int idx = queue[q];
+      int u = idx % grid.nu, v = idx / grid.nu % grid.nv;
+      int w = idx / (grid.nu * grid.nv);
+      int nb[6] = {grid.index_s(u+1, v, w), grid.index_s(u-1, v, w),
+                   grid.index_s(u, v+1, w), grid.index_s(u, v-1, w),
+                   grid.index_s(u, v, w+1), grid.index_s(u, v, w-1)};
+      for (int t : nb)
+        if (grid.data[t] > 0.6f && ref.data[t] < 0) {
+          ref.data[t] = n_ref;
+          queue.push_back(t);
+        }
+    }
+    max_point_count = std::max(max_point_count, queue.size());
+    ++n_ref;
+  }
+  CHECK((int) blobs.size() == n_ref);
+  // the mapping between labels must be one-to-one
+  std::vector<int> map(n_ref, -1);
+  int bad = 0;
+  for (size_t i = 0; i != grid.data.size(); ++i) {
+    if ((ref.data[i] < 0) != (labels.data[i] < 0)) {
+      ++bad;
+    } else if (ref.data[i] >= 0) {
+      int& m = map[ref.data[i]];
+      if (m == -1)
+        m = labels.data[i];
+      else if (m != labels.data[i])
+        ++bad;
+    }
+  }
+  CHECK(bad == 0);
+  size_t total = 0, max_found = 0;
+  for (const Blob& b : blobs) {
+    total += b.point_count;
+    max_found = std::max(max_found, b.point_count);
+  }
+  size_t above = 0;
+  for (float x : grid.data)
+    above += x > 0.6f;
+  CHECK(total == above);
+  CHECK(max_found == max_point_count);
+}
+
+// A blob longer than half the cell that crosses the cell boundary.
+// The point with the smallest index is at one end of the blob, so
+// unwrapping relative to that point would fold the blob.
+static void test_long_blob() {
+  Grid<float> grid = make_grid("P 1", 20, 20, 20);
+  grid.fill(0.f);
+  // rod from u=12 to u=27 (wrapped to 7), 16 points, at v=3, w=4
+  for (int u = 12; u != 28; ++u)
+    grid.set_value(u, 3, 4, 1.f + u);
+  grid.set_value(12, 3, 3, 1.f);
+  for (int nthreads : {1, 3}) {
+    std::vector<Blob> blobs = find_blobs(grid, 0.5, false, nthreads);
+    CHECK(blobs.size() == 1);
+    if (blobs.size() != 1)
+      continue;
+    const Blob& b = blobs[0];
+    CHECK(b.point_count == 17);
+    CHECK(b.box_max[0] - b.box_min[0] == 15);
+    CHECK(modulo(b.box_min[0], 20) == 12);
+    CHECK(b.box_min[1] == 3 && b.box_max[1] == 3);
+    CHECK(b.box_max[2] - b.box_min[2] == 1);
+    double expected_u = (16 * 19.5 + 12) / 17;
+    Fractional c = grid.unit_cell.fractionalize(b.centroid);
+    CHECK_NEAR(c.x - std::floor(c.x), expected_u / 20, 1e-9);
+    CHECK_NEAR(c.y, 3. / 20, 1e-9);
+    Fractional p = grid.unit_cell.fractionalize(b.peak_pos);
+    CHECK_NEAR(p.x - std::floor(p.x), 7. / 20, 1e-9);
+    CHECK_NEAR(b.peak_value, 28., 1e-9);
+  }
+}
+
+// Two symmetry mates in P 2 give one blob.
+static void test_symmetry() {
+  Grid<float> grid = make_grid("P 1 2 1", 16, 16, 16);
+  grid.fill(0.f);
+  for (int u = 2; u != 5; ++u)
+    grid.set_value(u, 3, 5, 1.f);
+  grid.symmetrize_max();
+  Grid<int> labels;
+  CHECK(find_blobs(grid, 0.5, labels, false).size() == 2);
+  std::vector<Blob> blobs = find_blobs(grid, 0.5, labels, true);
+  CHECK(blobs.size() == 1);
+  if (!blobs.empty())
+    CHECK(blobs[0].point_count == 3);
+  CHECK(labels.get_value(3, 3, 5) == 0);
+  CHECK(labels.get_value(-3, 3, -5) == 0);
+  CHECK(labels.get_value(0, 0, 0) == -1);
+}
+
+int main() {
+  RUN_TEST(test_random_labels);
+  RUN_TEST(test_long_blob);
+  RUN_TEST(test_symmetry);
+  return check::result("blobs");
+}
@@ -0,0 +1,547 @@
+// Tests of reading and writing CCP4 maps (ccp4.hpp).
+
+#include <algorithm>  // for equal
+#include <cstdio>   // for remove
+#include <random>
+#include <gemmi/ccp4.hpp>
+#include <gemmi/gz.hpp>        // for MaybeGzipped
+#include <gemmi/symmetry.hpp>  // for find_spacegroup_by_name
+#include "check.hpp"
+
+using namespace gemmi;
+
+// map of the whole cell, in XYZ order, with random values
+static Ccp4<float> random_map(const char* hm, int nu, int nv, int nw,
+                              unsigned seed) {
+  Ccp4<float> map;
+  map.grid.spacegroup = find_spacegroup_by_name(hm);
+  map.grid.set_unit_cell(20, 22, 24, 90, 100, 90);
+  map.grid.set_size(nu, nv, nw);
+  std::mt19937 rng(seed);
+  std::normal_distribution<float> normal;
+  for (float& x : map.grid.data)
+    x = normal(rng);
+  map.update_ccp4_header(2, true);
+  return map;
+}
+
+static Ccp4<float> read_file(const char* path) {
+  Ccp4<float> map;
+  map.read_ccp4_file(path);
+  return map;
+}
+
+static std::vector<char> read_bytes(const char* path) {
+  std::vector<char> bytes;
+  FILE* f = std::fopen(path, "rb");
+  char buf[4096];
+  size_t n;
+  while (f && (n = std::fread(buf, 1, sizeof buf, f)) != 0)
+    bytes.insert(bytes.end(), buf, buf + n);
+  if (f)
+    std::fclose(f);
+  return bytes;
+}
+
+static void write_bytes(const char* path, const std::vector<char>& bytes) {
+  FILE* f = std::fopen(path, "wb");
+  std::fwrite(bytes.data(), 1, bytes.size(), f);
+  std::fclose(f);
+}
+
+// the same map stored with sections along x and columns along z
+static Ccp4<float> zyx_copy(const Ccp4<float>& xyz) {
+  Ccp4<float> zyx;
+  zyx.grid.spacegroup = xyz.grid.spacegroup;
+  zyx.grid.set_unit_cell(xyz.grid.unit_cell);
+  zyx.grid.nu = xyz.grid.nw;
+  zyx.grid.nv = xyz.grid.nv;
+  zyx.grid.nw = xyz.grid.nu;
+  zyx.grid.axis_order = AxisOrder::ZYX;
+  zyx.grid.data.resize(xyz.grid.data.size());
+  for (int x = 0; x != xyz.grid.nu; ++x)
+    for (int y = 0; y != xyz.grid.nv; ++y)
+      for (int z = 0; z != xyz.grid.nw; ++z)
+        zyx.grid.data[zyx.grid.index_q(z, y, x)] = xyz.grid.get_value_q(x, y, z);
+  zyx.update_ccp4_header(2, true);
+  return zyx;
+}
+
+static void test_map_ccp4_file() {
+  const char* path = "test_ccp4_map.tmp";
+  Ccp4<float> map = random_map("P 1 21 1", 6, 8, 10, 1);
+  map.write_ccp4_map(path);
+  {
+    Ccp4<float> mapped;
+    GridView<float> view = mapped.map_ccp4_file(path);
+    CHECK(view.read_only);
+    CHECK(!view.data.is_owned());
+    CHECK(mapped.grid.data.empty());
+    CHECK(view.nu == 6 && view.nv == 8 && view.nw == 10);
+    CHECK(view.axis_order == AxisOrder::XYZ);
+    CHECK(view.spacegroup == map.grid.spacegroup);
+    CHECK(std::equal(map.grid.data.begin(), map.grid.data.end(),
+                     view.data.begin()));
+    GridView<float> cow = mapped.map_ccp4_file(path, MapAccess::CopyOnWrite);
+    CHECK(!cow.read_only);
+    cow.data[5] = 100.f;
+    CHECK(view.data[5] == map.grid.data[5]);
+  }
+  CHECK(read_file(path).grid.data == map.grid.data);
+  // other modes are read and moved to the view
+  map.update_ccp4_header(6);
+  for (float& x : map.grid.data)
+    x = std::round(std::fabs(x) * 100);
+  map.write_ccp4_map(path);
+  {
+    Ccp4<float> read;
+    GridView<float> view = read.map_ccp4_file(path);
+    CHECK(view.data.is_owned());
+    CHECK(std::equal(map.grid.data.begin(), map.grid.data.end(),
+                     view.data.begin()));
+  }
+  // maps in other axis order or not covering the cell are read and set up
+  map.update_ccp4_header(2);
+  map.grid.symmetrize_max();  // symmetry mates are set in setup()
+  zyx_copy(map).write_ccp4_map(path);
+  {
+    Ccp4<float> read;
+    GridView<float> view = read.map_ccp4_file(path);
+    CHECK(view.data.is_owned());
+    CHECK(view.axis_order == AxisOrder::XYZ);
+    CHECK(view.nu == 6 && view.nw == 10);
+    CHECK(std::equal(map.grid.data.begin(), map.grid.data.end(),
+                     view.data.begin()));
+  }
+  {
+    Ccp4<float> part;
+    part.read_ccp4_region(path, Fractional(0, 0, 0), Fractional(0.5, 1, 1));
+    part.set_header_i32(23, 1);  // P 1, no symmetry mates
+    part.write_ccp4_map(path);
+    Ccp4<float> read;
+    GridView<float> view = read.map_ccp4_file(path, MapAccess::ReadOnly,
+                                              -1.f);
+    CHECK(view.axis_order == AxisOrder::XYZ);
+    CHECK(view.nu == 6 && view.nv == 8 && view.nw == 10);
+    // x = 0..3 is in the file, x = 4 and 5 are not
+    CHECK(view.get_value_q(3, 2, 1) == map.grid.get_value_q(3, 2, 1));
+    CHECK(view.get_value_q(4, 2, 1) == -1.f);
+  }
+  // truncated file
+  map.write_ccp4_map(path);
+  std::vector<char> bytes = read_bytes(path);
+  bytes.resize(bytes.size() - 4);
+  write_bytes(path, bytes);
+  Ccp4<float> truncated;
+  CHECK_THROWS(truncated.map_ccp4_file(path));
+  std::remove(path);
+}
+
+// max difference between the region (after ReorderOnly setup) and the map
+static double region_diff(Ccp4<float>& region, const Ccp4<float>& full) {
+  region.setup(GridSetup::ReorderOnly, NAN);
+  const Grid<float>& g = region.grid;
+  int start[3] = {region.header_i32(5), region.header_i32(6),
+                  region.header_i32(7)};
+  double max_diff = 0;
+  for (int w = 0; w != g.nw; ++w)
+    for (int v = 0; v != g.nv; ++v)
+      for (int u = 0; u != g.nu; ++u) {
+        float expected = full.grid.get_value(start[0] + u, start[1] + v,
+                                             start[2] + w);
+        max_diff = std::max(max_diff, (double) std::fabs(
+                              g.get_value_q(u, v, w) - expected));
+      }
+  return max_diff;
+}
+
+static void test_region() {
+  const char* path = "test_ccp4_region.tmp";
+  const char* path2 = "test_ccp4_region2.tmp";
+  Ccp4<float> full = random_map("P 1", 10, 12, 14, 2);
+  const Fractional lo(-0.15, 0.2, 0.9), hi(0.3, 0.55, 1.3);
+  for (int mode : {2, 6}) {
+    Ccp4<float> map = full;
+    if (mode == 6) {
+      for (float& x : map.grid.data)
+        x = std::round(std::fabs(x) * 1000);
+      full.grid.data = map.grid.data;
+    }
+    map.update_ccp4_header(mode, true);
+    map.write_ccp4_map(path);
+    Ccp4<float> region;
+    region.read_ccp4_region(path, lo, hi);
+    // x: floor(-1.5)..3, y: 2..ceil(6.6), z: floor(12.6)..ceil(18.2)
+    CHECK(region.grid.nu == 6 && region.grid.nv == 6 && region.grid.nw == 8);
+    CHECK_NEAR(region_diff(region, full), 0., 0.);
+    CHECK(region.header_i32(5) == -2 && region.header_i32(7) == 12);
+    // the same from memory
+    std::vector<char> bytes = read_bytes(path);
+    MemoryStream mem(bytes.data(), bytes.data() + bytes.size());
+    Ccp4<float> region2;
+    region2.read_ccp4_region_stream(mem, "memory", lo, hi);
+    CHECK(region2.grid.data == region.grid.data);
+    // file with ZYX order
+    if (mode == 2) {
+      zyx_copy(full).write_ccp4_map(path2);
+      Ccp4<float> region3;
+      region3.read_ccp4_region(path2, lo, hi);
+      CHECK(region3.grid.nu == 8 && region3.grid.nw == 6);
+      CHECK_NEAR(region_diff(region3, full), 0., 0.);
+    }
+  }
+  // a map with only a part of the cell: the region is clipped to it
+  Ccp4<float> part;
+  part.read_ccp4_region(path, Fractional(0.1, 0.1, 0.1),
+                        Fractional(0.5, 0.5, 0.5));
+  part.write_ccp4_map(path2);
+  Ccp4<float> clipped;
+  clipped.read_ccp4_region(path2, Fractional(0.3, -0.2, 0.2),
+                           Fractional(0.9, 0.3, 0.4));
+  // x: 3..5 (the part ends at 5), y: 1 (where the part starts)..ceil(3.6)
+  CHECK(clipped.grid.nu == 3 && clipped.grid.nv == 4);
+  CHECK_NEAR(region_diff(clipped, full), 0., 0.);
+  Ccp4<float> outside;
+  CHECK_THROWS(outside.read_ccp4_region(path2, Fractional(0.7, 0.7, 0.7),
+                                        Fractional(0.8, 0.8, 0.8)));
+  std::remove(path);
+  std::remove(path2);
+}
+
+// The map is stored with sections along x and columns along z, starting
+// from a point other than the origin; setup() must restore the XYZ map.
+static void test_setup() {
+  Ccp4<float> full = random_map("P 21 21 21", 12, 10, 8, 3);
+  full.grid.symmetrize_max();
+  for (int n_thr : {1, 3})
+    for (bool low_memory : {false, true})
+      for (GridSetup mode : {GridSetup::ReorderOnly, GridSetup::Full,
+                             GridSetup::FullCheck}) {
+        Ccp4<float> zyx = zyx_copy(full);
+        // start (in the file order) is z=5, y=-3, x=7: shift the data
+        const int start[3] = {5, -3, 7};
+        Grid<float>& g = zyx.grid;
+        std::vector<float> data(g.data.size());
+        for (int w = 0; w != g.nw; ++w)
+          for (int v = 0; v != g.nv; ++v)
+            for (int u = 0; u != g.nu; ++u)
+              data[g.index_q(u, v, w)] = g.get_value(u + start[0], v + start[1],
+                                                     w + start[2]);
+        g.data = data;
+        zyx.set_header_3i32(5, start[0], start[1], start[2]);
+        const float* old_data = g.data.data();
+        double error = zyx.setup(mode, NAN, n_thr, low_memory);
+        // in place (with low_memory), or copied to a new vector
+        CHECK((zyx.grid.data.data() == old_data) == low_memory);
+        CHECK(zyx.grid.nu == 12 && zyx.grid.nv == 10 && zyx.grid.nw == 8);
+        CHECK_NEAR(error, 0., 0.);
+        if (mode == GridSetup::ReorderOnly) {
+          // the data starts from x=7, y=-3, z=5
+          CHECK(zyx.header_i32(5) == 7 && zyx.header_i32(7) == 5);
+          for (int w = 0; w != 8; ++w)
+            for (int v = 0; v != 10; ++v)
+              for (int u = 0; u != 12; ++u)
+                CHECK(zyx.grid.get_value_q(u, v, w) ==
+                      full.grid.get_value(u + 7, v - 3, w + 5));
+        } else {
+          CHECK(zyx.grid.axis_order == AxisOrder::XYZ);
+          CHECK(zyx.header_i32(5) == 0 && zyx.header_i32(7) == 0);
+          CHECK(zyx.grid.data == full.grid.data);
+        }
+      }
+
+  // a part of the cell is expanded, with missing points from symmetry
+  const char* path = "test_ccp4_setup.tmp";
+  full.write_ccp4_map(path);
+  Ccp4<float> part;
+  part.read_ccp4_region(path, Fractional(-0.1, 0, 0), Fractional(0.5, 1, 1));
+  part.setup(GridSetup::ReorderOnly, NAN);
+  CHECK(part.grid.nu == 9 && part.header_i32(5) == -2);
+  // not the whole cell, so it's copied even with low_memory
+  double error = part.setup(GridSetup::FullCheck, NAN, 0, true);
+  CHECK_NEAR(error, 0., 0.);
+  CHECK(part.grid.data == full.grid.data);
+  // without symmetry, the rest of the cell is set to the default value
+  part.read_ccp4_region(path, Fractional(0.2, 0, 0), Fractional(0.5, 1, 1));
+  part.grid.spacegroup = find_spacegroup_by_name("P 1");
+  part.setup(GridSetup::Full, -100.f);
+  for (int u = 0; u != 12; ++u)
+    CHECK(part.grid.get_value_q(u, 1, 2) == (u >= 2 && u <= 6
+                                             ? full.grid.get_value_q(u, 1, 2)
+                                             : -100.f));
+  std::remove(path);
+}
+
+// plain gzip file (one member, without the sizes in the header)
+static void write_gz(const char* path, const std::vector<char>& bytes) {
+  gzFile f = gzopen(path, "wb");
+  gzwrite(f, bytes.data(), (unsigned) bytes.size());
+  gzclose(f);
+}
+
+static void test_gz() {
+  const char* path = "test_ccp4_gz.tmp";
+  const char* gz_path = "test_ccp4_gz.tmp.gz";
+  Ccp4<float> map = random_map("P 1 21 1", 30, 32, 34, 4);
+  map.write_ccp4_map(path);
+  std::vector<char> bytes = read_bytes(path);
+  write_gz(gz_path, bytes);
+  std::string idx_path = gz_index_path(gz_path);
+  std::remove(idx_path.c_str());
+  // streamed from the gz file
+  Ccp4<float> gz_map;
+  gz_map.read_ccp4(MaybeGzipped(gz_path));
+  CHECK(gz_map.grid.data == map.grid.data);
+  CHECK(gz_map.ccp4_header == read_file(path).ccp4_header);
+  // decompressed in memory, without caching the index
+  MaybeGzipped input(gz_path);
+  std::unique_ptr<char[]> mem = input.memory();
+  CHECK(input.memory_size() == bytes.size() &&
+        std::memcmp(mem.get(), bytes.data(), bytes.size()) == 0);
+  FILE* idx = std::fopen(idx_path.c_str(), "rb");
+  CHECK(idx == nullptr);
+  if (idx)
+    std::fclose(idx);
+  Ccp4<float> mem_map;
+  mem_map.read_ccp4_from_memory(mem.get(), input.memory_size(), gz_path);
+  CHECK(mem_map.grid.data == map.grid.data);
+
+  // Read in parallel: members with sizes in headers (the member boundaries
+  // are not aligned with the data), or a plain file with a cached index.
+  // The mode 1 map goes through the conversion.
+  Ccp4<float> quant = random_map("P 1 21 1", 30, 32, 34, 5);
+  quant.set_quantization_from_stats(1, 0.);
+  quant.update_ccp4_header(1, true);
+  quant.write_ccp4_map(path);
+  Ccp4<float> quant_orig = read_file(path);
+  std::vector<char> quant_bytes = read_bytes(path);
+  for (int kind = 0; kind != 4; ++kind) {
+    const std::vector<char>& b = kind % 2 == 0 ? bytes : quant_bytes;
+    const Ccp4<float>& orig = kind % 2 == 0 ? map : quant_orig;
+    if (kind < 2) {
+      write_gz_parallel(gz_path, b.data(), b.size(), 6, 2, 10007);
+    } else {
+      write_gz(gz_path, b);
+      CHECK(!MaybeGzipped(gz_path).read_in_parallel(0, mem.get(), 10, 2));
+      get_gz_index(gz_path, 20000);
+    }
+    std::vector<char> part(30000);
+    CHECK(MaybeGzipped(gz_path).read_in_parallel(5003, part.data(),
+                                                 part.size(), 3));
+    CHECK(std::equal(part.begin(), part.end(), b.begin() + 5003));
+    Ccp4<float> par_map;
+    par_map.read_ccp4(MaybeGzipped(gz_path), 3);
+    CHECK(par_map.grid.data == orig.grid.data);
+    CHECK(par_map.ccp4_header == orig.ccp4_header);
+    CHECK_THROWS(MaybeGzipped(gz_path).read_in_parallel(b.size() - 10,
+                                                        part.data(), 11));
+    std::remove(idx_path.c_str());
+  }
+  CHECK(!BasicInput(path).read_in_parallel(0, mem.get(), 10));
+  std::remove(path);
+  std::remove(gz_path);
+}
+
+// write_ccp4_map_async() must write the same bytes as write_ccp4_map()
+static void test_async() {
+  const char* path = "test_ccp4_sync.tmp";
+  const char* async_path = "test_ccp4_async.tmp";
+  const char* gz_path = "test_ccp4_async.tmp.gz";
+  // more than one chunk (1M values) of data
+  Ccp4<float> orig = random_map("P 1 21 1", 110, 104, 100, 5);
+  struct Case { int mode; bool quantized; };
+  for (Case c : {Case{2, false}, Case{6, false}, Case{1, false},
+                 Case{0, true}, Case{1, true}}) {
+    auto map = std::make_shared<Ccp4<float>>(orig);
+    if (c.mode == 6 || !c.quantized)
+      for (float& x : map->grid.data)
+        x = std::round(std::fabs(x) * 20);
+    if (c.quantized)
+      map->set_quantization_from_stats(c.mode, 3.);
+    map->update_ccp4_header(c.mode, true);
+    map->write_ccp4_map(path);
+    const std::vector<char> expected = read_bytes(path);
+    for (int n_thr : {1, 3})
+      for (size_t queue : {(size_t) 1, (size_t) 8}) {
+        write_ccp4_map_async<float>(map, async_path, n_thr, queue).get();
+        CHECK(read_bytes(async_path) == expected);
+      }
+    // gzipped: members that are decompressed in parallel
+    write_ccp4_map_async<float>(map, gz_path, 3).get();
+    size_t size = 0;
+    std::unique_ptr<char[]> mem = decompress_gz_file(gz_path, size, 3, false);
+    CHECK(size == expected.size() &&
+          std::memcmp(mem.get(), expected.data(), size) == 0);
+  }
+  auto map = std::make_shared<Ccp4<float>>(orig);
+  CHECK_THROWS(write_ccp4_map_async<float>(map, "no_such_dir/x.map").get());
+  map->set_header_i32(4, 3);
+  CHECK_THROWS(write_ccp4_map_async<float>(map, async_path));
+  std::remove(path);
+  std::remove(async_path);
+  std::remove(gz_path);
+}
+
+// modes 0 and 1 with quant_scale: value = quant_offset + quant_scale * q
+static void test_quantized() {
+  const char* path = "test_ccp4_quant.tmp";
+  for (int mode : {0, 1}) {
+    const double qmin = mode == 0 ? -128 : -32768;
+    for (double sigma_range : {0., 2.}) {
+      Ccp4<float> map = random_map("P 1 21 1", 16, 18, 20, 6);
+      map.set_quantization_from_stats(mode, sigma_range);
+      map.update_ccp4_header(mode, true);
+      map.grid.data[7] = NAN;  // after the statistics are calculated
+      map.write_ccp4_map(path);
+      const double scale = map.quant_scale, offset = map.quant_offset;
+      const double lo = offset + qmin * scale;
+      const double hi = offset + (-qmin - 1) * scale;
+      if (sigma_range == 0)
+        CHECK_NEAR(hi, map.hstats.dmax, 1e-6 * hi);
+
+      Ccp4<float> back = read_file(path);
+      // the label keeps all digits
+      CHECK(back.quant_scale == scale && back.quant_offset == offset);
+      CHECK(back.header_i32(4) == mode);
+      CHECK_NEAR(back.hstats.dmin, map.hstats.dmin, scale);
+      CHECK_NEAR(back.hstats.dmax, map.hstats.dmax, scale);
+      CHECK_NEAR(back.hstats.rms, map.hstats.rms, 1e-3 * map.hstats.rms);
+      // NaN is stored as the minimum
+      CHECK_NEAR(back.grid.data[7], lo, 1e-6);
+      double max_error = 0;
+      bool clipped = true;
+      for (size_t i = 0; i != map.grid.data.size(); ++i) {
+        double x = map.grid.data[i], y = back.grid.data[i];
+        if (i == 7)
+          continue;
+        if (x >= lo && x <= hi)
+          max_error = std::max(max_error, std::fabs(x - y));
+        else
+          clipped = clipped && y == (float) (x < lo ? lo : hi);
+      }
+      // plus rounding of float values (offset + scale * q is a float)
+      double max_abs = std::max(-map.hstats.dmin, map.hstats.dmax);
+      CHECK(max_error <= 0.5 * scale + 1e-6 * max_abs);
+      CHECK(clipped);
+
+      // the same values in a region and in a double map
+      Ccp4<float> region;
+      region.read_ccp4_region(path, Fractional(0.1, 0.2, 0.3),
+                              Fractional(0.6, 0.7, 0.8));
+      CHECK_NEAR(region_diff(region, back), 0., 0.);
+      Ccp4<double> dmap;
+      dmap.read_ccp4_file(path);
+      CHECK_NEAR(dmap.grid.data[100], back.grid.data[100], 1e-6);
+    }
+  }
+  // without quant_scale, values are only converted
+  Ccp4<float> map = random_map("P 1", 4, 4, 4, 7);
+  for (float& x : map.grid.data)
+    x = std::round(x * 30);
+  map.update_ccp4_header(1, true);
+  map.write_ccp4_map(path);
+  Ccp4<float> back = read_file(path);
+  CHECK(back.quant_scale == 0);
+  CHECK(back.grid.data == map.grid.data);
+  CHECK_THROWS(map.set_quantization(2, 0, 1));
+  std::remove(path);
+}
+
+// Copy of a map file (written by map) in the other byte order. Text
+// (MAP, the machine stamp, labels, symmetry records) is not swapped.
+static std::vector<char> swapped_copy(const Ccp4<float>& map,
+                                      const std::vector<char>& bytes) {
+  std::vector<char> out = bytes;
+  for (int w = 1; w <= 56; ++w)
+    if (w != 53 && w != 54)
+      std::reverse(&out[4 * (w - 1)], &out[4 * w]);
+  out[212] = out[213] = (char) (is_little_endian() ? 0x11 : 0x44);
+  int mode = map.header_i32(4);
+  size_t width = mode == 0 ? 1 : mode == 2 ? 4 : 2;
+  for (size_t i = 1024 + map.header_i32(24); i < out.size(); i += width)
+    std::reverse(&out[i], &out[i + width]);
+  return out;
+}
+
+// Maps in the other byte order (big-endian on x86) must read the same
+// as native ones; bytes are swapped before values are converted.
+static void test_byte_order() {
+  const char* path = "test_ccp4_order.tmp";
+  const char* swapped_path = "test_ccp4_order2.tmp";
+  // more than one chunk (64k values) of data
+  const Ccp4<float> orig = random_map("P 1 21 1", 40, 42, 44, 8);
+  const Fractional lo(0.1, -0.2, 0.3), hi(0.6, 0.7, 0.8);
+  struct Case { int mode; bool quantized; };
+  for (Case c : {Case{2, false}, Case{6, false}, Case{1, false},
+                 Case{0, true}, Case{1, true}}) {
+    Ccp4<float> map = orig;
+    if (!c.quantized)
+      for (float& x : map.grid.data)
+        x = std::round(std::fabs(x) * 500);
+    if (c.quantized)
+      map.set_quantization_from_stats(c.mode, 3.);
+    map.update_ccp4_header(c.mode, true);
+    map.write_ccp4_map(path);
+    const std::vector<char> bytes = read_bytes(path);
+    const std::vector<char> swapped = swapped_copy(map, bytes);
+    CHECK(swapped != bytes);
+    write_bytes(swapped_path, swapped);
+
+    Ccp4<float> native = read_file(path);
+    Ccp4<float> other = read_file(swapped_path);
+    CHECK(!other.same_byte_order);
+    CHECK(other.grid.nu == 40 && other.grid.nw == 44);
+    CHECK(other.header_i32(4) == c.mode);
+    CHECK(other.grid.spacegroup == orig.grid.spacegroup);
+    CHECK(other.hstats.rms == native.hstats.rms);
+    CHECK(other.quant_scale == native.quant_scale);
+    CHECK(other.grid.data == native.grid.data);
+    if (!c.quantized)
+      CHECK(other.grid.data == map.grid.data);
+
+    Ccp4<double> dnative, dother;
+    dnative.read_ccp4_file(path);
+    dother.read_ccp4_file(swapped_path);
+    CHECK(dother.grid.data == dnative.grid.data);
+
+    Ccp4<float> region, other_region;
+    region.read_ccp4_region(path, lo, hi);
+    other_region.read_ccp4_region(swapped_path, lo, hi);
+    CHECK(other_region.grid.data == region.grid.data);
+
+    // from memory
+    MemoryStream mem(swapped.data(), swapped.data() + swapped.size());
+    Ccp4<float> from_mem;
+    from_mem.read_ccp4_stream(mem, "memory");
+    CHECK(from_mem.grid.data == native.grid.data);
+
+    // cannot be mapped, the data is read
+    Ccp4<float> mapped;
+    GridView<float> view = mapped.map_ccp4_file(swapped_path);
+    CHECK(view.data.is_owned());
+    CHECK(std::equal(native.grid.data.begin(), native.grid.data.end(),
+                     view.data.begin()));
+
+    // the memory type is the same as the file type
+    if (c.mode == 1 && !c.quantized) {
+      Ccp4<std::int16_t> native16, other16;
+      native16.read_ccp4_file(path);
+      other16.read_ccp4_file(swapped_path);
+      CHECK(other16.grid.data == native16.grid.data);
+      CHECK(other16.grid.data[5] == (std::int16_t) map.grid.data[5]);
+    }
+  }
+  std::remove(path);
+  std::remove(swapped_path);
+}
+
+int main() {
+  RUN_TEST(test_map_ccp4_file);
+  RUN_TEST(test_region);
+  RUN_TEST(test_setup);
+  RUN_TEST(test_gz);
+  RUN_TEST(test_async);
+  RUN_TEST(test_quantized);
+  RUN_TEST(test_byte_order);
+  return check::result("ccp4");
+}
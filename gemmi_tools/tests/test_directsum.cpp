@@ -0,0 +1,139 @@
+// Tests of direct_f_phi_on_frame() and sample_f_phi_on_frame() against
+// the FFT map and against a plain sum over all reflections.
+
+#include <map>
+#include <random>
+#include <gemmi/directsum.hpp>
+#include <gemmi/symmetry.hpp>  // for find_spacegroup_by_name
+#include "check.hpp"
+
+using namespace gemmi;
+
+// Reflections as rows (h, k, l, F, phi) with the interface of data
+// proxies (such as MtzDataProxy) used in fourier.hpp.
+struct RowProxy {
+  UnitCell cell;
+  const SpaceGroup* sg;
+  std::vector<double> v;
+  bool ok() const { return true; }
+  size_t stride() const { return 5; }
+  size_t size() const { return v.size(); }
+  const SpaceGroup* spacegroup() const { return sg; }
+  const UnitCell& unit_cell() const { return cell; }
+  std::array<size_t, 3> hkl_col() const { return {{0, 1, 2}}; }
+  int get_int(size_t n) const { return (int) v[n]; }
+  double get_num(size_t n) const { return v[n]; }
+  Miller get_hkl(size_t n, const std::array<size_t, 3>& c) const {
+    return {{get_int(n + c[0]), get_int(n + c[1]), get_int(n + c[2])}};
+  }
+};
+
+// consistent (symmetric) map coefficients from a random map
+static RowProxy coefficients_of_random_map(const char* hm, double dmin) {
+  Grid<float> map;
+  map.spacegroup = find_spacegroup_by_name(hm);
+  map.set_unit_cell(20, 22, 24, 90, 100, 90);
+  map.set_size(16, 16, 18);
+  std::mt19937 rng(1);
+  std::normal_distribution<float> normal;
+  for (float& x : map.data)
+    x = normal(rng);
+  map.symmetrize_max();
+  AsuFPhiData<float> asu = transform_map_to_f_phi_asu(map, dmin);
+  RowProxy data;
+  data.cell = map.unit_cell;
+  data.sg = map.spacegroup;
+  for (size_t i = 0; i != asu.hkl.size(); ++i)
+    data.v.insert(data.v.end(), {(double) asu.hkl[i][0],
+                                 (double) asu.hkl[i][1],
+                                 (double) asu.hkl[i][2], asu.f[i], asu.phi[i]});
+  return data;
+}
+
+// rho(x) = 1/V sum over all hkl of F cos(2 pi hkl.x - phi)
+static double plain_sum(const RowProxy& data, const Position& pos) {
+  std::map<Miller, std::pair<double, double>> all;
+  GroupOps ops = data.sg->operations();
+  for (size_t i = 0; i < data.v.size(); i += 5) {
+    Miller hkl = data.get_hkl(i, data.hkl_col());
+    double phi = rad(data.v[i + 4]);
+    for (const Op& op : ops.sym_ops) {
+      Miller m = op.apply_to_hkl(hkl);
+      double shifted = phi + op.phase_shift(hkl);
+      all.emplace(m, std::make_pair(data.v[i + 3], shifted));
+      all.emplace(Miller{{-m[0], -m[1], -m[2]}},
+                  std::make_pair(data.v[i + 3], -shifted));
+    }
+  }
+  Fractional fr = data.cell.fractionalize(pos);
+  double sum = 0;
+  for (const auto& t : all)
+    sum += t.second.first * std::cos(2 * pi() * (t.first[0] * fr.x +
+                                                  t.first[1] * fr.y +
+                                                  t.first[2] * fr.z) -
+                                     t.second.second);
+  return sum / data.cell.volume;
+}
+
+static void test_grid_frame() {
+  RowProxy data = coefficients_of_random_map("P 1 21 1", 3.0);
+  std::array<int, 3> cell_size = get_size_for_hkl(data, {{0, 0, 0}}, 3.);
+  Grid<float> map = transform_f_phi_to_map<float>(data, 3, 4, cell_size, 0.,
+                                                  true);
+  // box of grid points starting at (13, 2, 5), crossing the cell edge
+  Transform frame;
+  for (int i = 0; i != 3; ++i)
+    for (int j = 0; j != 3; ++j)
+      frame.mat[i][j] = data.cell.orth.mat[i][j] / cell_size[j];
+  frame.vec = frame.mat.multiply(Vec3(13, 2, 5));
+  std::array<int, 3> size = {{5, 4, 3}};
+  for (FrameMethod method : {FrameMethod::Direct, FrameMethod::Fft,
+                             FrameMethod::Auto}) {
+    std::vector<float> values = sample_f_phi_on_frame<float>(
+        data, 3, 4, frame, size, method, 3., 2);
+    CHECK(values.size() == 5 * 4 * 3);
+    double max_diff = 0;
+    for (int k = 0; k != size[2]; ++k)
+      for (int j = 0; j != size[1]; ++j)
+        for (int i = 0; i != size[0]; ++i)
+          max_diff = std::max(max_diff, (double) std::fabs(
+                values[(k * size[1] + j) * size[0] + i] -
+                map.get_value(13 + i, 2 + j, 5 + k)));
+    CHECK_NEAR(max_diff, 0., 1e-4);
+  }
+}
+
+static void test_rotated_frame() {
+  RowProxy data = coefficients_of_random_map("P 21 21 21", 4.0);
+  Transform frame;
+  const double c = std::cos(0.3), s = std::sin(0.3);
+  frame.mat = Mat33(0.7 * c, -0.7 * s, 0, 0.7 * s, 0.7 * c, 0, 0, 0, 0.6);
+  frame.vec = Vec3(-3.1, 4.2, 30.5);
+  std::array<int, 3> size = {{6, 3, 2}};
+  std::vector<float> values = direct_f_phi_on_frame<float>(data, 3, 4, frame,
+                                                           size, 2);
+  double max_diff = 0;
+  for (int k = 0; k != size[2]; ++k)
+    for (int j = 0; j != size[1]; ++j)
+      for (int i = 0; i != size[0]; ++i) {
+        Position pos(frame.apply(Vec3(i, j, k)));
+        max_diff = std::max(max_diff, std::fabs(
+              values[(k * size[1] + j) * size[0] + i] - plain_sum(data, pos)));
+      }
+  CHECK_NEAR(max_diff, 0., 1e-4);
+}
+
+static void test_errors() {
+  RowProxy data = coefficients_of_random_map("P 1", 4.0);
+  Transform frame;
+  CHECK_THROWS(direct_f_phi_on_frame<float>(data, 3, 7, frame, {{2, 2, 2}}));
+  data.sg = nullptr;
+  CHECK_THROWS(direct_f_phi_on_frame<float>(data, 3, 4, frame, {{2, 2, 2}}));
+}
+
+int main() {
+  RUN_TEST(test_grid_frame);
+  RUN_TEST(test_rotated_frame);
+  RUN_TEST(test_errors);
+  return check::result("directsum");
+}
@@ -0,0 +1,148 @@
+// Tests of distance_transform() and mask morphology against brute force.
+
+#include <random>
+#include <gemmi/edt.hpp>
+#include <gemmi/symmetry.hpp>  // for find_spacegroup_by_name
+#include "check.hpp"
+
+using namespace gemmi;
+
+static Grid<float> random_mask(double a, double b, double c, double alpha,
+                               double beta, double gamma, int nu, int nv,
+                               int nw, double fraction, unsigned seed) {
+  Grid<float> mask;
+  mask.spacegroup = find_spacegroup_by_name("P 1");
+  mask.set_unit_cell(a, b, c, alpha, beta, gamma);
+  mask.set_size(nu, nv, nw);
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<double> uni(0, 1);
+  for (float& x : mask.data)
+    x = uni(rng) < fraction ? 1.f : 0.f;
+  return mask;
+}
+
+// Squared distance from each point to the nearest image of a mask point.
+static std::vector<double> brute_force(const Grid<float>& mask) {
+  // squared length of the shortest image of each grid offset
+  std::vector<double> table(mask.data.size(), INFINITY);
+  for (int w = 0; w != mask.nw; ++w)
+    for (int v = 0; v != mask.nv; ++v)
+      for (int u = 0; u != mask.nu; ++u) {
+        double& r = table[mask.index_q(u, v, w)];
+        for (int i = -2; i <= 2; ++i)
+          for (int j = -2; j <= 2; ++j)
+            for (int k = -2; k <= 2; ++k) {
+              Fractional f(double(u) / mask.nu + i, double(v) / mask.nv + j,
+                           double(w) / mask.nw + k);
+              r = std::min(r, mask.unit_cell.orthogonalize_difference(f)
+                              .length_sq());
+            }
+      }
+  std::vector<std::array<int, 3>> seeds;
+  for (int w = 0; w != mask.nw; ++w)
+    for (int v = 0; v != mask.nv; ++v)
+      for (int u = 0; u != mask.nu; ++u)
+        if (mask.get_value_q(u, v, w) != 0)
+          seeds.push_back({{u, v, w}});
+  std::vector<double> result(mask.data.size(), INFINITY);
+  for (int w = 0; w != mask.nw; ++w)
+    for (int v = 0; v != mask.nv; ++v)
+      for (int u = 0; u != mask.nu; ++u) {
+        double& r = result[mask.index_q(u, v, w)];
+        for (const std::array<int, 3>& s : seeds)
+          r = std::min(r, table[mask.index_s(s[0] - u, s[1] - v, s[2] - w)]);
+      }
+  return result;
+}
+
+static void compare(const Grid<float>& mask, int nthreads) {
+  Grid<float> dist = distance_transform(mask, nthreads);
+  std::vector<double> ref = brute_force(mask);
+  double max_diff = 0;
+  for (size_t i = 0; i != ref.size(); ++i)
+    max_diff = std::max(max_diff, std::fabs(dist.data[i] - std::sqrt(ref[i])));
+  CHECK_NEAR(max_diff, 0., 1e-4);
+}
+
+static void test_orthogonal() {
+  compare(random_mask(12, 14, 15, 90, 90, 90, 12, 14, 16, 0.01, 1), 2);
+}
+
+static void test_triclinic() {
+  compare(random_mask(11, 12, 13, 70, 105, 115, 12, 12, 14, 0.01, 2), 2);
+  compare(random_mask(11, 12, 13, 70, 105, 115, 12, 12, 14, 0.3, 3), 1);
+  // strongly skewed, sparse: distances are larger than the blocks
+  compare(random_mask(10, 12, 20, 100, 130, 60, 10, 12, 20, 0.002, 4), 3);
+  compare(random_mask(10, 12, 20, 100, 130, 60, 10, 12, 20, 0.2, 5), 3);
+}
+
+static void test_single_point() {
+  Grid<float> mask = random_mask(9, 10, 11, 80, 100, 120, 9, 10, 11, 0, 6);
+  mask.set_value(3, 4, 5, 1.f);
+  compare(mask, 2);
+  mask.fill(0.f);
+  Grid<float> dist = distance_transform(mask);
+  CHECK(dist.data[0] == INFINITY);
+}
+
+static void test_max_distance() {
+  Grid<float> mask = random_mask(10, 12, 20, 100, 130, 60, 10, 12, 20,
+                                 0.002, 4);
+  std::vector<double> ref = brute_force(mask);
+  for (double max_distance : {0.5, 2.0, 3.5}) {
+    Grid<float> dist = distance_transform(mask, 2, max_distance);
+    int bad = 0, n_inf = 0;
+    for (size_t i = 0; i != ref.size(); ++i) {
+      double d = std::sqrt(ref[i]);
+      if (dist.data[i] == INFINITY)
+        ++n_inf;
+      if (dist.data[i] == INFINITY ? d < max_distance
+                                   : std::fabs(dist.data[i] - d) > 1e-4)
+        ++bad;
+    }
+    CHECK(bad == 0);
+    CHECK(n_inf > 0);
+  }
+}
+
+static void test_dilate_erode() {
+  Grid<float> mask = random_mask(11, 12, 13, 70, 105, 115, 12, 12, 14,
+                                 0.02, 7);
+  std::vector<double> ref = brute_force(mask);
+  const double radius = 2.2;
+  Grid<float> dilated = mask;
+  dilate_mask(dilated, radius, 2);
+  int bad = 0;
+  for (size_t i = 0; i != ref.size(); ++i)
+    if (std::fabs(std::sqrt(ref[i]) - radius) > 1e-4 &&
+        dilated.data[i] != (std::sqrt(ref[i]) < radius ? 1.f : 0.f))
+      ++bad;
+  CHECK(bad == 0);
+  // erosion is dilation of the complement
+  Grid<float> eroded = dilated;
+  erode_mask(eroded, radius, 2);
+  Grid<float> complement = dilated;
+  for (float& x : complement.data)
+    x = x != 0 ? 0.f : 1.f;
+  std::vector<double> ref2 = brute_force(complement);
+  bad = 0;
+  for (size_t i = 0; i != ref2.size(); ++i)
+    if (std::fabs(std::sqrt(ref2[i]) - radius) > 1e-4 &&
+        eroded.data[i] != (std::sqrt(ref2[i]) < radius ? 0.f : 1.f))
+      ++bad;
+  CHECK(bad == 0);
+  // closing contains the original mask
+  for (size_t i = 0; i != mask.data.size(); ++i)
+    if (mask.data[i] != 0 && eroded.data[i] == 0)
+      ++bad;
+  CHECK(bad == 0);
+}
+
+int main() {
+  RUN_TEST(test_orthogonal);
+  RUN_TEST(test_triclinic);
+  RUN_TEST(test_single_point);
+  RUN_TEST(test_max_distance);
+  RUN_TEST(test_dilate_erode);
+  return check::result("edt");
+}
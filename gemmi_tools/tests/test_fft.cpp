@@ -0,0 +1,384 @@
+// Tests of the map <-> map coefficients FFTs in fourier.hpp.
+
+#include <map>
+#include <random>
+#include <gemmi/fourier.hpp>
+#include <gemmi/symmetry.hpp>  // for find_spacegroup_by_name
+#include "check.hpp"
+
+using namespace gemmi;
+
+static Grid<float> random_map(int nu, int nv, int nw, unsigned seed) {
+  Grid<float> grid;
+  grid.spacegroup = find_spacegroup_by_name("P 1");
+  grid.set_unit_cell(21, 24, 30, 80, 95, 100);
+  grid.set_size(nu, nv, nw);
+  std::mt19937 rng(seed);
+  std::normal_distribution<float> normal;
+  for (float& x : grid.data)
+    x = normal(rng);
+  return grid;
+}
+
+template<typename T>
+static double max_abs_diff(const std::vector<T>& a, const std::vector<T>& b) {
+  double d = 0;
+  for (size_t i = 0; i != a.size(); ++i)
+    d = std::max(d, (double) std::abs(a[i] - b[i]));
+  return d;
+}
+
+// Reflections as rows (h, k, l, F, phi) with the interface of data
+// proxies (such as MtzDataProxy) used in fourier.hpp.
+struct RowProxy {
+  UnitCell cell;
+  const SpaceGroup* sg;
+  std::vector<double> v;
+  bool ok() const { return true; }
+  size_t stride() const { return 5; }
+  size_t size() const { return v.size(); }
+  const SpaceGroup* spacegroup() const { return sg; }
+  const UnitCell& unit_cell() const { return cell; }
+  std::array<size_t, 3> hkl_col() const { return {{0, 1, 2}}; }
+  int get_int(size_t n) const { return (int) v[n]; }
+  double get_num(size_t n) const { return v[n]; }
+  Miller get_hkl(size_t n, const std::array<size_t, 3>& c) const {
+    return {{get_int(n + c[0]), get_int(n + c[1]), get_int(n + c[2])}};
+  }
+};
+
+// random F and phi for reflections from the ASU with |h|,|k|,|l| <= lim
+static RowProxy random_reflections(const char* hm, int lim, unsigned seed) {
+  RowProxy data;
+  data.sg = find_spacegroup_by_name(hm);
+  data.cell = UnitCell(21, 24, 30, 90, 90, 90);
+  HklAsuChecker asu(data.sg);
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<double> uniform(0, 1);
+  for (int h = -lim; h <= lim; ++h)
+    for (int k = -lim; k <= lim; ++k)
+      for (int l = -lim; l <= lim; ++l)
+        if (asu.is_in(h, k, l))
+          data.v.insert(data.v.end(), {(double) h, (double) k, (double) l,
+                                       10 * uniform(rng), 360 * uniform(rng)});
+  return data;
+}
+
+// Map coefficients on the grid from a serial loop over reflections and
+// symmetry operations, where the first value > 0 put on a point wins
+// (column 3 is F, or the value if phi_col is 0).
+static FPhiGrid<float> serial_fill(const RowProxy& data, size_t phi_col,
+                                   std::array<int, 3> size, bool half_l,
+                                   AxisOrder axis_order) {
+  FPhiGrid<float> grid;
+  initialize_hkl_grid(grid, data, size, half_l, axis_order);
+  GroupOps ops = data.sg->operations();
+  for (size_t i = 0; i < data.size(); i += data.stride()) {
+    Miller hkl = data.get_hkl(i, data.hkl_col());
+    double f = data.get_num(i + 3);
+    double phi = phi_col ? rad(data.get_num(i + phi_col)) : 0.;
+    if (f == 0 || (phi_col && f < 0))
+      continue;
+    for (const Op& op : ops.sym_ops) {
+      Miller hklp = op.apply_to_hkl(hkl);
+      int sign = !half_l || hklp[2] >= 0 ? 1 : -1;
+      if (axis_order == AxisOrder::ZYX)
+        std::swap(hklp[0], hklp[2]);
+      std::complex<float>& x = grid.data[grid.index_n(
+          sign * hklp[0], sign * hklp[1], sign * hklp[2])];
+      if (x == std::complex<float>())
+        x = phi_col ? std::complex<float>(std::polar(
+                          f, sign * (phi + op.phase_shift(hkl))))
+                    : std::complex<float>((float) f);
+    }
+  }
+  if (!ops.is_centric())
+    add_friedel_mates(grid);
+  return grid;
+}
+
+// F(hkl) = V/N sum_x rho(x) exp(2 pi i hkl.x)
+static std::complex<double> direct_f(const Grid<float>& map, int h, int k,
+                                     int l) {
+  std::complex<double> sum;
+  for (int w = 0; w != map.nw; ++w)
+    for (int v = 0; v != map.nv; ++v)
+      for (int u = 0; u != map.nu; ++u) {
+        double arg = 2 * pi() * (double(h * u) / map.nu +
+                                 double(k * v) / map.nv +
+                                 double(l * w) / map.nw);
+        sum += std::polar((double) map.get_value_q(u, v, w), arg);
+      }
+  return sum * (map.unit_cell.volume / map.point_count());
+}
+
+static void test_threads() {
+  Grid<float> map = random_map(20, 24, 18, 1);
+  FPhiGrid<float> hkl1 = transform_map_to_f_phi(map, true, 1);
+  for (int nthreads : {2, 3}) {
+    FPhiGrid<float> hkl = transform_map_to_f_phi(map, true, nthreads);
+    CHECK(hkl.nu == hkl1.nu && hkl.nv == hkl1.nv && hkl.nw == hkl1.nw);
+    CHECK_NEAR(max_abs_diff(hkl.data, hkl1.data), 0., 1e-5);
+  }
+  const int hkls[3][3] = {{1, 2, 3}, {-4, 0, 2}, {3, -5, 4}};
+  for (const int* m : hkls) {
+    std::complex<double> f = direct_f(map, m[0], m[1], m[2]);
+    std::complex<float> g = hkl1.get_value(m[0], m[1], m[2]);
+    CHECK_NEAR(std::abs(std::complex<double>(g) - f), 0., 1e-3);
+  }
+  // full grid (half_l=false) has Friedel mates
+  FPhiGrid<float> full = transform_map_to_f_phi(map, false, 3);
+  CHECK_NEAR(std::abs(full.get_value(2, 3, -4) -
+                      std::conj(hkl1.get_value(-2, -3, 4))), 0., 1e-5);
+  for (bool half_l : {true, false}) {
+    Grid<float> map1 =
+      transform_f_phi_grid_to_map(transform_map_to_f_phi(map, half_l, 1), 1);
+    Grid<float> map3 =
+      transform_f_phi_grid_to_map(transform_map_to_f_phi(map, half_l, 3), 3);
+    CHECK(map1.nu == map.nu && map1.nv == map.nv && map1.nw == map.nw);
+    CHECK_NEAR(max_abs_diff(map1.data, map.data), 0., 1e-4);
+    CHECK_NEAR(max_abs_diff(map3.data, map1.data), 0., 1e-5);
+  }
+}
+
+static void test_workspace() {
+  const std::array<int, 3> size = {{16, 18, 20}};
+  RowProxy data = random_reflections("P 21 21 21", 6, 2);
+  RowProxy data2 = random_reflections("P 21 21 21", 5, 3);
+  FftWorkspace<float> ws(2);
+  for (int iter = 0; iter != 3; ++iter) {
+    // the second iteration changes values only, the third reflections
+    RowProxy& d = iter < 2 ? data : data2;
+    if (iter == 1)
+      for (size_t i = 3; i < d.v.size(); i += 5)
+        d.v[i] *= 0.5;
+    Grid<float> expected = transform_f_phi_to_map<float>(d, 3, 4, size, 0.,
+                                                         true, 1);
+    FPhiGrid<float>& hkl = ws.set_f_phi(d, 3, 4, size);
+    FPhiGrid<float> ref = get_f_phi_on_grid<float>(d, 3, 4, size, true);
+    CHECK_NEAR(max_abs_diff(hkl.data, ref.data), 0., 1e-5);
+    Grid<float>& map = ws.f_phi_to_map();
+    CHECK(map.nu == size[0] && map.nv == size[1] && map.nw == size[2]);
+    CHECK_NEAR(max_abs_diff(map.data, expected.data), 0., 1e-5);
+    FPhiGrid<float>& back = ws.map_to_f_phi();
+    FPhiGrid<float> ref_back = transform_map_to_f_phi(expected, true, 1);
+    CHECK_NEAR(max_abs_diff(back.data, ref_back.data), 0., 1e-4);
+  }
+  // the memory of the buffers is reused
+  const float* map_ptr = ws.map.data.data();
+  ws.set_f_phi(data, 3, 4, size);
+  ws.f_phi_to_map();
+  CHECK(ws.map.data.data() == map_ptr);
+}
+
+static void test_batched() {
+  const std::array<int, 3> size = {{16, 18, 20}};
+  RowProxy data = random_reflections("P 1 21 1", 6, 4);
+  for (AxisOrder order : {AxisOrder::XYZ, AxisOrder::ZYX})
+    for (bool half_l : {true, false}) {
+      std::vector<FPhiGrid<float>> hkls;
+      for (int i = 0; i != 3; ++i) {
+        for (size_t j = 3; j < data.v.size(); j += 5)
+          data.v[j] *= 0.9;
+        hkls.push_back(get_f_phi_on_grid<float>(data, 3, 4, size, half_l,
+                                                order));
+      }
+      std::vector<Grid<float>> expected;
+      for (const FPhiGrid<float>& hkl : hkls)
+        expected.push_back(transform_f_phi_grid_to_map(FPhiGrid<float>(hkl)));
+      std::vector<Grid<float>> maps =
+        transform_f_phi_grids_to_maps(std::move(hkls), 2);
+      CHECK(maps.size() == 3);
+      for (size_t i = 0; i != maps.size(); ++i) {
+        CHECK(maps[i].nu == expected[i].nu && maps[i].nv == expected[i].nv &&
+              maps[i].nw == expected[i].nw);
+        CHECK_NEAR(max_abs_diff(maps[i].data, expected[i].data), 0., 1e-5);
+      }
+    }
+  // datasets with different cells (and space groups) of the same grid size
+  {
+    RowProxy data2 = random_reflections("P 1", 6, 5);
+    data2.cell = UnitCell(22, 23.5, 31, 90, 90, 90);
+    std::vector<FPhiGrid<float>> hkls;
+    hkls.push_back(get_f_phi_on_grid<float>(data, 3, 4, size, true));
+    hkls.push_back(get_f_phi_on_grid<float>(data2, 3, 4, size, true));
+    std::vector<Grid<float>> expected;
+    for (const FPhiGrid<float>& hkl : hkls)
+      expected.push_back(transform_f_phi_grid_to_map(FPhiGrid<float>(hkl)));
+    std::vector<Grid<float>> maps =
+      transform_f_phi_grids_to_maps(std::move(hkls), 2);
+    for (size_t i = 0; i != 2; ++i) {
+      CHECK(maps[i].spacegroup == expected[i].spacegroup);
+      CHECK(maps[i].unit_cell == expected[i].unit_cell);
+      CHECK_NEAR(max_abs_diff(maps[i].data, expected[i].data), 0., 1e-5);
+    }
+    CHECK(maps[1].spacegroup == data2.sg);
+    CHECK_NEAR(maps[1].unit_cell.c, 31, 1e-9);
+  }
+  std::vector<FPhiGrid<float>> hkls(2);
+  hkls[0] = get_f_phi_on_grid<float>(data, 3, 4, size, true);
+  hkls[1] = get_f_phi_on_grid<float>(data, 3, 4, {{16, 18, 24}}, true);
+  CHECK_THROWS(transform_f_phi_grids_to_maps(std::move(hkls)));
+}
+
+static void test_expansion() {
+  const std::array<int, 3> size = {{16, 18, 20}};
+  for (const char* hm : {"P 1", "P 1 21 1", "P 21 21 21", "P 4 21 2"}) {
+    RowProxy data = random_reflections(hm, 5, 5);
+    // duplicates and symmetry mates: the first one with F > 0 wins
+    const double extra[4][5] = {{1, 2, 3, 0, 30}, {1, 2, 3, 4, 40},
+                                {-1, 2, -3, 5, 50}, {2, 1, -3, 6, 60}};
+    data.v.insert(data.v.begin(), {1, 2, 3, 0, 10});
+    for (const double* row : extra)
+      data.v.insert(data.v.end(), row, row + 5);
+    data.v[5 * 7 + 3] = 0;
+    HklExpansion<float> expansion;
+    expansion.build(data, size, true, AxisOrder::XYZ, 2);
+    CHECK(expansion.matches(data, size, true, AxisOrder::XYZ));
+    FPhiGrid<float> hkl;
+    expansion.fill_f_phi(hkl, data, 3, 4, 2);
+    FPhiGrid<float> ref = serial_fill(data, 4, size, true, AxisOrder::XYZ);
+    CHECK_NEAR(max_abs_diff(hkl.data, ref.data), 0., 1e-5);
+    ReciprocalGrid<float> values;
+    expansion.fill_values(values, data, 3, 2);
+    FPhiGrid<float> ref_values = serial_fill(data, 0, size, true,
+                                             AxisOrder::XYZ);
+    double max_diff = 0;
+    for (size_t i = 0; i != values.data.size(); ++i)
+      max_diff = std::max(max_diff, (double) std::abs(values.data[i] -
+                                                      ref_values.data[i]));
+    CHECK_NEAR(max_diff, 0., 1e-6);
+    // the one-off functions use the same expansion
+    for (bool half_l : {true, false})
+      for (AxisOrder order : {AxisOrder::XYZ, AxisOrder::ZYX}) {
+        FPhiGrid<float> grid = get_f_phi_on_grid<float>(data, 3, 4, size,
+                                                        half_l, order, 3);
+        ref = serial_fill(data, 4, size, half_l, order);
+        CHECK(grid.nu == ref.nu && grid.nw == ref.nw);
+        CHECK_NEAR(max_abs_diff(grid.data, ref.data), 0., 1e-5);
+      }
+    ReciprocalGrid<float> grid_values =
+      get_value_on_grid<float>(data, 3, size, true, AxisOrder::XYZ, 3);
+    CHECK(grid_values.data == values.data);
+    data.v[0] = 0;
+    CHECK(!expansion.matches(data, size, true, AxisOrder::XYZ));
+    CHECK_THROWS(expansion.fill_f_phi(hkl, data, 3, 4));
+  }
+  // (1,2,3) with F=0 does not take the grid point, which is then filled
+  // from the next reflection (as in get_f_phi_on_grid), and the same
+  // expansion gives the first reflection when its F is set
+  RowProxy data;
+  data.sg = find_spacegroup_by_name("P 1 21 1");
+  data.cell = UnitCell(21, 24, 30, 90, 100, 90);
+  data.v = {1, 2, 3, 0, 10,  -1, 2, -3, 4, 40,  1, 2, 3, 5, 50};
+  HklExpansion<float> expansion;
+  expansion.build(data, size, true, AxisOrder::XYZ);
+  FPhiGrid<float> hkl;
+  expansion.fill_f_phi(hkl, data, 3, 4);
+  CHECK_NEAR(std::abs(hkl.get_value(1, 2, 3)), 4., 1e-5);
+  CHECK_NEAR(std::abs(hkl.get_value(1, -2, 3)), 4., 1e-5);
+  data.v[3] = 9;
+  expansion.fill_f_phi(hkl, data, 3, 4);
+  CHECK_NEAR(std::abs(hkl.get_value(1, 2, 3)), 9., 1e-5);
+  CHECK_NEAR(std::abs(hkl.get_value(1, -2, 3)), 9., 1e-5);
+}
+
+static void test_asu_output() {
+  for (const char* hm : {"P 1", "P 1 21 1", "C 1 2 1", "P 21 21 21"}) {
+    Grid<float> map = random_map(16, 20, 18, 6);
+    map.spacegroup = find_spacegroup_by_name(hm);
+    map.set_unit_cell(21, 24, 30, 90, hm[2] == '1' ? 95 : 90, 90);
+    map.symmetrize_max();
+    const double dmin = 3.5;
+    AsuFPhiData<float> asu = transform_map_to_f_phi_asu(map, dmin, 3);
+    CHECK(asu.f.size() == asu.hkl.size() && asu.phi.size() == asu.hkl.size());
+    // reference: full grid, filtered
+    FPhiGrid<float> full = transform_map_to_f_phi(map, false, 1);
+    HklAsuChecker checker(map.spacegroup);
+    GroupOps gops = map.spacegroup->operations();
+    std::map<Miller, std::complex<float>> expected;
+    double max_absent = 0;
+    for (int l = -8; l <= 8; ++l)
+      for (int k = -9; k <= 9; ++k)
+        for (int h = -7; h <= 7; ++h) {
+          Miller m = {{h, k, l}};
+          if (map.unit_cell.calculate_d(m) < dmin || !checker.is_in(h, k, l))
+            continue;
+          std::complex<float> value = full.get_value(h, k, l);
+          if (gops.is_systematically_absent(m))
+            max_absent = std::max(max_absent, (double) std::abs(value));
+          else
+            expected.emplace(m, value);
+        }
+    CHECK_NEAR(max_absent, 0., 1e-4);
+    CHECK(asu.hkl.size() == expected.size());
+    double max_diff = 0;
+    for (size_t i = 0; i != asu.hkl.size(); ++i) {
+      auto it = expected.find(asu.hkl[i]);
+      if (it == expected.end()) {
+        CHECK(!"unexpected reflection");
+        continue;
+      }
+      std::complex<float> value = std::polar(asu.f[i],
+                                             (float) rad(asu.phi[i]));
+      max_diff = std::max(max_diff, (double) std::abs(value - it->second));
+      expected.erase(it);
+    }
+    CHECK(expected.empty());
+    CHECK_NEAR(max_diff, 0., 1e-3);
+  }
+  Grid<float> map = random_map(8, 8, 8, 7);
+  CHECK_THROWS(transform_map_to_f_phi_asu(map, 0.));
+  CHECK_THROWS(transform_map_to_f_phi_asu(map, -2.));
+}
+
+template<typename A, typename B>
+static double relative_rms_diff(const std::vector<A>& a,
+                                const std::vector<B>& ref) {
+  double sum_d2 = 0, sum_x2 = 0;
+  for (size_t i = 0; i != a.size(); ++i) {
+    sum_d2 += std::norm(B(a[i]) - ref[i]);
+    sum_x2 += std::norm(ref[i]);
+  }
+  return std::sqrt(sum_d2 / sum_x2);
+}
+
+// the error of float transforms is within the bound documented in
+// fourier.hpp (relative rms error ~2e-7, checked here with a margin);
+// with FftPrecision::Double only the rounding to float is left
+static void test_float_error() {
+  Grid<float> map = random_map(30, 32, 36, 8);
+  Grid<double> map_d;
+  map_d.spacegroup = map.spacegroup;
+  map_d.set_unit_cell(map.unit_cell);
+  map_d.set_size(map.nu, map.nv, map.nw);
+  std::copy(map.data.begin(), map.data.end(), map_d.data.begin());
+  FPhiGrid<float> hkl = transform_map_to_f_phi(map, true);
+  FPhiGrid<double> hkl_d = transform_map_to_f_phi(map_d, true);
+  double err = relative_rms_diff(hkl.data, hkl_d.data);
+  CHECK(err < 1e-6);
+  FPhiGrid<float> hkl2 = transform_map_to_f_phi(map, true, 2,
+                                                FftPrecision::Double);
+  CHECK(hkl2.half_l && hkl2.nw == hkl.nw && hkl2.unit_cell == hkl.unit_cell);
+  CHECK(relative_rms_diff(hkl2.data, hkl_d.data) < 0.5 * err);
+
+  Grid<float> back = transform_f_phi_grid_to_map(std::move(hkl));
+  err = relative_rms_diff(back.data, map_d.data);
+  CHECK(err < 1e-6);
+  FftWorkspace<float> ws(2);
+  ws.precision = FftPrecision::Double;
+  ws.hkl = hkl2;
+  Grid<float>& back2 = ws.f_phi_to_map();
+  CHECK(back2.nw == map.nw && back2.spacing[2] == map.spacing[2]);
+  CHECK(relative_rms_diff(back2.data, map_d.data) < 0.5 * err);
+}
+
+int main() {
+  RUN_TEST(test_threads);
+  RUN_TEST(test_workspace);
+  RUN_TEST(test_batched);
+  RUN_TEST(test_expansion);
+  RUN_TEST(test_asu_output);
+  RUN_TEST(test_float_error);
+  return check::result("fft");
+}
@@ -0,0 +1,157 @@
+// Tests of GridStorage, GridView and map_grid_data().
+
+#include <cstdio>
+#include <vector>
+#include <gemmi/grid.hpp>
+#include <gemmi/mmap.hpp>
+#include <gemmi/peaks.hpp>     // for find_peaks
+#include <gemmi/resample.hpp>  // for resample
+#include <gemmi/symmetry.hpp>  // for find_spacegroup_by_name
+#include "check.hpp"
+
+using namespace gemmi;
+
+static void test_storage_copy() {
+  std::vector<float> external = {1.f, 2.f, 3.f, 4.f};
+  GridStorage<float> borrowed;
+  borrowed.borrow(external.data(), external.size());
+  CHECK(!borrowed.is_owned());
+  // copies are deep
+  GridStorage<float> copy = borrowed;
+  CHECK(copy.is_owned());
+  CHECK(copy.size() == 4);
+  copy[0] = 10.f;
+  CHECK(external[0] == 1.f);
+  // share() aliases
+  GridStorage<float> shared = borrowed.share();
+  CHECK(!shared.is_owned());
+  shared[1] = 20.f;
+  CHECK(external[1] == 20.f);
+  // moves keep the memory
+  GridStorage<float> moved = std::move(shared);
+  CHECK(moved.data() == external.data());
+  CHECK(shared.empty());
+  CHECK_THROWS(borrowed.resize(5));
+  borrowed.resize(4);  // same size is fine
+  borrowed.clear();
+  CHECK(borrowed.is_owned() && borrowed.empty());
+}
+
+static void test_view() {
+  Grid<float> grid;
+  grid.spacegroup = find_spacegroup_by_name("P 1");
+  grid.set_unit_cell(10, 11, 12, 90, 90, 90);
+  grid.set_size(4, 5, 6);
+  for (size_t i = 0; i != grid.data.size(); ++i)
+    grid.data[i] = (float) i;
+  GridView<float> view = GridView<float>::of(grid);
+  CHECK(view.data.data() == grid.data.data());
+  CHECK(view.point_count() == 120);
+  CHECK(view.get_value(1, 2, 3) == grid.get_value(1, 2, 3));
+  CHECK(view.get_value(-1, 7, 6) == grid.get_value(-1, 7, 6));
+  GridView<float> copy = view;
+  CHECK(copy.data.data() != grid.data.data());
+  Grid<float> back = view.to_grid();
+  CHECK(back.data == grid.data);
+  CHECK(back.nu == 4 && back.nv == 5 && back.nw == 6);
+  CHECK(back.axis_order == AxisOrder::XYZ);
+  for (int i = 0; i != 3; ++i)
+    CHECK_NEAR(back.spacing[i], grid.spacing[i], 1e-12);
+  CHECK_NEAR(back.spacing[2], 2., 1e-12);
+}
+
+static void test_map_grid_data() {
+  const char* path = "test_gridview.tmp";
+  const size_t offset = 100;
+  std::vector<float> values(3 * 4 * 5);
+  for (size_t i = 0; i != values.size(); ++i)
+    values[i] = 0.5f * i;
+  {
+    FILE* f = std::fopen(path, "wb");
+    std::vector<char> header(offset, 'x');
+    std::fwrite(header.data(), 1, offset, f);
+    std::fwrite(values.data(), sizeof(float), values.size(), f);
+    std::fclose(f);
+  }
+  GridView<float> view;
+  view.nu = 3;
+  view.nv = 4;
+  view.nw = 5;
+  map_grid_data(view, path, offset, MapAccess::ReadOnly);
+  CHECK(view.read_only);
+  CHECK(!view.data.is_owned());
+  CHECK(std::equal(values.begin(), values.end(), view.data.begin()));
+  {
+    GridView<float> cow;
+    cow.nu = 3;
+    cow.nv = 4;
+    cow.nw = 5;
+    map_grid_data(cow, path, offset, MapAccess::CopyOnWrite);
+    CHECK(!cow.read_only);
+    cow.data[7] = -1.f;
+    CHECK(view.data[7] == values[7]);  // not written to the file
+  }
+  GridView<float> big;
+  big.nu = big.nv = big.nw = 100;
+  CHECK_THROWS(map_grid_data(big, path, offset));
+  std::remove(path);
+}
+
+// find_peaks() and resample() read a view of a memory-mapped file
+// and give the same results as for a Grid
+static void test_algorithms_on_view() {
+  const char* path = "test_gridview2.tmp";
+  Grid<float> grid;
+  grid.spacegroup = find_spacegroup_by_name("P 1 21 1");
+  grid.set_unit_cell(20, 22, 24, 90, 100, 90);
+  grid.set_size(20, 22, 24);
+  for (int w = 0; w != grid.nw; ++w)
+    for (int v = 0; v != grid.nv; ++v)
+      for (int u = 0; u != grid.nu; ++u)
+        grid.data[grid.index_q(u, v, w)] =
+          std::sin(0.6f * u) * std::cos(0.5f * v) + std::sin(0.3f * w);
+  grid.symmetrize_max();
+  {
+    FILE* f = std::fopen(path, "wb");
+    std::fwrite(grid.data.data(), sizeof(float), grid.data.size(), f);
+    std::fclose(f);
+  }
+  GridView<float> view;
+  view.copy_metadata_from(grid);
+  map_grid_data(view, path, 0, MapAccess::ReadOnly);
+  CHECK(!view.data.is_owned());
+  CHECK_NEAR(view.spacing[1], grid.spacing[1], 1e-12);
+  const Position pos(3.3, -7.1, 15.2);
+  CHECK(view.interpolate_value(pos) == grid.interpolate_value(pos));
+
+  std::vector<Peak> expected = find_peaks(grid, 0.5, 0, 2.0, 2);
+  std::vector<Peak> peaks = find_peaks(view, 0.5, 0, 2.0, 2);
+  CHECK(!expected.empty());
+  CHECK(peaks.size() == expected.size());
+  bool same_peaks = peaks.size() == expected.size();
+  for (size_t i = 0; same_peaks && i != peaks.size(); ++i)
+    same_peaks = peaks[i].value == expected[i].value &&
+                 peaks[i].u == expected[i].u && peaks[i].v == expected[i].v &&
+                 peaks[i].w == expected[i].w;
+  CHECK(same_peaks);
+
+  Grid<float> dst, expected_dst;
+  dst.set_unit_cell(15, 16, 17, 90, 90, 90);
+  dst.set_size(10, 12, 14);
+  expected_dst = dst;
+  Transform tr;
+  tr.vec = Vec3(1.5, -2, 3);
+  resample(grid, expected_dst, tr, 2);
+  resample(view, dst, tr, 2);
+  CHECK(dst.data == expected_dst.data);
+  view.data.clear();  // unmaps the file
+  std::remove(path);
+}
+
+int main() {
+  RUN_TEST(test_storage_copy);
+  RUN_TEST(test_view);
+  RUN_TEST(test_map_grid_data);
+  RUN_TEST(test_algorithms_on_view);
+  return check::result("gridview");
+}
@@ -0,0 +1,164 @@
+// Tests of random access to and parallel decompression of gz files
+// (gzindex.hpp).
+
+#include <cstdio>   // for remove
+#include <random>
+#include <gemmi/gzindex.hpp>
+#include "check.hpp"
+
+using namespace gemmi;
+
+static std::vector<unsigned char> random_bytes(size_t n, unsigned seed) {
+  std::mt19937 rng(seed);
+  std::vector<unsigned char> data(n);
+  // half random, half repeated, to be compressed to about half
+  for (size_t i = 0; i != n; ++i)
+    data[i] = i % 64 < 32 ? (unsigned char) rng() : (unsigned char) (i % 7);
+  return data;
+}
+
+// gzip member padded (with a comment in the header) to exactly size bytes
+static std::vector<unsigned char>
+gzip_member_of_size(const std::vector<unsigned char>& data, size_t size) {
+  std::vector<unsigned char> deflated(compressBound((uLong) data.size()));
+  z_stream strm;
+  std::memset(&strm, 0, sizeof(strm));
+  deflateInit2(&strm, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+  strm.next_in = const_cast<unsigned char*>(data.data());
+  strm.avail_in = (uInt) data.size();
+  strm.next_out = deflated.data();
+  strm.avail_out = (uInt) deflated.size();
+  deflate(&strm, Z_FINISH);
+  deflated.resize(deflated.size() - strm.avail_out);
+  deflateEnd(&strm);
+  // header (10) + comment + NUL + deflated + CRC32 and ISIZE (8)
+  size_t comment = size - 19 - deflated.size();
+  std::vector<unsigned char> out = {0x1f, 0x8b, 8, 0x10, 0, 0, 0, 0, 0, 255};
+  out.insert(out.end(), comment, 'x');
+  out.push_back(0);
+  out.insert(out.end(), deflated.begin(), deflated.end());
+  impl::write_le(out, crc32(0, data.data(), (uInt) data.size()), 4);
+  impl::write_le(out, data.size(), 4);
+  CHECK(out.size() == size);
+  return out;
+}
+
+static void write_file(const char* path, const std::vector<unsigned char>& v) {
+  FILE* f = std::fopen(path, "wb");
+  std::fwrite(v.data(), 1, v.size(), f);
+  std::fclose(f);
+}
+
+// The first member ends just before, at, or after the end of the first
+// chunk read from the file (impl::gz_chunk_size), so that 1, 0 or 2 bytes
+// of the next member are left in the input buffer.
+static void test_member_boundary() {
+  const char* path = "test_gzindex.tmp.gz";
+  for (size_t size : {impl::gz_chunk_size - 2, impl::gz_chunk_size - 1,
+                      impl::gz_chunk_size, impl::gz_chunk_size + 1}) {
+    std::vector<unsigned char> data = random_bytes(90000, 1);
+    std::vector<unsigned char> second = random_bytes(50000, 2);
+    std::vector<unsigned char> gz = gzip_member_of_size(data, size);
+    std::vector<unsigned char> m2 = impl::gzip_member(second.data(),
+                                                      second.size(), 6);
+    gz.insert(gz.end(), m2.begin(), m2.end());
+    data.insert(data.end(), second.begin(), second.end());
+    write_file(path, gz);
+
+    GzIndex index = build_gz_index(path, 16384);
+    CHECK(index.uncompressed_size == data.size());
+    CHECK(index.points.size() > 2 && index.points[0].member_start);
+    size_t n_members = 0;
+    for (const GzAccessPoint& p : index.points)
+      n_members += p.member_start;
+    CHECK(n_members == 2);
+
+    // scan_gz() (no index cached, no sizes of members in the headers)
+    size_t out_size = 0;
+    std::unique_ptr<char[]> out = decompress_gz_file(path, out_size, 1,
+                                                     false);
+    CHECK(out_size == data.size() &&
+          std::memcmp(out.get(), data.data(), data.size()) == 0);
+
+    // GzIndexedStream, read in one go from the start and in parts
+    GzIndexedStream stream(index);
+    std::vector<unsigned char> buf(data.size());
+    CHECK(stream.read(buf.data(), buf.size()));
+    CHECK(buf == data);
+    for (size_t start : {(size_t) 0, (size_t) 85000, (size_t) 89990}) {
+      std::vector<unsigned char> part(100);
+      CHECK(stream.seek(start) && stream.read(part.data(), part.size()));
+      CHECK(std::equal(part.begin(), part.end(), data.begin() + start));
+    }
+  }
+  std::remove(path);
+}
+
+static void test_cache() {
+  const char* path = "test_gzindex2.tmp.gz";
+  std::vector<unsigned char> data = random_bytes(300000, 3);
+  write_file(path, impl::gzip_member(data.data(), data.size(), 6));
+  std::string idx_path = gz_index_path(path);
+  std::remove(idx_path.c_str());
+  GzIndex index = get_gz_index(path, 32768);
+  GzIndex cached;
+  CHECK(read_gz_index(idx_path, path, cached));
+  CHECK(cached.points.size() == index.points.size());
+  CHECK(cached.uncompressed_size == data.size());
+  // the spans between access points are decompressed in parallel
+  size_t out_size = 0;
+  std::unique_ptr<char[]> out = decompress_gz_file(path, out_size, 3);
+  CHECK(out_size == data.size() &&
+        std::memcmp(out.get(), data.data(), data.size()) == 0);
+  // (get_gz_index() ignores this error)
+  CHECK_THROWS(write_gz_index(index, "no_such_dir/x.gzidx"));
+  std::remove(idx_path.c_str());
+
+  // files written in parallel are also decompressed in parallel
+  write_gz_parallel(path, data.data(), data.size(), 6, 3, 40000);
+  out = decompress_gz_file(path, out_size, 3, false);
+  CHECK(out_size == data.size() &&
+        std::memcmp(out.get(), data.data(), data.size()) == 0);
+  std::remove(path);
+}
+
+// A file written in parallel followed by a member without the size
+// in the header (as from cat parallel.gz plain.gz) is not truncated.
+static void test_mixed_members() {
+  const char* path = "test_gzindex3.tmp.gz";
+  const char* plain_path = "test_gzindex4.tmp.gz";
+  std::vector<unsigned char> data = random_bytes(200000, 4);
+  std::vector<unsigned char> second = random_bytes(70000, 5);
+  write_gz_parallel(path, data.data(), data.size(), 6, 2, 40000);
+  gzFile gz = gzopen(plain_path, "wb");
+  gzwrite(gz, second.data(), (unsigned) second.size());
+  gzclose(gz);
+  std::vector<unsigned char> bytes;
+  for (const char* p : {path, plain_path}) {
+    FILE* f = std::fopen(p, "rb");
+    unsigned char buf[4096];
+    size_t n;
+    while ((n = std::fread(buf, 1, sizeof buf, f)) != 0)
+      bytes.insert(bytes.end(), buf, buf + n);
+    std::fclose(f);
+  }
+  write_file(path, bytes);
+  data.insert(data.end(), second.begin(), second.end());
+  for (bool use_cache : {false, true}) {
+    size_t out_size = 0;
+    std::unique_ptr<char[]> out = decompress_gz_file(path, out_size, 2,
+                                                     use_cache);
+    CHECK(out_size == data.size() &&
+          std::memcmp(out.get(), data.data(), data.size()) == 0);
+  }
+  std::remove(gz_index_path(path).c_str());
+  std::remove(path);
+  std::remove(plain_path);
+}
+
+int main() {
+  RUN_TEST(test_member_boundary);
+  RUN_TEST(test_cache);
+  RUN_TEST(test_mixed_members);
+  return check::result("gzindex");
+}
@@ -0,0 +1,275 @@
+// Tests of scanning headers of maps and MTZ files and of the header index
+// (headerscan.hpp).
+
+#define GEMMI_WRITE_IMPLEMENTATION  // for Mtz::write_to_file
+#include <cstdio>   // for remove
+#include <random>
+#include <gemmi/headerscan.hpp>
+#include <gemmi/symmetry.hpp>  // for find_spacegroup_by_name
+#include "check.hpp"
+#ifdef _WIN32
+# include <direct.h>    // for _mkdir, _rmdir
+# define mkdir(path, mode) _mkdir(path)
+# define rmdir _rmdir
+#else
+# include <sys/stat.h>  // for mkdir
+# include <unistd.h>    // for rmdir
+#endif
+
+using namespace gemmi;
+
+static const char* dir = "test_headerscan.tmp.d";
+static const char* subdir = "test_headerscan.tmp.d/sub";
+static const char* index_path = "test_headerscan.tmp.d/index.hdx";
+static const std::string map_path = std::string(dir) + "/a.map";
+static const std::string mtz_path = std::string(dir) + "/c.mtz";
+static const std::string bad_path = std::string(dir) + "/d.mrc";
+static const std::string txt_path = std::string(dir) + "/e.txt";
+static const std::string gz_map_path = std::string(subdir) + "/b.ccp4.gz";
+static const std::string gz_mtz_path = std::string(subdir) + "/f.mtz.gz";
+
+static Ccp4<float> random_map(int nu, int nv, int nw, unsigned seed) {
+  Ccp4<float> map;
+  map.grid.spacegroup = find_spacegroup_by_name("P 21 21 21");
+  map.grid.set_unit_cell(20, 22, 24, 90, 90, 90);
+  map.grid.set_size(nu, nv, nw);
+  std::mt19937 rng(seed);
+  std::normal_distribution<float> normal;
+  for (float& x : map.grid.data)
+    x = normal(rng);
+  map.update_ccp4_header(2, true);
+  return map;
+}
+
+// reflections with d = 30, 20 and 10 A
+static void write_mtz(const std::string& path) {
+  Mtz mtz;
+  mtz.spacegroup = find_spacegroup_by_name("P 1 21 1");
+  mtz.cell.set(30, 40, 50, 90, 90, 90);
+  mtz.add_dataset("HKL_base");
+  mtz.add_column("H", 'H');
+  mtz.add_column("K", 'H');
+  mtz.add_column("L", 'H');
+  mtz.add_dataset("native");
+  mtz.add_column("FP", 'F');
+  mtz.add_column("SIGFP", 'Q');
+  const float data[] = {1, 0, 0, 10.f, 1.f,
+                        0, 2, 0, 20.f, 2.f,
+                        0, 0, 5, 30.f, 3.f};
+  mtz.set_data(data, 15);
+  mtz.write_to_file(path);
+}
+
+static std::vector<char> read_bytes(const std::string& path) {
+  std::vector<char> bytes;
+  FILE* f = std::fopen(path.c_str(), "rb");
+  char buf[4096];
+  size_t n;
+  while (f && (n = std::fread(buf, 1, sizeof buf, f)) != 0)
+    bytes.insert(bytes.end(), buf, buf + n);
+  if (f)
+    std::fclose(f);
+  return bytes;
+}
+
+static void write_bytes(const std::string& path,
+                        const std::vector<char>& bytes) {
+  FILE* f = std::fopen(path.c_str(), "wb");
+  std::fwrite(bytes.data(), 1, bytes.size(), f);
+  std::fclose(f);
+}
+
+static void write_gz(const std::string& path, const std::vector<char>& bytes) {
+  gzFile f = gzopen(path.c_str(), "wb");
+  gzwrite(f, bytes.data(), (unsigned) bytes.size());
+  gzclose(f);
+}
+
+static void make_files() {
+  mkdir(dir, 0755);
+  mkdir(subdir, 0755);
+  random_map(10, 12, 14, 1).write_ccp4_map(map_path);
+  random_map(8, 8, 16, 2).write_ccp4_map(gz_map_path);
+  write_gz(gz_map_path, read_bytes(gz_map_path));
+  write_mtz(mtz_path);
+  write_gz(gz_mtz_path, read_bytes(mtz_path));
+  write_bytes(bad_path, std::vector<char>(300, 'x'));
+  write_bytes(txt_path, std::vector<char>(10, 'x'));
+}
+
+static void remove_files() {
+  for (const std::string& path : {map_path, mtz_path, bad_path, txt_path,
+                                  gz_map_path, gz_mtz_path})
+    std::remove(path.c_str());
+  std::remove(index_path);
+  rmdir(subdir);
+  rmdir(dir);
+}
+
+// DirWalk may add a prefix ("./") to the paths
+static bool same_file(const std::string& found, const std::string& path) {
+  return ends_with(found, "/" + path) || found == path;
+}
+
+static const ScannedFile* find(const std::vector<ScannedFile>& files,
+                               const std::string& path) {
+  for (const ScannedFile& sf : files)
+    if (same_file(sf.path, path))
+      return &sf;
+  return nullptr;
+}
+
+static bool same(double a, double b) {
+  return std::isnan(a) ? std::isnan(b) : a == b;
+}
+
+static bool same_entry(const ScannedFile& a, const ScannedFile& b) {
+  return a.path == b.path && a.kind == b.kind &&
+         a.file_size == b.file_size && a.mtime == b.mtime &&
+         a.error == b.error && a.cell.a == b.cell.a &&
+         a.cell.c == b.cell.c && a.cell.beta == b.cell.beta &&
+         a.spacegroup_number == b.spacegroup_number &&
+         a.spacegroup_hm == b.spacegroup_hm && a.mode == b.mode &&
+         a.grid_size == b.grid_size && a.map_size == b.map_size &&
+         a.map_start == b.map_start && same(a.stats.dmin, b.stats.dmin) &&
+         same(a.stats.dmax, b.stats.dmax) &&
+         same(a.stats.dmean, b.stats.dmean) &&
+         same(a.stats.rms, b.stats.rms) &&
+         a.nreflections == b.nreflections &&
+         same(a.resolution_high, b.resolution_high) &&
+         same(a.resolution_low, b.resolution_low) &&
+         a.column_labels == b.column_labels &&
+         a.column_types == b.column_types;
+}
+
+static void test_scan() {
+  std::vector<ScannedFile> files = scan_file_headers(dir, 3);
+  CHECK(files.size() == 5);  // e.txt is not scanned
+
+  const ScannedFile* map = find(files, map_path);
+  CHECK(map && map->kind == ScannedFileKind::Map && map->error.empty());
+  if (map) {
+    Ccp4<float> orig;
+    orig.read_ccp4_file(map_path);
+    CHECK(map->file_size == read_bytes(map_path).size());
+    CHECK(map->mtime > 0);
+    CHECK(map->mode == 2);
+    CHECK(map->spacegroup_number == 19);
+    CHECK(map->spacegroup_hm == "P 21 21 21");
+    CHECK_NEAR(map->cell.b, 22, 1e-6);
+    CHECK((map->grid_size == std::array<int, 3>{{10, 12, 14}}));
+    CHECK((map->map_size == std::array<int, 3>{{10, 12, 14}}));
+    CHECK((map->map_start == std::array<int, 3>{{0, 0, 0}}));
+    CHECK_NEAR(map->stats.dmax, orig.hstats.dmax, 0);
+    CHECK_NEAR(map->stats.rms, orig.hstats.rms, 0);
+    CHECK(std::isnan(map->resolution_high));
+    CHECK(map->column_labels.empty());
+  }
+
+  const ScannedFile* gz_map = find(files, gz_map_path);
+  CHECK(gz_map && gz_map->error.empty());
+  if (gz_map) {
+    // the size of the compressed file
+    CHECK(gz_map->file_size == read_bytes(gz_map_path).size());
+    CHECK((gz_map->grid_size == std::array<int, 3>{{8, 8, 16}}));
+    CHECK(gz_map->stats.rms > 0.5);
+  }
+
+  for (const std::string& path : {mtz_path, gz_mtz_path}) {
+    const ScannedFile* mtz = find(files, path);
+    CHECK(mtz && mtz->kind == ScannedFileKind::Mtz && mtz->error.empty());
+    if (!mtz)
+      continue;
+    CHECK(mtz->spacegroup_number == 4);
+    CHECK(mtz->spacegroup_hm == "P 1 21 1");
+    CHECK_NEAR(mtz->cell.c, 50, 1e-4);
+    CHECK(mtz->nreflections == 3);
+    CHECK_NEAR(mtz->resolution_high, 10, 1e-6);
+    CHECK_NEAR(mtz->resolution_low, 30, 1e-6);
+    CHECK((mtz->column_labels ==
+           std::vector<std::string>{"H", "K", "L", "FP", "SIGFP"}));
+    CHECK(mtz->column_types == "HHHFQ");
+    CHECK(mtz->mode == -1);
+  }
+
+  const ScannedFile* bad = find(files, bad_path);
+  CHECK(bad && bad->kind == ScannedFileKind::Map && !bad->error.empty());
+  CHECK(!scan_file_header(std::string(dir) + "/none.map").error.empty());
+}
+
+static void test_index() {
+  std::vector<ScannedFile> files = scan_file_headers(dir, 2);
+  write_header_index(files, index_path);
+  std::vector<ScannedFile> read = read_header_index(index_path);
+  CHECK(read.size() == files.size());
+  bool all_same = read.size() == files.size();
+  for (size_t i = 0; all_same && i != files.size(); ++i)
+    all_same = same_entry(read[i], files[i]);
+  CHECK(all_same);
+
+  // only the index is added to the directory (no temporary files)
+  size_t n_files = 0;
+  for (const std::string& path : DirWalk<>(dir)) {
+    (void) path;
+    ++n_files;
+  }
+  CHECK(n_files == 7);
+
+  const std::vector<char> good = read_bytes(index_path);
+  std::vector<char> bytes = good;
+  bytes[0] = 'X';
+  write_bytes(index_path, bytes);
+  CHECK_THROWS(read_header_index(index_path));
+  for (size_t size : {(size_t) 10, (size_t) 100, good.size() - 1}) {
+    bytes.assign(good.begin(), good.begin() + size);
+    write_bytes(index_path, bytes);
+    CHECK_THROWS(read_header_index(index_path));
+  }
+  // number of files larger than the index
+  bytes = good;
+  bytes[19] = 1;
+  write_bytes(index_path, bytes);
+  CHECK_THROWS(read_header_index(index_path));
+  // a corrupted index is re-created
+  std::vector<ScannedFile> updated = update_header_index(index_path, dir, 2);
+  CHECK(updated.size() == 5);
+  CHECK(read_header_index(index_path).size() == 5);
+  std::remove(index_path);
+}
+
+static void test_update() {
+  std::vector<ScannedFile> files = update_header_index(index_path, dir, 2);
+  CHECK(files.size() == 5);
+  // Entries of unchanged files are taken from the index. To check that,
+  // the index is altered.
+  for (ScannedFile& sf : files)
+    sf.spacegroup_hm = "from index";
+  write_header_index(files, index_path);
+  // a.map changes size, a file is added
+  random_map(10, 12, 16, 3).write_ccp4_map(map_path);
+  const std::string new_path = std::string(subdir) + "/g.mrc";
+  random_map(6, 6, 6, 4).write_ccp4_map(new_path);
+  std::vector<ScannedFile> updated = update_header_index(index_path, dir, 2);
+  CHECK(updated.size() == 6);
+  for (const ScannedFile& sf : updated) {
+    bool rescanned = same_file(sf.path, map_path) ||
+                     same_file(sf.path, new_path) ||
+                     same_file(sf.path, bad_path);  // entries with errors
+    CHECK(rescanned == (sf.spacegroup_hm != "from index"));
+  }
+  const ScannedFile* map = find(updated, map_path);
+  CHECK(map && map->grid_size[2] == 16);
+  // entries of removed files are dropped
+  std::remove(new_path.c_str());
+  CHECK(update_header_index(index_path, dir, 2).size() == 5);
+  std::remove(index_path);
+}
+
+int main() {
+  make_files();
+  RUN_TEST(test_scan);
+  RUN_TEST(test_index);
+  RUN_TEST(test_update);
+  remove_files();
+  return check::result("headerscan");
+}
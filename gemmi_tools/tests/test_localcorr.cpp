@@ -0,0 +1,97 @@
+// Tests of local_correlation() against direct summation over the window.
+
+#include <random>
+#include <gemmi/localcorr.hpp>
+#include <gemmi/symmetry.hpp>  // for find_spacegroup_by_name
+#include "check.hpp"
+
+using namespace gemmi;
+
+static Grid<float> random_grid(unsigned seed) {
+  Grid<float> grid;
+  grid.spacegroup = find_spacegroup_by_name("P 1");
+  grid.set_unit_cell(12, 13, 14, 80, 95, 100);
+  grid.set_size(12, 12, 16);
+  std::mt19937 rng(seed);
+  std::normal_distribution<float> normal;
+  for (float& x : grid.data)
+    x = normal(rng);
+  return grid;
+}
+
+// Weighted Pearson correlation in the window around (u, v, w),
+// with all periodic images of the window points.
+static double direct_correlation(const Grid<float>& a, const Grid<float>& b,
+                                 int u, int v, int w, double radius,
+                                 WindowShape shape) {
+  double cutoff = shape == WindowShape::Sphere ? radius : 3 * radius;
+  double sw = 0, sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+  int range = 3 * a.nu;
+  for (int k = -range; k <= range; ++k)
+    for (int j = -range; j <= range; ++j)
+      for (int i = -range; i <= range; ++i) {
+        Fractional f(double(i) / a.nu, double(j) / a.nv, double(k) / a.nw);
+        double d2 = a.unit_cell.orthogonalize_difference(f).length_sq();
+        if (d2 >= cutoff * cutoff)
+          continue;
+        double wt = shape == WindowShape::Sphere ? 1.
+                    : std::exp(-d2 / (2 * radius * radius));
+        double x = a.get_value(u + i, v + j, w + k);
+        double y = b.get_value(u + i, v + j, w + k);
+        sw += wt;
+        sa += wt * x;
+        sb += wt * y;
+        saa += wt * x * x;
+        sbb += wt * y * y;
+        sab += wt * x * y;
+      }
+  double ma = sa / sw, mb = sb / sw;
+  return (sab / sw - ma * mb) /
+         std::sqrt((saa / sw - ma * ma) * (sbb / sw - mb * mb));
+}
+
+static void test_against_direct(double radius, WindowShape shape) {
+  Grid<float> a = random_grid(1);
+  Grid<float> b = random_grid(2);
+  for (size_t i = 0; i != a.data.size(); ++i)
+    b.data[i] = 0.6f * a.data[i] + b.data[i];
+  Grid<float> cc = local_correlation(a, b, radius, shape, 2);
+  const int points[3][3] = {{0, 0, 0}, {3, 7, 11}, {11, 5, 2}};
+  for (const int* p : points)
+    CHECK_NEAR(cc.get_value(p[0], p[1], p[2]),
+               direct_correlation(a, b, p[0], p[1], p[2], radius, shape),
+               1e-4);
+}
+
+static void test_windows() {
+  test_against_direct(3.0, WindowShape::Sphere);
+  test_against_direct(1.5, WindowShape::Gaussian);
+  // windows bigger than half the cell
+  test_against_direct(9.0, WindowShape::Sphere);
+  test_against_direct(4.0, WindowShape::Gaussian);
+}
+
+static void test_linear() {
+  Grid<float> a = random_grid(3);
+  Grid<float> b = a;
+  for (float& x : b.data)
+    x = -2 * x + 5;
+  Grid<float> cc = local_correlation(a, b, 2.5);
+  double max_diff = 0;
+  for (float x : cc.data)
+    max_diff = std::max(max_diff, std::fabs(x + 1.));
+  CHECK_NEAR(max_diff, 0., 1e-3);
+}
+
+static void test_errors() {
+  Grid<float> a = random_grid(4);
+  Grid<float> b;
+  CHECK_THROWS(local_correlation(a, b, 2.0));
+}
+
+int main() {
+  RUN_TEST(test_windows);
+  RUN_TEST(test_linear);
+  RUN_TEST(test_errors);
+  return check::result("localcorr");
+}
@@ -0,0 +1,127 @@
+// Tests of find_peaks().
+
+#include <random>
+#include <gemmi/peaks.hpp>
+#include <gemmi/symmetry.hpp>  // for find_spacegroup_by_name
+#include "check.hpp"
+
+using namespace gemmi;
+
+static Grid<float> make_grid(const char* sg) {
+  Grid<float> grid;
+  grid.spacegroup = find_spacegroup_by_name(sg);
+  grid.set_unit_cell(30, 32, 34, 90, 100, 90);
+  grid.set_size(60, 64, 68);
+  return grid;
+}
+
+static void add_gaussian(Grid<float>& grid, const Position& pos,
+                         double height, double sigma) {
+  grid.use_points_around(grid.unit_cell.fractionalize(pos), 4 * sigma,
+                         [&](float& point, double d2) {
+    point += float(height * std::exp(-d2 / (2 * sigma * sigma)));
+  });
+}
+
+// Reference: merging by comparing each candidate with all kept peaks.
+static std::vector<Peak> merge_brute_force(const Grid<float>& grid,
+                                           std::vector<Peak> peaks,
+                                           double merge_distance) {
+  UnitCell cell = grid.unit_cell;
+  cell.set_cell_images_from_spacegroup(grid.spacegroup);
+  std::vector<Peak> kept;
+  for (const Peak& peak : peaks) {
+    bool dup = false;
+    for (const Peak& p : kept)
+      if (cell.find_nearest_image(p.pos, peak.pos, Asu::Any).dist()
+          < merge_distance)
+        dup = true;
+    if (!dup)
+      kept.push_back(peak);
+  }
+  return kept;
+}
+
+static void test_positions() {
+  Grid<float> grid = make_grid("P 1");
+  Position pos(7.3, 11.1, 4.2);
+  add_gaussian(grid, pos, 5.0, 1.0);
+  std::vector<Peak> peaks = find_peaks(grid, 1.0, 0, 0., 2);
+  CHECK(peaks.size() == 1);
+  if (!peaks.empty()) {
+    CHECK(peaks[0].pos.dist(pos) < 0.05);
+    CHECK_NEAR(peaks[0].value, 5.0, 0.05);
+  }
+}
+
+static void test_merge(const char* sg, size_t max_count) {
+  Grid<float> grid = make_grid(sg);
+  std::mt19937 rng(5);
+  std::uniform_real_distribution<double> uni(0, 1);
+  for (int i = 0; i != 40; ++i) {
+    Position pos = grid.unit_cell.orthogonalize(
+        Fractional(uni(rng), uni(rng), uni(rng)));
+    add_gaussian(grid, pos, 1 + 5 * uni(rng), 0.7);
+    // a slightly lower peak nearby, to be merged
+    add_gaussian(grid, pos + Position(1.6, 0.4, -0.3), 1 + 4 * uni(rng), 0.7);
+  }
+  grid.symmetrize_max();
+  const double merge_distance = 2.5;
+  std::vector<Peak> all = find_peaks(grid, 0.5, 0, 0., 3);
+  std::vector<Peak> ref = merge_brute_force(grid, all, merge_distance);
+  std::vector<Peak> merged = find_peaks(grid, 0.5, 0, merge_distance, 3);
+  CHECK(merged.size() == ref.size());
+  CHECK(merged.size() < all.size());
+  // symmetry mates have the same value, so only values are compared
+  bool same = merged.size() == ref.size();
+  for (size_t i = 0; same && i != ref.size(); ++i)
+    same = merged[i].value == ref[i].value;
+  CHECK(same);
+  // max_count must give max_count peaks even if many are merged
+  std::vector<Peak> top = find_peaks(grid, 0.5, max_count, merge_distance, 1);
+  CHECK(top.size() == std::min(max_count, ref.size()));
+  for (size_t i = 0; i != top.size() && i != ref.size(); ++i)
+    CHECK_NEAR(top[i].value, ref[i].value, 1e-9);
+}
+
+static void test_merging() {
+  test_merge("P 1", 30);
+  test_merge("P 1 21 1", 10);
+  test_merge("C 1 2 1", 5);
+}
+
+// plateaus across the cell edge give one peak
+static void test_wrapped_plateau() {
+  Grid<float> grid = make_grid("P 1");
+  // two points across the u edge
+  grid.set_value(0, 10, 20, 3.f);
+  grid.set_value(grid.nu - 1, 10, 20, 3.f);
+  std::vector<Peak> peaks = find_peaks(grid, 1.0, 0, 0., 2);
+  CHECK(peaks.size() == 1);
+  if (!peaks.empty())
+    CHECK(peaks[0].u == 0 && peaks[0].v == 10 && peaks[0].w == 20);
+  // a line along w that wraps around the cell
+  grid.fill(0.f);
+  for (int w = 0; w != grid.nw; ++w)
+    grid.set_value(5, 6, w, 2.f);
+  peaks = find_peaks(grid, 1.0, 0, 0., 2);
+  CHECK(peaks.size() == 1);
+  if (!peaks.empty())
+    CHECK(peaks[0].u == 5 && peaks[0].v == 6 && peaks[0].w == 0);
+  // a plane v=const
+  grid.fill(0.f);
+  for (int w = 0; w != grid.nw; ++w)
+    for (int u = 0; u != grid.nu; ++u)
+      grid.set_value(u, 7, w, 2.f);
+  peaks = find_peaks(grid, 1.0, 0, 0., 3);
+  CHECK(peaks.size() == 1);
+  if (!peaks.empty())
+    CHECK_NEAR(peaks[0].value, 2.0, 1e-6);
+}
+
+int main() {
+  RUN_TEST(test_positions);
+  RUN_TEST(test_merging);
+  RUN_TEST(test_wrapped_plateau);
+  return check::result("peaks");
+}
@@ -0,0 +1,91 @@
+// Tests of resample() and resample_fourier().
+
+#include <gemmi/resample.hpp>
+#include <gemmi/symmetry.hpp>  // for find_spacegroup_by_name
+#include "check.hpp"
+
+using namespace gemmi;
+
+static const double pi2 = 2 * 3.14159265358979323846;
+
+// Band-limited function of fractional coordinates.
+static double wave(double x, double y, double z) {
+  return std::cos(pi2 * (x + 2 * y)) + 0.5 * std::sin(pi2 * (3 * z - y))
+         + 0.25 * std::cos(pi2 * (2 * x + z));
+}
+
+static Grid<float> make_wave_grid(int nu, int nv, int nw) {
+  Grid<float> grid;
+  grid.spacegroup = find_spacegroup_by_name("P 1");
+  grid.set_unit_cell(20, 24, 28, 80, 95, 105);
+  grid.set_size(nu, nv, nw);
+  for (int w = 0; w != nw; ++w)
+    for (int v = 0; v != nv; ++v)
+      for (int u = 0; u != nu; ++u)
+        grid.data[grid.index_q(u, v, w)] =
+          (float) wave(double(u) / nu, double(v) / nv, double(w) / nw);
+  return grid;
+}
+
+static void test_identity() {
+  Grid<float> src = make_wave_grid(12, 16, 20);
+  Grid<float> dst;
+  dst.spacegroup = src.spacegroup;
+  dst.set_unit_cell(src.unit_cell);
+  dst.set_size(12, 16, 20);
+  resample(src, dst, Transform(), 2);
+  for (size_t i = 0; i != src.data.size(); ++i)
+    CHECK_NEAR(dst.data[i], src.data[i], 1e-5);
+}
+
+// Shifting by a whole number of grid steps permutes the values.
+static void test_shift() {
+  Grid<float> src = make_wave_grid(12, 16, 20);
+  Grid<float> dst = src;
+  dst.fill(0.f);
+  Transform tr;
+  Fractional step(1. / 12, 2. / 16, -3. / 20);
+  tr.vec = src.unit_cell.orthogonalize_difference(step);
+  resample(src, dst, tr, 3);
+  double max_diff = 0;
+  for (int w = 0; w != 20; ++w)
+    for (int v = 0; v != 16; ++v)
+      for (int u = 0; u != 12; ++u)
+        max_diff = std::max(max_diff, (double) std::fabs(
+              dst.get_value(u, v, w) - src.get_value(u + 1, v + 2, w - 3)));
+  CHECK_NEAR(max_diff, 0., 1e-4);
+}
+
+// Fourier resampling of a band-limited map is exact.
+static void test_fourier() {
+  Grid<float> src = make_wave_grid(12, 16, 20);
+  Grid<float> dst = resample_fourier(src, {{18, 20, 30}}, 2);
+  CHECK(dst.nu == 18 && dst.nv == 20 && dst.nw == 30);
+  double max_diff = 0;
+  for (int w = 0; w != dst.nw; ++w)
+    for (int v = 0; v != dst.nv; ++v)
+      for (int u = 0; u != dst.nu; ++u) {
+        double expected = wave(double(u) / dst.nu, double(v) / dst.nv,
+                               double(w) / dst.nw);
+        max_diff = std::max(max_diff,
+                            std::fabs(dst.get_value(u, v, w) - expected));
+      }
+  CHECK_NEAR(max_diff, 0., 1e-4);
+}
+
+static void test_errors() {
+  Grid<float> src = make_wave_grid(12, 16, 20);
+  Grid<float> empty;
+  CHECK_THROWS(resample(src, empty));
+  src.axis_order = AxisOrder::Unknown;
+  Grid<float> dst = make_wave_grid(4, 4, 4);
+  CHECK_THROWS(resample(src, dst));
+}
+
+int main() {
+  RUN_TEST(test_identity);
+  RUN_TEST(test_shift);
+  RUN_TEST(test_fourier);
+  RUN_TEST(test_errors);
+  return check::result("resample");
+}
@@ -0,0 +1,104 @@
+// Tests of splat_atoms() and mask_atoms() against brute force.
+
+#include <random>
+#include <gemmi/splat.hpp>
+#include <gemmi/symmetry.hpp>  // for find_spacegroup_by_name
+#include "check.hpp"
+
+using namespace gemmi;
+
+// Squared distance to the nearest image of p.
+static double min_image_d2(const UnitCell& cell, const Position& a,
+                           const Position& p) {
+  Fractional fa = cell.fractionalize(a);
+  Fractional fp = cell.fractionalize(p);
+  Fractional delta = fp - fa;
+  delta = Fractional(delta.x - std::round(delta.x),
+                     delta.y - std::round(delta.y),
+                     delta.z - std::round(delta.z));
+  double best = INFINITY;
+  for (int i = -1; i <= 1; ++i)
+    for (int j = -1; j <= 1; ++j)
+      for (int k = -1; k <= 1; ++k) {
+        Fractional d(delta.x + i, delta.y + j, delta.z + k);
+        best = std::min(best, cell.orthogonalize_difference(d).length_sq());
+      }
+  return best;
+}
+
+static void test_against_brute_force() {
+  Grid<float> grid;
+  grid.spacegroup = find_spacegroup_by_name("P 1");
+  grid.set_unit_cell(18, 20, 23, 75, 100, 110);
+  grid.set_size(18, 20, 24);
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<double> uni(-30, 30);
+  std::vector<Position> positions;
+  std::vector<double> radii;
+  for (int i = 0; i != 25; ++i) {
+    positions.push_back(Position(uni(rng), uni(rng), uni(rng)));
+    radii.push_back(1.5 + 0.1 * i);
+  }
+  Grid<float> count = grid;
+  count.fill(0.f);
+  Grid<float> d2sum = count;
+  // count and d2sum have the same layout, so the offset of the point
+  // in count gives the position in d2sum
+  splat_atoms(count, positions, radii, [&](float& point, double d2, int) {
+      point += 1.f;
+      d2sum.data[&point - count.data.data()] += (float) d2;
+  }, 3);
+  Grid<float> mask = count;
+  mask.fill(0.f);
+  mask_atoms(mask, positions, radii, 1.f, 2);
+
+  int mismatches = 0;
+  double max_d2_error = 0;
+  for (int w = 0; w != grid.nw; ++w)
+    for (int v = 0; v != grid.nv; ++v)
+      for (int u = 0; u != grid.nu; ++u) {
+        Position p = grid.unit_cell.orthogonalize(
+            Fractional(double(u) / grid.nu, double(v) / grid.nv,
+                       double(w) / grid.nw));
+        int n = 0;
+        double sum = 0;
+        for (size_t i = 0; i != positions.size(); ++i) {
+          double d2 = min_image_d2(grid.unit_cell, positions[i], p);
+          // skip points that are within rounding error of the sphere
+          if (std::fabs(d2 - radii[i] * radii[i]) < 1e-6)
+            continue;
+          if (d2 < radii[i] * radii[i]) {
+            ++n;
+            sum += d2;
+          }
+        }
+        size_t idx = grid.index_q(u, v, w);
+        if (count.data[idx] != n || mask.data[idx] != (n > 0 ? 1.f : 0.f))
+          ++mismatches;
+        max_d2_error = std::max(max_d2_error,
+                                std::fabs(d2sum.data[idx] - sum));
+      }
+  CHECK(mismatches == 0);
+  CHECK_NEAR(max_d2_error, 0., 1e-3);
+}
+
+static void test_errors() {
+  Grid<float> grid;
+  std::vector<Position> positions(1);
+  std::vector<double> radii(1, 1.0);
+  CHECK_THROWS(mask_atoms(grid, positions, radii));
+  grid.spacegroup = find_spacegroup_by_name("P 1");
+  grid.set_unit_cell(10, 10, 10, 90, 90, 90);
+  grid.set_size(10, 10, 10);
+  radii.push_back(1.0);
+  CHECK_THROWS(mask_atoms(grid, positions, radii));
+  radii.resize(1);
+  radii[0] = 6.0;
+  CHECK_THROWS(mask_atoms(grid, positions, radii));
+}
+
+int main() {
+  RUN_TEST(test_against_brute_force);
+  RUN_TEST(test_errors);
+  return check::result("splat");
+}
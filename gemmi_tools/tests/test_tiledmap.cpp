@@ -0,0 +1,168 @@
+// Tests of the tiled map format (tiledmap.hpp): round trips, boxes
+// and rejection of corrupted files.
+
+#include <cstdio>   // for remove
+#include <random>
+#include <gemmi/tiledmap.hpp>
+#include <gemmi/symmetry.hpp>  // for find_spacegroup_by_name
+#include "check.hpp"
+
+using namespace gemmi;
+
+// sizes are not multiples of the tile size used in tests (8)
+static Grid<float> random_grid(unsigned seed) {
+  Grid<float> grid;
+  grid.spacegroup = find_spacegroup_by_name("P 21 21 21");
+  grid.set_unit_cell(20, 18, 13, 90, 90, 90);
+  grid.set_size_without_checking(20, 18, 13);
+  std::mt19937 rng(seed);
+  std::normal_distribution<float> normal;
+  for (float& x : grid.data)
+    x = 3 * normal(rng);
+  return grid;
+}
+
+static bool same(float a, float b) {
+  return std::isnan(a) ? std::isnan(b) : a == b;
+}
+
+static std::vector<char> read_bytes(const char* path) {
+  std::vector<char> bytes;
+  FILE* f = std::fopen(path, "rb");
+  char buf[4096];
+  size_t n;
+  while (f && (n = std::fread(buf, 1, sizeof buf, f)) != 0)
+    bytes.insert(bytes.end(), buf, buf + n);
+  if (f)
+    std::fclose(f);
+  return bytes;
+}
+
+static void write_bytes(const char* path, const std::vector<char>& bytes) {
+  FILE* f = std::fopen(path, "wb");
+  std::fwrite(bytes.data(), 1, bytes.size(), f);
+  std::fclose(f);
+}
+
+static void test_lossless() {
+  const char* path = "test_tiledmap.tmp";
+  Grid<float> grid = random_grid(1);
+  grid.data[grid.index_q(1, 2, 3)] = NAN;
+  grid.data[grid.index_q(17, 2, 3)] = INFINITY;
+  grid.data[grid.index_q(9, 17, 12)] = -INFINITY;
+  for (int n_thr : {1, 3}) {
+    write_tiled_map(grid, path, 0, 6, n_thr, 8);
+    Grid<float> back = read_tiled_map(path, n_thr);
+    CHECK(back.nu == 20 && back.nv == 18 && back.nw == 13);
+    CHECK(back.spacegroup == grid.spacegroup);
+    CHECK_NEAR(back.unit_cell.b, 18, 0);
+    bool all_same = true;
+    for (size_t i = 0; i != grid.data.size(); ++i)
+      all_same = all_same && same(back.data[i], grid.data[i]);
+    CHECK(all_same);
+  }
+  Grid<double> back = read_tiled_map<double>(path);
+  CHECK(back.data[5] == (double) grid.data[5]);
+  std::remove(path);
+}
+
+static void test_quantized() {
+  const char* path = "test_tiledmap.tmp";
+  Grid<float> grid = random_grid(2);
+  // tiles with NaN or infinity are stored losslessly
+  grid.data[grid.index_q(1, 2, 3)] = NAN;
+  grid.data[grid.index_q(17, 2, 3)] = INFINITY;
+  grid.data[grid.index_q(9, 17, 12)] = -INFINITY;
+  for (int bits : {8, 16}) {
+    write_tiled_map(grid, path, bits, 6, 2, 8);
+    TiledMapHeader header = read_tiled_map_header(path);
+    CHECK(header.tiles.size() == 3 * 3 * 2);
+    int n_float = 0;
+    for (const TileInfo& info : header.tiles)
+      if (info.encoding == TileEncoding::Float32)
+        ++n_float;
+    CHECK(n_float == 3);
+    Grid<float> back = read_tiled_map(path);
+    double max_error = 0;
+    for (size_t i = 0; i != grid.data.size(); ++i)
+      if (std::isfinite(grid.data[i]))
+        max_error = std::max(max_error,
+                             (double) std::fabs(back.data[i] - grid.data[i]));
+      else
+        CHECK(same(back.data[i], grid.data[i]));
+    // the range of values in a tile is below 40
+    CHECK(max_error < 0.5 * 40 / (bits == 8 ? 255 : 65535));
+    CHECK(max_error > 0);
+  }
+  std::remove(path);
+}
+
+static void test_box() {
+  const char* path = "test_tiledmap.tmp";
+  Grid<float> grid = random_grid(3);
+  write_tiled_map(grid, path, 0, 6, 2, 8);
+  TiledMapHeader header = read_tiled_map_header(path);
+  // wraps around the cell along each axis, the box is longer than the cell
+  std::array<int, 3> start = {{-3, 5, 11}}, size = {{15, 20, 7}};
+  std::vector<float> box = read_tiled_map_box(path, header, start, size, 2);
+  CHECK(box.size() == 15 * 20 * 7);
+  bool all_same = true;
+  for (int w = 0; w != size[2]; ++w)
+    for (int v = 0; v != size[1]; ++v)
+      for (int u = 0; u != size[0]; ++u)
+        all_same = all_same &&
+          box[(w * size[1] + v) * size[0] + u] ==
+          grid.get_value(start[0] + u, start[1] + v, start[2] + w);
+  CHECK(all_same);
+  CHECK(read_tiled_map_box(path, header, start, {{0, 4, 4}}).empty());
+  std::remove(path);
+}
+
+static void test_corrupted() {
+  const char* path = "test_tiledmap.tmp";
+  const char* bad = "test_tiledmap_bad.tmp";
+  write_tiled_map(random_grid(4), path, 8, 6, 1, 8);
+  const std::vector<char> good = read_bytes(path);
+  const size_t table = 128, entry = 24;
+  const size_t n_tiles = 3 * 3 * 2;
+  std::vector<char> bytes = good;
+  // truncated file
+  bytes.resize(good.size() - 10);
+  write_bytes(bad, bytes);
+  CHECK_THROWS(read_tiled_map_header(bad));
+  bytes.resize(table + 5 * entry);
+  write_bytes(bad, bytes);
+  CHECK_THROWS(read_tiled_map_header(bad));
+  // unknown encoding
+  bytes = good;
+  bytes[table + entry + 12] = 7;
+  write_bytes(bad, bytes);
+  CHECK_THROWS(read_tiled_map_header(bad));
+  // grid size that would need a bigger tile table
+  bytes = good;
+  bytes[16 + 3] = 0x10;  // nu = 2^28 + 20
+  write_bytes(bad, bytes);
+  CHECK_THROWS(read_tiled_map_header(bad));
+  // tile that points into the tile table
+  bytes = good;
+  bytes[table + 2 * entry] = 0;
+  bytes[table + 2 * entry + 1] = 0;
+  write_bytes(bad, bytes);
+  CHECK_THROWS(read_tiled_map_header(bad));
+  // damaged compressed data
+  bytes = good;
+  for (size_t i = table + n_tiles * entry + 10; i < good.size(); i += 7)
+    bytes[i] ^= 0x5a;
+  write_bytes(bad, bytes);
+  CHECK_THROWS(read_tiled_map(bad, 2));
+  std::remove(path);
+  std::remove(bad);
+}
+
+int main() {
+  RUN_TEST(test_lossless);
+  RUN_TEST(test_quantized);
+  RUN_TEST(test_box);
+  RUN_TEST(test_corrupted);
+  return check::result("tiledmap");
+}